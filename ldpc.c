@@ -11,11 +11,26 @@
 // was written to understand the algoritim. It has been a
 // big help for me. Maybe it will be a big help for others.
 //
+// The decoder itself is in libldpc.c (see ldpc.h). This file is the
+// interactive viewer and the batch, simulation, benchmark and
+// regression check tools built on it.
+//
 /////////////////////////////////////////////////////////////
 #include <stdio.h>
 #include <stdlib.h>
-#include <ncurses.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef NO_CURSES
+#include <ncurses.h>
+#endif
+#include "ldpc.h"
 
 // LDPC matrix
 const uint8_t matrix[4][6] = {
@@ -30,6 +45,7 @@ double initial_r[] = { -0.5, 2.50, -4.0, 5.0, -3.5, 2.5};
 
 #define N_ITERATIONS 8
 
+#ifndef NO_CURSES
 const static char *welcome_msg[] = {
   "ldpc_demo : A simple LDPC decoder",
   "",
@@ -44,32 +60,59 @@ const static char *welcome_msg[] = {
   "  Up/Down     - change the input probablilty for the current bit",
   "  Left/Right  - Select the prior or next bit for changin",
   "  PgUp/PgDown - View the different iterations of the LDPC decoder.",
+  "  M           - Change the check node algorithm",
+  "  L           - Switch between flooding and layered schedules",
+  "  < and >     - Scroll across the bits a screen at a time",
+  "  [ and ]     - Scroll through the checks a screen at a time",
+  "  S           - Switch between the messages and a summary of the solve",
   "  ESC or Q    - Quit",
   "",
   "Hope this comes in useful for somebody. If so, send me an email!",
   "",
   "Press enter to continue:"
 };
+#endif
+
+
+#ifndef NO_CURSES
+const static char *schedule_names[] = {
+   "flooding", "layered"
+};
 
-struct iteration {
-   struct iteration *next;
-   double **message_v_to_c;
-   double *l;
-   double **message_c_to_v;
-   uint8_t *codeword;
-   uint8_t *parity;
+// What the viewer shows
+enum view {
+   VIEW_MESSAGES,
+   VIEW_SUMMARY
 };
 
-struct state {
-   int cursor;
-   int page;
+#define HISTOGRAM_BINS   8
+#define VIEW_FIXED_LINES 17   // Lines of the messages view that are not check rows
+
+// The interactive viewer. The decoder is made with history, so every
+// iteration of the last solve can be paged through, and the channel
+// probabilities the keys change are kept here. Codes too big for the
+// screen are shown through a window of variable columns from first_v
+// and check rows from first_c.
+struct viewer {
+   struct state *s;
+   const struct code *code;
+   struct config config;
    int iterations;
    int n_v;
    int n_c;
+   int cursor;
+   int page;
+   int view;
+   int first_v;
+   int first_c;
    double *channel;
    double *channel_llr;
-   uint8_t **matrix;
-   struct iteration *first_iteration;
+
+   // Worked out once per solve for the summary: per iteration, the
+   // hard decisions that changed from the one before (or from the
+   // channel), and HISTOGRAM_BINS counts of |L|
+   int *flips;
+   int *histogram;
 };
 
 // Little helper functions
@@ -82,285 +125,1566 @@ static double p_to_l(double p) {
    return log(p/(1-p));
 }
 
-// A very basic display function
-static void state_display(struct state *s) {
-   int line = 0;
+
+// |L| histogram bin: [0,1), [1,2), [2,4) and so on, with the last
+// bin for everything from 64 up
+static int histogram_bin(double l) {
+   double m = fabs(l);
+   int b = 0;
+   while(b < HISTOGRAM_BINS-1 && m >= (double)(1 << b))
+      b++;
+   return b;
+}
+
+
+// Work out the summary of the last solve, once per solve rather than
+// on every redraw
+static void viewer_summarise(struct viewer *s) {
+   int iterations_used = state_iterations_used(s->s);
+   for(int it = 0; it < iterations_used; it++) {
+      const struct iteration *current = state_get_iteration(s->s, it);
+      const struct iteration *prior = it > 0 ? state_get_iteration(s->s, it-1) : NULL;
+      int *histogram = s->histogram + it*HISTOGRAM_BINS;
+      int flips = 0;
+      for(int b = 0; b < HISTOGRAM_BINS; b++) {
+         histogram[b] = 0;
+      }
+      for(int i = 0; i < s->n_v; i++) {
+         int bit  = bit_get(current->hard, code_packed_bit(s->code, i)) != 0;
+         int last = prior != NULL ? bit_get(prior->hard, code_packed_bit(s->code, i)) != 0
+                                  : s->channel_llr[i] < 0;
+         flips += bit != last;
+         histogram[histogram_bin(current->l[i])]++;
+      }
+      s->flips[it] = flips;
+   }
+}
+
+
+// Check rows shown in each block of messages, and the variable
+// columns shown across
+static int viewer_rows(const struct viewer *s) {
+   int rows = (LINES - VIEW_FIXED_LINES) / 2;
+   if(rows < 1)
+      rows = 1;
+   return rows < s->n_c ? rows : s->n_c;
+}
+
+
+static int viewer_columns(const struct viewer *s) {
+   int columns = COLS / 8;
+   if(columns < 1)
+      columns = 1;
+   return columns < s->n_v ? columns : s->n_v;
+}
+
+
+// Keep the cursor's column on the screen, and the rows in range
+static void viewer_scroll(struct viewer *s) {
+   int columns = viewer_columns(s);
+   int rows = viewer_rows(s);
+   if(s->cursor < s->first_v)
+      s->first_v = s->cursor;
+   if(s->cursor >= s->first_v + columns)
+      s->first_v = s->cursor - columns + 1;
+   if(s->first_c > s->n_c - rows)
+      s->first_c = s->n_c - rows;
+   if(s->first_c < 0)
+      s->first_c = 0;
+}
+
+
+static void display_heading(int line, int pair, const char *text) {
    move(line, 0);
-   attron(COLOR_PAIR(1));
-   printw("Channel");
+   attron(COLOR_PAIR(pair));
+   printw("%s", text);
    attron(COLOR_PAIR(2));
-   line++;
-   for(int i = 0; i < s->n_v; i++) {
-      move(line,i*8);
-      printw("%7.4f",s->channel[i]);
+}
+
+
+// A heading, with the range shown when it is not everything
+static void display_range(int line, const char *text, const char *what, int first, int n, int total) {
+   char heading[128];
+   if(n < total)
+      snprintf(heading, sizeof(heading), "%s (%s %d-%d of %d)", text, what, first, first+n-1, total);
+   else
+      snprintf(heading, sizeof(heading), "%s", text);
+   display_heading(line, 1, heading);
+}
+
+
+// One block of messages, for the rows and columns on the screen.
+// Returns the next line.
+static int display_messages(const struct viewer *s, int line, const double *messages) {
+   int rows = viewer_rows(s);
+   int columns = viewer_columns(s);
+   for(int i = 0; i < rows; i++) {
+      int c = s->first_c + i;
+      for(int e = s->code->row_start[c]; e < s->code->row_start[c+1]; e++) {
+         int v = s->code->edge_v[e] - s->first_v;
+         if(v >= 0 && v < columns) {
+            move(line+i, v*8);
+            printw("%7.4f ", messages[e]);
+         }
+      }
+   }
+   return line + rows;
+}
+
+
+// A row of n bits from 'first', two columns each
+static void display_bits(int line, const struct code *code, const uint64_t *bits, int first, int n) {
+   for(int i = 0; i < n; i++) {
+      move(line, i*2);
+      printw("%c", bit_get(bits, code_packed_bit(code, first+i)) ? '1' : '0');
    }
+}
+
+
+// The summary of the last solve: each iteration's unsatisfied checks
+// and the hard decisions that changed, and the histogram of |L| for
+// the iteration being viewed
+static void summary_display(struct viewer *s) {
+   int iterations_used = state_iterations_used(s->s);
+   int line = 0;
+   char heading[128];
+
+   snprintf(heading, sizeof(heading), "Summary: %d iterations of %d, check nodes '%s', %s",
+            iterations_used, s->iterations, check_names[s->config.check], schedule_names[s->config.schedule]);
+   display_heading(line++, 3, heading);
    line++;
+   display_heading(line++, 1, "Iteration  Unsatisfied  Flipped");
 
-   move(line, 0);
-   attron(COLOR_PAIR(1));
-   printw("Channel LLR");
-   attron(COLOR_PAIR(2));
+   // As many iterations as fit above the histogram, around the page
+   int room = LINES - line - HISTOGRAM_BINS - 3;
+   if(room < 1)
+      room = 1;
+   int first = s->page - room/2;
+   if(first > iterations_used - room)
+      first = iterations_used - room;
+   if(first < 0)
+      first = 0;
+   for(int it = first; it < iterations_used && it < first + room; it++) {
+      const struct iteration *current = state_get_iteration(s->s, it);
+      move(line++, 0);
+      printw("%c%8d  %11d  %7d", it == s->page ? '>' : ' ', it+1, current->unsatisfied, s->flips[it]);
+   }
    line++;
-   for(int i = 0; i < s->n_v; i++) {
+
+   snprintf(heading, sizeof(heading), "|L| histogram, iteration %d:", s->page+1);
+   display_heading(line++, 1, heading);
+   const int *histogram = s->histogram + s->page*HISTOGRAM_BINS;
+   int width = COLS - 24;
+   for(int b = 0; iterations_used > 0 && b < HISTOGRAM_BINS; b++) {
+      char range[16];
+      if(b == HISTOGRAM_BINS-1)
+         snprintf(range, sizeof(range), "%d+", 1 << (b-1));
+      else
+         snprintf(range, sizeof(range), "%d-%d", b ? 1 << (b-1) : 0, 1 << b);
+      move(line++, 0);
+      printw("%7s %10d ", range, histogram[b]);
+      int bar = width > 0 ? (int)((long)histogram[b] * width / s->n_v) : 0;
+      for(int i = 0; i < bar; i++) {
+         addch('#');
+      }
+   }
+   refresh();
+}
+
+
+// A very basic display function. Only what fits on the screen is
+// drawn: a window of variable columns that follows the cursor, and a
+// window of check rows that scrolls.
+static void state_display(struct viewer *s) {
+   int iterations_used = state_iterations_used(s->s);
+   int columns, line = 0;
+   char heading[128];
+
+   erase();
+   if(s->view == VIEW_SUMMARY) {
+      summary_display(s);
+      return;
+   }
+   viewer_scroll(s);
+   columns = viewer_columns(s);
+
+   display_range(line++, "Channel", "bits", s->first_v, columns, s->n_v);
+   for(int i = 0; i < columns; i++) {
       move(line,i*8);
-      printw("%7.4f ",s->channel_llr[i]);
+      printw("%7.4f",s->channel[s->first_v+i]);
    }
    line++;
 
-   struct iteration *current = s->first_iteration;
-   for(int i = 0; i < s->page; i++) {
-      if(current != NULL)
-        current = current->next;
+   display_heading(line++, 1, "Channel LLR");
+   for(int i = 0; i < columns; i++) {
+      move(line,i*8);
+      printw("%7.4f ",s->channel_llr[s->first_v+i]);
    }
+   line++;
+
+   const struct iteration *current = state_get_iteration(s->s, s->page);
 
    if(current != NULL) {
       line++;
-      move(line, 0);
-      attron(COLOR_PAIR(3));
-      printw("Iteraton %d of %d:", s->page+1, s->iterations);
-      line++;
+      snprintf(heading, sizeof(heading), "Iteraton %d of %d (max %d), check nodes '%s', %s:   ",
+               s->page+1, iterations_used, s->iterations,
+               check_names[s->config.check], schedule_names[s->config.schedule]);
+      display_heading(line++, 3, heading);
 
-      move(line, 0);
-      attron(COLOR_PAIR(1));
-      printw("Check-to-value messages:");
-      attron(COLOR_PAIR(2));
-      line++;
-      for(int i = 0; i < s->n_c; i++) {
-         for(int j = 0; j < s->n_v; j++) {
-            if(s->matrix[i][j]) {
-               move(line+i, j*8);
-               printw("%7.4f ",current->message_c_to_v[i][j]);
-            }
-         }
-      }
-      line += s->n_c;
+      display_range(line++, "Check-to-value messages:", "checks", s->first_c, viewer_rows(s), s->n_c);
+      line = display_messages(s, line, current->message_c_to_v);
 
       line++;
 
-      move(line, 0);
-      attron(COLOR_PAIR(1));
-      printw("Value-to-check messages:");
-      attron(COLOR_PAIR(2));
-      line++;
-      for(int i = 0; i < s->n_c; i++) {
-         for(int j = 0; j < s->n_v; j++) {
-            if(s->matrix[i][j]) {
-               move(line+i, j*8);
-               printw("%7.4f ",current->message_v_to_c[i][j]);
-            }
-         }
-      }
-      line += s->n_c;
+      display_heading(line++, 1, "Value-to-check messages:");
+      line = display_messages(s, line, current->message_v_to_c);
 
-      move(line, 0);
-      attron(COLOR_PAIR(1));
-      printw("L:");
-      attron(COLOR_PAIR(2));
-      line++;
-      for(int i = 0; i < s->n_v; i++) {
+      display_heading(line++, 1, "L:");
+      for(int i = 0; i < columns; i++) {
          move(line,i*8);
-         printw("%7.4f ",current->l[i]);
+         printw("%7.4f ",current->l[s->first_v+i]);
       }
-
       line++;
 
-      move(line, 0);
-      attron(COLOR_PAIR(1));
-      printw("Codeword:");
-      attron(COLOR_PAIR(2));
-      line++;
-      for(int i = 0; i < s->n_v; i++) {
-         move(line,i*2);
-         printw("%c", (current->codeword[i]) ? '1' : '0');
-      }
-      line++;
+      int n = s->n_v - s->first_v < COLS/2 ? s->n_v - s->first_v : COLS/2;
+      display_range(line++, "Codeword:", "bits", s->first_v, n, s->n_v);
+      display_bits(line++, s->code, current->hard, s->first_v, n);
 
-      move(line, 0);
-      attron(COLOR_PAIR(1));
-      printw("Parity:");
-      attron(COLOR_PAIR(2));
-      line++;
-      int valid = 1;
-      for(int i = 0; i < s->n_c; i++) {
-         move(line,i*2);
-         printw("%c", (current->parity[i]) ? '1' : '0');
-         if(current->parity[i])
-            valid = 0;
-      }
-      line++;
+      n = s->n_c - s->first_c < COLS/2 ? s->n_c - s->first_c : COLS/2;
+      display_range(line++, "Parity:", "checks", s->first_c, n, s->n_c);
+      display_bits(line++, s->code, current->syndrome, s->first_c, n);
 
       line++;
 
+      int valid = current->unsatisfied == 0;
       move(line,1);
       attron(valid ? COLOR_PAIR(5) : COLOR_PAIR(4));
       printw("=== %s ===   ", valid ? " Valid codeword " : "Invalid codeword");
       line++;
-
-      current = current->next;
    }
-   move(1,s->cursor*8+6);
+   move(1,(s->cursor-s->first_v)*8+6);
    refresh();
 }
 
 
-static void add_iteration(struct state *s) {
-   // Assumes malloc() always succeeds...
-   struct iteration *new_i = malloc(sizeof(struct iteration));
-   new_i->l                = malloc(sizeof(double)  *s->n_v);
-   new_i->message_v_to_c   = malloc(sizeof(double *)*s->n_c);
-   new_i->message_c_to_v   = malloc(sizeof(double *)*s->n_c);
-   new_i->codeword         = malloc(sizeof(uint8_t) *s->n_v);
-   new_i->parity           = malloc(sizeof(uint8_t) *s->n_c);
-   for(int i = 0; i < s->n_c; i++) { 
-      new_i->message_v_to_c[i] = malloc(sizeof(double)*s->n_v);
-      new_i->message_c_to_v[i] = malloc(sizeof(double)*s->n_v);
+// Keep the page on an iteration of the last solve
+static void viewer_clamp_page(struct viewer *s) {
+   int iterations_used = state_iterations_used(s->s);
+   if(s->page >= iterations_used)
+      s->page = iterations_used > 0 ? iterations_used-1 : 0;
+}
+
+
+// Decode from the channel probabilities
+static void viewer_solve(struct viewer *s) {
+   for(int i = 0; i < s->n_v; i++) {
+      s->channel_llr[i] = p_to_l(s->channel[i]);
    }
-   // Add to list
-   new_i->next = s->first_iteration;
-   s->first_iteration = new_i;
+   state_decode(s->s, s->channel_llr);
+   viewer_clamp_page(s);
+   viewer_summarise(s);
 }
 
 
-static struct state *state_new(int n_i) {
-   // Assumes malloc() always succeeds...
-   int n_v = sizeof(matrix[0])/sizeof(matrix[0][0]);
-   int n_c = sizeof(matrix)/sizeof(matrix[0]);
-   struct state *s = malloc(sizeof(struct state));
-   s->channel      = malloc(sizeof(double) * n_v);
-   s->channel_llr  = malloc(sizeof(double) * n_v);
-   s->matrix       = malloc(sizeof(uint8_t *) * n_c);
-   for(int i = 0; i < n_c; i++) {
-      s->matrix[i] = malloc(sizeof(uint8_t) * n_v); 
-   }
-
-   // Setting all the elements
-   s->n_v             = n_v;
-   s->n_c             = n_c;
-   s->cursor          = 0; 
-   s->page            = 0;
-   s->iterations      = n_i;
-   s->first_iteration = NULL;
+// Decode again after the probability of the bit under the cursor
+// has changed. Only the part of each iteration that depends on that
+// bit is worked out again, and the result is the same as
+// viewer_solve()'s.
+static void viewer_solve_cursor(struct viewer *s) {
+   s->channel_llr[s->cursor] = p_to_l(s->channel[s->cursor]);
+   state_redecode(s->s, s->channel_llr, s->cursor);
+   viewer_clamp_page(s);
+   viewer_summarise(s);
+}
+
+
+// Returns 0 if there is not enough memory
+static int viewer_init(struct viewer *s, const struct code *code, const struct config *config, int n_i) {
+   s->code        = code;
+   s->config      = *config;
+   s->iterations  = n_i;
+   s->n_v         = code->n_v;
+   s->n_c         = code->n_c;
+   s->cursor      = 0;
+   s->page        = 0;
+   s->view        = VIEW_MESSAGES;
+   s->first_v     = 0;
+   s->first_c     = 0;
+   s->s           = state_new(code, config, n_i, 1, NULL);
+   s->channel     = malloc(sizeof(double) * code->n_v);
+   s->channel_llr = malloc(sizeof(double) * code->n_v);
+   s->flips       = malloc(sizeof(int) * n_i);
+   s->histogram   = malloc(sizeof(int) * n_i * HISTOGRAM_BINS);
+   if(s->s == NULL || s->channel == NULL || s->channel_llr == NULL ||
+      s->flips == NULL || s->histogram == NULL)
+      return 0;
 
    // Set the initial channel probabilities
-   for(int i = 0; i < n_v; i++) {
+   for(int i = 0; i < s->n_v; i++) {
       if(i < sizeof(initial_r)/sizeof(double)) {
          s->channel[ i] = l_to_p(initial_r[i]);
       } else {
          s->channel[ i] = 0.50;
       } 
    }
-   // Copy the LDPC matrix into the structure
-   for(int i = 0; i < n_v; i++) {
-      for(int j = 0; j < n_c; j++) {
-         s->matrix[j][i] = matrix[j][i];
+   return 1;
+}
+
+
+static void viewer_free(struct viewer *s) {
+   if(s->s != NULL)
+      state_delete(s->s);
+   free(s->channel);
+   free(s->channel_llr);
+   free(s->flips);
+   free(s->histogram);
+}
+#endif
+
+
+// Monte Carlo BER/FER simulation
+//
+// Frames of random data are encoded, sent as BPSK ('0' as +1) over
+// an AWGN channel, decoded, and checked for data bit and frame errors.
+// Without an encoder the all-zero codeword is sent instead. Each
+// Eb/N0 point runs until it has seen the target number of frame
+// errors, or the frame limit.
+//
+// With HARQ, a frame that does not decode to a valid codeword is sent
+// again with new noise, up to the transmission limit, and each
+// transmission is combined into the frame's soft buffer before it is
+// decoded again. Iterations are counted over all the transmissions.
+//
+// With rate matching, only the bits the rate matching picks out are
+// sent, filler bits are sent as data bits of 0, and frames are decoded
+// with the shortened code. The rate is the data bits less the filler
+// bits over the bits sent.
+//
+// Every frame has its own random number stream, seeded from the
+// seed, the point and the frame number, and the errors are counted
+// in frame order. So the results only depend on the seed, however
+// many threads there are and whichever thread got which frame.
+
+struct sim_settings {
+   double start, stop, step;   // Eb/N0 sweep in dB
+   int target_errors;          // Frame errors to see at each point
+   long max_frames;            // Give up on a point after this many frames
+   uint64_t seed;
+   int n_threads;
+   int max_transmissions;      // HARQ if more than 1
+   // Rate matching if e > 0, see rate_match_new(). The filler bits
+   // are the last data bits.
+   int rm_e, rm_punctured, rm_filler, rm_start;
+};
+
+// One round of frames, shared by the worker threads
+struct sim_round {
+   const struct encoder *encoder;
+   const struct rate_match *rm;
+   int n_v;
+   int n_tx;                   // LLRs per frame sent
+   int first_filler;           // Data bits from here on are filler
+   int point;
+   uint64_t seed;
+   double sigma;
+   int max_transmissions;
+   long first_frame;
+   int n_blocks;
+   atomic_int next_block;
+   int *bit_errors;
+   int *iterations;
+   int *transmissions;
+};
+
+struct sim_worker {
+   struct sim_round *round;
+   struct state *s;
+   float *llr;
+   uint8_t *bits;
+   uint64_t *data;
+   uint64_t *codeword;
+   uint64_t *scratch;
+   // For HARQ: a soft buffer per lane, a transmission's LLRs, and the
+   // hard decisions and results of the frames sent again
+   struct harq *harq;
+   float *rx;
+   uint8_t *rx_bits;
+   pthread_t thread;
+};
+
+
+// Send a codeword (all-zero if NULL) as BPSK through noise of the
+// given sigma, giving the LLRs of the n_tx bits sent: codeword bit
+// position[i] for LLR i, or bit i if there is no rate matching
+static void sim_channel(const struct sim_round *round, struct rng *rng, const uint64_t *codeword, float *llr) {
+   const int *position = round->rm != NULL ? rate_match_positions(round->rm) : NULL;
+   double sigma = round->sigma;
+
+   rng_gaussian(rng, llr, round->n_tx);
+   for(int i = 0; i < round->n_tx; i++) {
+      int v = position != NULL ? position[i] : i;
+      float x = codeword != NULL && bit_get(codeword, v) ? -1.0f : 1.0f;
+      llr[i] = 2.0f * (x + (float)sigma * llr[i]) / (float)(sigma * sigma);
+   }
+}
+
+
+// Make one frame's LLRs from the rng: random data (with the filler
+// bits 0) encoded into codeword[] when there is an encoder, otherwise
+// the all-zero codeword, sent through the channel
+static void sim_frame(const struct sim_round *round, struct rng *rng, float *llr,
+                      uint64_t *data, uint64_t *codeword, uint64_t *scratch) {
+   const struct encoder *e = round->encoder;
+   if(e != NULL) {
+      int k = encoder_k(e);
+      for(int i = 0; i < WORDS(k); i++)
+         data[i] = rng_next(rng);
+      for(int i = round->first_filler; i < k; i++)
+         data[i/64] &= ~((uint64_t)1 << (i % 64));
+      if(k % 64 != 0)
+         data[k/64] &= ((uint64_t)1 << (k % 64)) - 1;
+      encoder_encode(e, data, codeword, scratch);
+   }
+   sim_channel(round, rng, e != NULL ? codeword : NULL, llr);
+}
+
+
+// Send a block of frames, whose first transmissions are in w->llr,
+// until each decodes to a valid codeword or runs out of
+// transmissions. Frames that are sent again are packed together at
+// the front of w->llr to be decoded.
+static void sim_harq(struct sim_worker *w, struct rng *rng, struct frame_result *results, int *iterations,
+                     int *transmissions) {
+   struct sim_round *round = w->round;
+   int n_v = round->n_v;
+   int lane[BATCH_LANES];
+
+   for(int f = 0; f < BATCH_LANES; f++) {
+      harq_clear(w->harq, f);
+      iterations[f]    = 0;
+      transmissions[f] = 0;
+      results[f].valid = 0;
+   }
+   for(int t = 0; t < round->max_transmissions; t++) {
+      struct frame_result tx_results[BATCH_LANES];
+      int n = 0;
+      for(int f = 0; f < BATCH_LANES; f++) {
+         if(results[f].valid)
+            continue;
+         const float *llr = w->llr + f*n_v;
+         if(t > 0) {
+            sim_channel(round, &rng[f], round->encoder != NULL ? w->codeword + f*WORDS(n_v) : NULL, w->rx);
+            llr = w->rx;
+         }
+         // Combining frame f into slot n only overwrites frames that
+         // are already combined
+         transmissions[f] = harq_combine(w->harq, f, llr, w->llr + n*n_v);
+         lane[n++] = f;
+      }
+      if(n == 0)
+         break;
+      state_decode_frames(w->s, w->llr, n, w->rx_bits, tx_results);
+      for(int i = 0; i < n; i++) {
+         int f = lane[i];
+         results[f] = tx_results[i];
+         iterations[f] += tx_results[i].iterations;
+         memcpy(w->bits + f*n_v, w->rx_bits + i*n_v, n_v);
       }
    }
+}
+
 
-   // Add the storage needed for each iteration 
-   for(int i = 0; i < n_i; i++) {
-     add_iteration(s);
+// Count the data bits in error, or every bit without an encoder
+static int sim_errors(const struct encoder *e, int n_v, const uint8_t *bits, const uint64_t *codeword) {
+   int errors = 0;
+   if(e != NULL) {
+      const int *info_pos = encoder_info_pos(e);
+      for(int i = 0; i < encoder_k(e); i++) {
+         int v = info_pos[i];
+         errors += bits[v] != bit_get(codeword, v);
+      }
+   } else {
+      for(int v = 0; v < n_v; v++) {
+         errors += bits[v];
+      }
    }
-   return s;
+   return errors;
 }
 
 
-double calc_message_v_to_c(struct state *s, struct iteration *iteration, int v, int c) {
-   double t = 1.0;
-   for(int i = 0; i < s->n_v; i++) {
-      if(i != v && s->matrix[c][i]) {
-         t *= tanh(iteration->message_c_to_v[c][i]/2);
+static void *sim_worker_main(void *arg) {
+   struct sim_worker *w = arg;
+   struct sim_round *round = w->round;
+   const struct encoder *e = round->encoder;
+   int n_v = round->n_v;
+   struct frame_result results[BATCH_LANES];
+   int block;
+
+   while((block = atomic_fetch_add(&round->next_block, 1)) < round->n_blocks) {
+      struct rng rng[BATCH_LANES];
+      int *iterations    = round->iterations    + block*BATCH_LANES;
+      int *transmissions = round->transmissions + block*BATCH_LANES;
+      for(int f = 0; f < BATCH_LANES; f++) {
+         long frame = round->first_frame + (long)block*BATCH_LANES + f;
+         float *llr = w->llr + f*round->n_tx;
+         rng_stream(&rng[f], round->seed, round->point, frame);
+         sim_frame(round, &rng[f], llr, w->data, w->codeword + f*WORDS(n_v), w->scratch);
+      }
+      if(w->harq != NULL) {
+         sim_harq(w, rng, results, iterations, transmissions);
+      } else if(round->rm != NULL) {
+         // Decode the shortened code, then put the filler bits back
+         const struct rate_match *rm = round->rm;
+         int n_short = rate_match_code(rm)->n_v;
+         struct frame_io io = { w->llr, LLR_FLOAT32, 1.0f, w->rx_bits, NULL, results, NULL, NULL, rm };
+         state_decode_io(w->s, &io, 0, BATCH_LANES);
+         for(int f = 0; f < BATCH_LANES; f++) {
+            rate_match_bits(rm, w->rx_bits + f*n_short, w->bits + f*n_v);
+            iterations[f]    = results[f].iterations;
+            transmissions[f] = 1;
+         }
+      } else {
+         state_decode_frames(w->s, w->llr, BATCH_LANES, w->bits, results);
+         for(int f = 0; f < BATCH_LANES; f++) {
+            iterations[f]    = results[f].iterations;
+            transmissions[f] = 1;
+         }
+      }
+      for(int f = 0; f < BATCH_LANES; f++) {
+         round->bit_errors[block*BATCH_LANES + f] = sim_errors(e, n_v, w->bits + f*n_v, w->codeword + f*WORDS(n_v));
       }
    }
-   return log((1+t)/(1-t));
+   return NULL;
 }
 
-double calc_message_c_to_v(struct state *s, struct iteration *iteration, int v, int c) {
-   double p = s->channel_llr[v];
-   for(int i = 0; i < s->n_c; i++) {
-      if(i != c && s->matrix[i][v] == 1) {
-         p += iteration->message_v_to_c[i][v];
+
+// Run the sweep, printing a line per Eb/N0 point. Returns 0 if it
+// could not be run.
+int simulate(const struct code *code, const struct config *config, int n_i,
+             const struct sim_settings *settings) {
+   int n_v = code->n_v;
+   int n_threads = settings->n_threads < 1 ? 1 : settings->n_threads;
+   int round_blocks = 64 * n_threads;
+   struct encoder *encoder = encoder_new(code);
+   int k = encoder != NULL ? encoder_k(encoder) : code->n_v - code->n_c;
+   struct rate_match *rm = NULL;
+   struct sim_round round;
+   struct sim_worker *worker = calloc(n_threads, sizeof(struct sim_worker));
+   int ok = worker != NULL;
+
+   // Filler bits are the last data bits, so they have to be where the
+   // encoder puts them
+   if(settings->rm_e > 0) {
+      int n_filler = settings->rm_filler;
+      int first_v = encoder != NULL && n_filler > 0 && n_filler <= k ? encoder_info_pos(encoder)[k - n_filler] : 0;
+      if(n_filler < 0 || n_filler > k || (n_filler > 0 && encoder == NULL) ||
+         (n_filler > 0 && encoder_info_pos(encoder)[k-1] != first_v + n_filler - 1)) {
+         fprintf(stderr, "The filler bits have to be the last data bits, in one run\n");
+         ok = 0;
+      } else {
+         rm = rate_match_new(code, settings->rm_punctured, first_v, n_filler, settings->rm_start, settings->rm_e);
+         ok = ok && rm != NULL;
       }
    }
-   return p;
-} 
+   const struct code *decode_code = rm != NULL ? rate_match_code(rm) : code;
+   int n_tx = rm != NULL ? settings->rm_e : n_v;
+   int k_info = rm != NULL ? k - settings->rm_filler : k;
+   double rate = (double)k_info / n_tx;
 
+   round.encoder    = encoder;
+   round.rm         = rm;
+   round.n_v        = n_v;
+   round.n_tx       = n_tx;
+   round.first_filler = rm != NULL ? k - settings->rm_filler : k;
+   round.seed       = settings->seed;
+   round.max_transmissions = settings->max_transmissions;
+   round.bit_errors    = malloc(sizeof(int) * round_blocks * BATCH_LANES);
+   round.iterations    = malloc(sizeof(int) * round_blocks * BATCH_LANES);
+   round.transmissions = malloc(sizeof(int) * round_blocks * BATCH_LANES);
+   ok = ok && round.bit_errors != NULL && round.iterations != NULL && round.transmissions != NULL;
+   for(int i = 0; ok && i < n_threads; i++) {
+      worker[i].round = &round;
+      worker[i].s     = state_new(decode_code, config, n_i, 0, NULL);
+      worker[i].llr   = malloc(sizeof(float) * (n_tx > n_v ? n_tx : n_v) * BATCH_LANES);
+      worker[i].bits  = malloc(n_v * BATCH_LANES);
+      worker[i].data     = malloc(sizeof(uint64_t) * (WORDS(k) + 1));
+      worker[i].codeword = malloc(sizeof(uint64_t) * WORDS(n_v) * BATCH_LANES);
+      worker[i].scratch  = malloc(sizeof(uint64_t) * (encoder != NULL ? encoder_scratch_words(encoder) + 1 : 1));
+      ok = worker[i].s != NULL && worker[i].llr != NULL && worker[i].bits != NULL &&
+           worker[i].data != NULL && worker[i].codeword != NULL && worker[i].scratch != NULL;
+      if(ok && settings->max_transmissions > 1) {
+         worker[i].harq    = harq_new(n_v, BATCH_LANES, HARQ_DEFAULT_SCALE);
+         worker[i].rx      = malloc(sizeof(float) * n_v);
+         ok = worker[i].harq != NULL && worker[i].rx != NULL;
+      }
+      if(ok && (settings->max_transmissions > 1 || rm != NULL)) {
+         worker[i].rx_bits = malloc(n_v * BATCH_LANES);
+         ok = worker[i].rx_bits != NULL;
+      }
+   }
 
-void state_solve(struct state *s) {
-   for(int i = 0; i < s->n_v; i++) {
-      s->channel_llr[i] = p_to_l(s->channel[i]);
+   if(ok) {
+      printf("# n=%d k=%d rate=%.4f %s, BPSK, AWGN, seed %llu",
+             code->n_v, k, rate, encoder != NULL ? "random data" : "all-zero codeword",
+             (unsigned long long)settings->seed);
+      if(rm != NULL)
+         printf(", %d bits sent, %d punctured, %d filler, from %d",
+                settings->rm_e, settings->rm_punctured, settings->rm_filler, settings->rm_start);
+      if(settings->max_transmissions > 1)
+         printf(", HARQ up to %d transmissions", settings->max_transmissions);
+      printf("\n# EbN0_dB      frames  frame_errs    bit_errs          FER          BER  avg_iter%s\n",
+             settings->max_transmissions > 1 ? "    avg_tx" : "");
    }
-   if(s->first_iteration == NULL) 
-     return;
 
-   for(int c = 0; c < s->n_c; c++) {  // For each check node
-      for(int v = 0; v < s->n_v; v++) {  // message for each check node 
-         s->first_iteration->message_c_to_v[c][v] = s->channel_llr[v];
+   int point = 0;
+   for(double ebn0 = settings->start; ok && ebn0 <= settings->stop + 1e-9; ebn0 += settings->step, point++) {
+      long frames = 0, frame_errors = 0, bit_errors = 0, iterations = 0, transmissions = 0;
+      int done = 0;
+
+      round.point = point;
+      round.sigma = sqrt(1.0 / (2.0 * rate * pow(10.0, ebn0/10)));
+      while(!done && frames < settings->max_frames) {
+         round.first_frame = frames;
+         round.n_blocks    = round_blocks;
+         atomic_store(&round.next_block, 0);
+         int started = 0;
+         while(started < n_threads &&
+               pthread_create(&worker[started].thread, NULL, sim_worker_main, &worker[started]) == 0)
+            started++;
+         // The blocks go to whichever worker asks next, so if a thread
+         // could not be started this one takes its share
+         if(started < n_threads)
+            sim_worker_main(&worker[started]);
+         for(int i = 0; i < started; i++) {
+            pthread_join(worker[i].thread, NULL);
+         }
+
+         // Count the frames in order, up to when the target is reached
+         for(int f = 0; !done && f < round_blocks * BATCH_LANES && frames < settings->max_frames; f++) {
+            frames++;
+            iterations += round.iterations[f];
+            transmissions += round.transmissions[f];
+            bit_errors += round.bit_errors[f];
+            if(round.bit_errors[f] > 0 && ++frame_errors >= settings->target_errors)
+               done = 1;
+         }
       }
+      printf("%9.3f %11ld %11ld %11ld %12.4e %12.4e %9.3f", ebn0, frames, frame_errors, bit_errors,
+             (double)frame_errors / frames, (double)bit_errors / ((double)frames * (encoder != NULL ? k_info : n_v)),
+             (double)iterations / frames);
+      if(settings->max_transmissions > 1)
+         printf(" %9.3f", (double)transmissions / frames);
+      printf("\n");
+      fflush(stdout);
    }
 
-   struct iteration *current = s->first_iteration;
-   while(current != NULL) {
-      for(int c = 0; c < s->n_c; c++) {  // For each check node
-         for(int v = 0; v < s->n_v; v++) {  // message for each check node 
-            current->message_v_to_c[c][v] = calc_message_v_to_c(s, current, v, c);
+   for(int i = 0; worker != NULL && i < n_threads; i++) {
+      if(worker[i].s != NULL)
+         state_delete(worker[i].s);
+      free(worker[i].llr);
+      free(worker[i].bits);
+      free(worker[i].data);
+      free(worker[i].codeword);
+      free(worker[i].scratch);
+      harq_delete(worker[i].harq);
+      free(worker[i].rx);
+      free(worker[i].rx_bits);
+   }
+   free(worker);
+   encoder_delete(encoder);
+   rate_match_delete(rm);
+   free(round.bit_errors);
+   free(round.iterations);
+   free(round.transmissions);
+   return ok;
+}
+
+
+// Benchmark
+//
+// Each engine is run over each code, schedule and Eb/N0 point in
+// turn, with a single decoder on the calling thread. The frames are
+// made up front as in the simulation, so only decoding is timed.
+// The lane engines decode BATCH_LANES frames per call, and every
+// frame in a call is given that call's time as its latency. Other
+// engines are timed a frame at a time.
+
+struct bench_code {
+   const char *name;
+   const char *qc_file;   // NULL for the built in example
+};
+
+// The BG1 and DVB-S2 entries are stand-ins with the real codes'
+// dimensions, not the standards' tables, see the files
+static const struct bench_code bench_codes[] = {
+   { "johnson-4x6",             NULL },
+   { "nr-bg1-z384-synthetic",   "codes/nr_bg1_synthetic.qc" },
+   { "dvbs2-64800-synthetic",   "codes/dvbs2_64800_synthetic.qc" },
+};
+
+struct bench_engine {
+   const char *name;
+   int engine;
+   int check;
+};
+
+static const struct bench_engine bench_engines[] = {
+   { "double-sp",  ENGINE_DOUBLE, CHECK_SUM_PRODUCT },
+   { "double-nms", ENGINE_DOUBLE, CHECK_NORMALIZED_MIN_SUM },
+   { "float-sp",   ENGINE_FLOAT,  CHECK_SUM_PRODUCT },
+   { "fixed-nms",  ENGINE_FIXED,  CHECK_NORMALIZED_MIN_SUM },
+};
+
+static const double bench_ebn0[] = { 1.0, 2.0, 3.0 };
+
+enum bench_format {
+   BENCH_TEXT,
+   BENCH_CSV,
+   BENCH_JSON
+};
+
+struct bench_result {
+   int frames;
+   int frame_errors;
+   double seconds;
+   double iterations;   // Average per frame
+   double p50, p99, p999;   // Latency in microseconds
+};
+
+
+static double now_seconds(void) {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+static int compare_double(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+
+// The latency that a fraction q of the frames came in under
+static double percentile(const double *sorted, int n, double q) {
+   int i = (int)ceil(q * n) - 1;
+   return sorted[i < 0 ? 0 : i];
+}
+
+
+// Decode n_frames frames through s. Returns 0 if it could not be run.
+static int bench_run(struct state *s, const struct code *code, const struct config *config,
+                     const struct encoder *encoder, double ebn0, int n_frames, struct bench_result *result) {
+   int n_v = code->n_v;
+   int k = encoder_k(encoder);
+   double sigma = sqrt(1.0 / (2.0 * ((double)k / n_v) * pow(10.0, ebn0/10)));
+   float *llr        = malloc(sizeof(float) * n_v * n_frames);
+   uint64_t *sent    = malloc(sizeof(uint64_t) * WORDS(n_v) * n_frames);
+   uint64_t *data    = malloc(sizeof(uint64_t) * (WORDS(k) + 1));
+   uint64_t *scratch = malloc(sizeof(uint64_t) * (encoder_scratch_words(encoder) + 1));
+   uint8_t *bits     = malloc(n_v * BATCH_LANES);
+   double *latency   = malloc(sizeof(double) * n_frames);
+   struct frame_result results[BATCH_LANES];
+   long iterations = 0;
+   struct sim_round round = { .encoder = encoder, .n_v = n_v, .n_tx = n_v, .first_filler = k, .sigma = sigma };
+   int ok = llr != NULL && sent != NULL && data != NULL && scratch != NULL && bits != NULL && latency != NULL;
+
+   for(int f = 0; ok && f < n_frames; f++) {
+      struct rng rng;
+      rng_stream(&rng, 1, (uint64_t)(ebn0 * 1000), f);
+      sim_frame(&round, &rng, llr + (size_t)f*n_v, data, sent + (size_t)f*WORDS(n_v), scratch);
+   }
+
+   result->frames       = n_frames;
+   result->frame_errors = 0;
+   result->seconds      = 0;
+   int batch = config_uses_lanes(config) ? BATCH_LANES : 1;
+   for(int f = 0; ok && f < n_frames; f += batch) {
+      int n = n_frames - f < batch ? n_frames - f : batch;
+      double start = now_seconds();
+      state_decode_frames(s, llr + (size_t)f*n_v, n, bits, results);
+      double t = now_seconds() - start;
+      result->seconds += t;
+      for(int i = 0; i < n; i++) {
+         latency[f+i] = t * 1e6;
+         iterations  += results[i].iterations;
+         result->frame_errors += sim_errors(encoder, n_v, bits + i*n_v, sent + (size_t)(f+i)*WORDS(n_v)) > 0;
+      }
+   }
+   if(ok) {
+      qsort(latency, n_frames, sizeof(double), compare_double);
+      result->iterations = (double)iterations / n_frames;
+      result->p50  = percentile(latency, n_frames, 0.5);
+      result->p99  = percentile(latency, n_frames, 0.99);
+      result->p999 = percentile(latency, n_frames, 0.999);
+   }
+   free(llr);
+   free(sent);
+   free(data);
+   free(scratch);
+   free(bits);
+   free(latency);
+   return ok;
+}
+
+
+static void bench_print(int format, int *first, const char *code_name, const struct code *code, int k,
+                        const char *engine, int schedule, double ebn0, const struct bench_result *r) {
+   static const char *schedules[] = { "flooding", "layered" };
+   double mbits    = r->frames * (double)k / r->seconds / 1e6;
+   double frames_s = r->frames / r->seconds;
+   double fer      = (double)r->frame_errors / r->frames;
+
+   switch(format) {
+      case BENCH_TEXT:
+         if(*first)
+            printf("%-24s %6s %6s %-10s %-8s %5s %6s %9s %10s %8s %9s %10s %10s %10s\n", "code", "n", "k",
+                   "engine", "schedule", "EbN0", "frames", "Mbit/s", "frames/s", "avg_iter", "FER",
+                   "p50_us", "p99_us", "p99.9_us");
+         printf("%-24s %6d %6d %-10s %-8s %5.2f %6d %9.3f %10.1f %8.2f %9.3e %10.1f %10.1f %10.1f\n",
+                code_name, code->n_v, k, engine, schedules[schedule], ebn0, r->frames, mbits, frames_s,
+                r->iterations, fer, r->p50, r->p99, r->p999);
+         break;
+      case BENCH_CSV:
+         if(*first)
+            printf("code,n,k,engine,schedule,ebn0_db,frames,mbit_s,frames_s,avg_iterations,fer,"
+                   "p50_us,p99_us,p999_us\n");
+         printf("%s,%d,%d,%s,%s,%.2f,%d,%.4f,%.2f,%.3f,%.4e,%.2f,%.2f,%.2f\n", code_name, code->n_v, k,
+                engine, schedules[schedule], ebn0, r->frames, mbits, frames_s, r->iterations, fer,
+                r->p50, r->p99, r->p999);
+         break;
+      case BENCH_JSON:
+         printf("%s\n  {\"code\": \"%s\", \"n\": %d, \"k\": %d, \"engine\": \"%s\", \"schedule\": \"%s\", "
+                "\"ebn0_db\": %.2f, \"frames\": %d, \"mbit_s\": %.4f, \"frames_s\": %.2f, "
+                "\"avg_iterations\": %.3f, \"fer\": %.4e, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+                "\"p999_us\": %.2f}", *first ? "[" : ",", code_name, code->n_v, k, engine,
+                schedules[schedule], ebn0, r->frames, mbits, frames_s, r->iterations, fer,
+                r->p50, r->p99, r->p999);
+         break;
+   }
+   *first = 0;
+   fflush(stdout);
+}
+
+
+// Run the benchmark over the built in list of codes, or just 'code'
+// if one was given, writing one record per run. Returns 0 if
+// anything could not be run.
+int benchmark(const struct code *only, const char *only_name, int n_i, int n_frames, int format) {
+   int n_codes = only != NULL ? 1 : sizeof(bench_codes)/sizeof(bench_codes[0]);
+   int first = 1, ok = 1;
+
+   for(int c = 0; c < n_codes; c++) {
+      struct code *loaded = NULL;
+      const struct code *code = only;
+      const char *name = only_name;
+      if(only == NULL) {
+         name = bench_codes[c].name;
+         if(bench_codes[c].qc_file != NULL)
+            loaded = code_load_qc(bench_codes[c].qc_file, 0);
+         else
+            loaded = code_new_dense(&matrix[0][0], sizeof(matrix)/sizeof(matrix[0]), sizeof(matrix[0])/sizeof(matrix[0][0]));
+         code = loaded;
+      }
+      struct encoder *encoder = code != NULL ? encoder_new(code) : NULL;
+      if(encoder == NULL) {
+         fprintf(stderr, "Unable to set up %s\n", name);
+         ok = 0;
+      }
+
+      for(int e = 0; encoder != NULL && e < (int)(sizeof(bench_engines)/sizeof(bench_engines[0])); e++) {
+         for(int schedule = SCHEDULE_FLOODING; schedule <= SCHEDULE_LAYERED; schedule++) {
+            struct config config;
+            config_default(&config);
+            config.engine   = bench_engines[e].engine;
+            config.check    = bench_engines[e].check;
+            config.schedule = schedule;
+            struct state *s = state_new(code, &config, n_i, 0, NULL);
+            if(s == NULL) {
+               fprintf(stderr, "Unable to allocate the decoder for %s\n", name);
+               ok = 0;
+               continue;
+            }
+            for(int p = 0; p < (int)(sizeof(bench_ebn0)/sizeof(bench_ebn0[0])); p++) {
+               struct bench_result r;
+               if(!bench_run(s, code, &config, encoder, bench_ebn0[p], n_frames, &r)) {
+                  ok = 0;
+                  continue;
+               }
+               bench_print(format, &first, name, code, encoder_k(encoder), bench_engines[e].name, schedule,
+                           bench_ebn0[p], &r);
+            }
+            state_delete(s);
          }
       }
+      encoder_delete(encoder);
+      if(loaded != NULL)
+         code_delete(loaded);
+   }
+   if(format == BENCH_JSON)
+      printf("%s]\n", first ? "[" : "\n");
+   return ok;
+}
+
+
+// Regression checks
+//
+// -V decodes a set of test vectors with the double engine, keeping
+// every iteration, as the reference for each check node algorithm and
+// schedule. Then the other engines and paths decode the same frames
+// and are compared with it: the double engine without history, a team
+// of threads and state_redecode() bit for bit, and the single
+// precision and GPU engines to a tolerance. Those are compared as soft
+// bits, tanh(L/2), so that the float sum-product limiting its messages
+// to +/-24 where the double one goes to +/-38 makes no difference, and
+// must give the same iteration count and hard decision. Frames the
+// reference could not decode only need to fail in the same way, as by
+// then min-sum's choices between nearly equal minimums have made the
+// rest chaotic.
+//
+// The fixed point engine is not compared with the reference, as it
+// rounds every message. Instead, on QC codes, each engine's block
+// column paths are checked bit for bit against its per edge paths,
+// by decoding with a copy of the code without its circulants. The
+// fixed point engine is also checked bit for bit against a trace, see
+// -X and -Y.
+//
+// Each case is timed against what it is compared with, as the best of
+// at least CHECK_MIN_PASSES passes over the frames and as many more as
+// fit in CHECK_MIN_SECONDS, and one that goes over its budget fails.
+#define CHECK_TOLERANCE   1e-3   // Largest |tanh(L/2) - tanh(reference/2)|
+#define CHECK_MIN_PASSES  3
+#define CHECK_MIN_SECONDS 0.05
+#define CHECK_FRAMES      16     // Random test vectors per code
+
+enum check_kind {
+   CHECK_BATCH,      // Through state_decode_io()
+   CHECK_TEAM,       // Per frame across two threads
+   CHECK_REDECODE,   // state_redecode() after changing one LLR
+   CHECK_QC          // The block column paths against the per edge ones
+};
+
+struct check_case {
+   const char *name;
+   int kind;
+   int engine;
+   double budget;    // Most time against the reference's
+   int min_n_v;      // Smallest code the budget applies to
+};
+
+// The double engine without history does the same work as the
+// reference, and single precision, a GPU and a team of two must all
+// beat it. state_redecode() must beat a full decode, and the block
+// column paths must not be much slower than the per edge ones.
+//
+// A GPU launch or a team barrier costs more than a whole frame of a
+// small code, and re-decoding a small code covers it at once and
+// falls back to a full decode, so on codes of fewer than min_n_v
+// variables those three are checked but not timed against a budget.
+// Nor is the team on a machine with only one processor, where its two
+// threads take turns.
+static const struct check_case check_cases[] = {
+   { "double",    CHECK_BATCH,    ENGINE_DOUBLE, 1.5, 0    },
+   { "float",     CHECK_BATCH,    ENGINE_FLOAT,  1.0, 0    },
+   { "gpu",       CHECK_BATCH,    ENGINE_GPU,    1.0, 1000 },
+   { "team-2",    CHECK_TEAM,     ENGINE_DOUBLE, 1.0, 1000 },
+   { "redecode",  CHECK_REDECODE, ENGINE_DOUBLE, 0.9, 1000 },
+   { "qc-double", CHECK_QC,       ENGINE_DOUBLE, 1.5, 0    },
+   { "qc-float",  CHECK_QC,       ENGINE_FLOAT,  1.5, 0    },
+   { "qc-fixed",  CHECK_QC,       ENGINE_FIXED,  1.5, 0    },
+};
+
+// What a decoder made of each frame
+struct check_output {
+   double *l;                     // Final L, n_v per frame
+   uint8_t *bits;                 // Hard decision, n_v per frame
+   struct frame_result *results;
+};
+
+// The test vectors, as floats and doubles
+struct check_vectors {
+   int n_frames;
+   float *llr;
+   double *llr_d;
+};
+
+
+// The test vectors for a code: the example from the paper at
+// initial_r when 'johnson' is set, then n_random frames of random
+// codewords (or the all-zero codeword if the code has no encoder)
+// through the AWGN channel at each of bench_ebn0[] in turn. Returns 0
+// if there is not enough memory.
+static int check_make_vectors(struct check_vectors *t, const struct code *code, int johnson, int n_random) {
+   int n_v = code->n_v, n = johnson + n_random;
+   struct encoder *encoder = encoder_new(code);
+   int k = encoder != NULL ? encoder_k(encoder) : code->n_v - code->n_c;
+   uint64_t *data    = malloc(sizeof(uint64_t) * (WORDS(n_v) + 1));
+   uint64_t *sent    = malloc(sizeof(uint64_t) * WORDS(n_v));
+   uint64_t *scratch = malloc(sizeof(uint64_t) * ((encoder != NULL ? encoder_scratch_words(encoder) : 0) + 1));
+   t->n_frames = n;
+   t->llr      = malloc(sizeof(float) * n_v * n);
+   t->llr_d    = malloc(sizeof(double) * n_v * n);
+   int ok = t->llr != NULL && t->llr_d != NULL && data != NULL && sent != NULL && scratch != NULL && k > 0;
+
+   for(int v = 0; ok && johnson && v < n_v; v++) {
+      t->llr[v] = v < sizeof(initial_r)/sizeof(double) ? initial_r[v] : 0.0f;
+   }
+   for(int f = 0; ok && f < n_random; f++) {
+      double ebn0 = bench_ebn0[f % (sizeof(bench_ebn0)/sizeof(bench_ebn0[0]))];
+      double sigma = sqrt(1.0 / (2.0 * ((double)k / n_v) * pow(10.0, ebn0/10)));
+      struct sim_round round = { .encoder = encoder, .n_v = n_v, .n_tx = n_v, .first_filler = k, .sigma = sigma };
+      struct rng rng;
+      rng_stream(&rng, 1, (uint64_t)(ebn0 * 1000), f);
+      sim_frame(&round, &rng, t->llr + (size_t)(johnson + f)*n_v, data, sent, scratch);
+   }
+   for(size_t i = 0; ok && i < (size_t)n_v * n; i++) {
+      t->llr_d[i] = t->llr[i];
+   }
+   free(data);
+   free(sent);
+   free(scratch);
+   encoder_delete(encoder);
+   return ok;
+}
+
+
+static void check_vectors_free(struct check_vectors *t) {
+   free(t->llr);
+   free(t->llr_d);
+}
+
 
-      for(int i = 0; i < s->n_c; i++) {
-         current->parity[i] = 0;
+static int check_output_alloc(struct check_output *out, int n_v, int n_frames) {
+   out->l       = malloc(sizeof(double) * n_v * n_frames);
+   out->bits    = malloc(n_v * n_frames);
+   out->results = malloc(sizeof(struct frame_result) * n_frames);
+   return out->l != NULL && out->bits != NULL && out->results != NULL;
+}
+
+
+static void check_output_free(struct check_output *out) {
+   free(out->l);
+   free(out->bits);
+   free(out->results);
+}
+
+
+// Copy out the last decode of frame f
+static void check_keep(struct state *s, const struct code *code, int valid, int f, struct check_output *out) {
+   const struct iteration *last = state_get_iteration(s, state_iterations_used(s) - 1);
+   int n_v = code->n_v;
+   for(int v = 0; v < n_v; v++) {
+      out->l[(size_t)f*n_v + v]    = last->l[v];
+      out->bits[(size_t)f*n_v + v] = bit_get(last->hard, code_packed_bit(code, v));
+   }
+   out->results[f].valid       = valid;
+   out->results[f].iterations  = state_iterations_used(s);
+   out->results[f].unsatisfied = last->unsatisfied;
+}
+
+
+// Decode every frame through s. With 'lanes' they go through
+// state_decode_io(), whose float outputs are widened to double, and
+// otherwise a frame at a time so the outputs are exact. Returns the
+// time taken.
+static double check_decode(struct state *s, const struct code *code, int lanes, const struct check_vectors *t,
+                           float *app, struct check_output *out) {
+   int n_v = code->n_v;
+   double start = now_seconds();
+   if(lanes) {
+      struct frame_io io = { t->llr, LLR_FLOAT32, 1.0f, out->bits, NULL, out->results, app, NULL, NULL };
+      state_decode_io(s, &io, 0, t->n_frames);
+   } else {
+      for(int f = 0; f < t->n_frames; f++) {
+         check_keep(s, code, state_decode(s, t->llr_d + (size_t)f*n_v), f, out);
       }
-      for(int v = 0; v < s->n_v; v++) {
-         int b;
-         current->l[v] = s->channel_llr[v];
-         for(int i = 0; i < s->n_c; i++) {
-            if(s->matrix[i][v])
-              current->l[v] += current->message_v_to_c[i][v];
+   }
+   double seconds = now_seconds() - start;
+   for(size_t i = 0; lanes && i < (size_t)n_v * t->n_frames; i++) {
+      out->l[i] = app[i];
+   }
+   return seconds;
+}
+
+
+// Decode every frame, and then again for the best time of the passes
+static double check_timed(struct state *s, const struct code *code, int lanes, const struct check_vectors *t,
+                          float *app, struct check_output *out) {
+   double start = now_seconds();
+   double best = check_decode(s, code, lanes, t, app, out);
+   for(int pass = 1; pass < CHECK_MIN_PASSES || now_seconds() - start < CHECK_MIN_SECONDS; pass++) {
+      double seconds = check_decode(s, code, lanes, t, app, out);
+      if(seconds < best)
+         best = seconds;
+   }
+   return best;
+}
+
+
+// Compare the outputs of a decoder with the reference's, exactly if
+// tolerance is 0 and otherwise as soft bits. Returns the number of
+// frames that differ, and the largest error in *max_error.
+static int check_compare(const struct code *code, const struct check_output *ref, const struct check_output *out,
+                         int n_frames, double tolerance, double *max_error, const char *what) {
+   int n_v = code->n_v, differ = 0;
+   *max_error = 0;
+   for(int f = 0; f < n_frames; f++) {
+      const struct frame_result *a = &ref->results[f], *b = &out->results[f];
+      double error = 0;
+      int bits = 0;
+      for(int v = 0; (tolerance == 0 || a->valid) && v < n_v; v++) {
+         size_t i = (size_t)f*n_v + v;
+         double e = tolerance == 0 ? fabs(out->l[i] - ref->l[i])
+                                   : fabs(tanh(out->l[i] / 2) - tanh(ref->l[i] / 2));
+         if(e > error)
+            error = e;
+         bits += out->bits[i] != ref->bits[i];
+      }
+      if(error > *max_error)
+         *max_error = error;
+      if(a->valid != b->valid || a->iterations != b->iterations || bits != 0 || error > tolerance) {
+         if(differ == 0)
+            fprintf(stderr, "%s: frame %d differs (valid %d/%d, iterations %d/%d, %d bits, error %.3e)\n",
+                    what, f, b->valid, a->valid, b->iterations, a->iterations, bits, error);
+         differ++;
+      }
+   }
+   return differ;
+}
+
+
+// Compare every iteration of two decodes bit for bit. Returns 0 if
+// they differ.
+static int check_iterations(const struct code *code, const struct state *ref, const struct state *s) {
+   int n = state_iterations_used(ref);
+   if(state_iterations_used(s) != n)
+      return 0;
+   for(int it = 0; it < n; it++) {
+      const struct iteration *a = state_get_iteration(ref, it), *b = state_get_iteration(s, it);
+      if(a->unsatisfied != b->unsatisfied ||
+         memcmp(a->message_v_to_c, b->message_v_to_c, sizeof(double) * code->n_edges) != 0 ||
+         memcmp(a->message_c_to_v, b->message_c_to_v, sizeof(double) * code->n_edges) != 0 ||
+         memcmp(a->l, b->l, sizeof(double) * code->n_v) != 0 ||
+         memcmp(a->hard, b->hard, sizeof(uint64_t) * code->hard_words) != 0 ||
+         memcmp(a->syndrome, b->syndrome, sizeof(uint64_t) * code->syndrome_words) != 0)
+         return 0;
+   }
+   return 1;
+}
+
+
+// The variable whose LLR has its sign changed in frame f for
+// state_redecode(), with the changed frame in 'changed'
+static int check_changed(const struct code *code, const double *llr, int f, double *changed) {
+   int v = (int)(((uint64_t)f * 2654435761u) % code->n_v);
+   memcpy(changed, llr, sizeof(double) * code->n_v);
+   changed[v] = -llr[v];
+   return v;
+}
+
+
+// Re-decode each frame with one LLR changed, and check every iteration
+// against a full decode of the changed frame by ref. Only the
+// re-decodes are timed, and the full decodes for the reference time,
+// each the best of the passes as in check_timed(). Returns the number
+// of frames that differ.
+static int check_redecode(struct state *ref, struct state *s, const struct code *code, const struct check_vectors *t,
+                          double *changed, double *seconds, double *ref_seconds) {
+   int n_v = code->n_v, differ = 0;
+   double start = now_seconds();
+   *seconds = *ref_seconds = HUGE_VAL;
+   for(int pass = 0; pass < CHECK_MIN_PASSES || now_seconds() - start < CHECK_MIN_SECONDS; pass++) {
+      double full = 0, partial = 0;
+      for(int f = 0; f < t->n_frames; f++) {
+         int v = check_changed(code, t->llr_d + (size_t)f*n_v, f, changed);
+         double t0 = now_seconds();
+         state_decode(ref, changed);
+         full += now_seconds() - t0;
+         state_decode(s, t->llr_d + (size_t)f*n_v);
+         t0 = now_seconds();
+         state_redecode(s, changed, v);
+         partial += now_seconds() - t0;
+         if(pass == 0)
+            differ += !check_iterations(code, ref, s);
+      }
+      if(full < *ref_seconds)
+         *ref_seconds = full;
+      if(partial < *seconds)
+         *seconds = partial;
+   }
+   return differ;
+}
+
+
+static void check_print(int *first, const char *code_name, const char *name, const struct config *config,
+                        int n_frames, int differ, double max_error, double ratio, double budget,
+                        const char *result) {
+   static const char *schedules[] = { "flooding", "layered" };
+   if(*first)
+      printf("%-24s %-9s %-5s %-8s %6s %6s %10s %7s %7s %s\n", "code", "case", "check", "schedule",
+             "frames", "differ", "max_error", "time", "budget", "result");
+   printf("%-24s %-9s %-5s %-8s %6d %6d %10.3e %7.2f %7.2f %s\n", code_name, name, check_names[config->check],
+          schedules[config->schedule], n_frames, differ, max_error, ratio, budget, result);
+   *first = 0;
+   fflush(stdout);
+}
+
+
+// Run one case against the reference outputs in *ref, which took
+// ref_seconds. Returns 1 if it passed, 0 if it failed and -1 if it
+// could not be run here.
+static int check_case_run(const struct check_case *cc, const char *name, const struct code *code,
+                          const struct code *generic, const struct config *config, int n_i,
+                          const struct check_vectors *t, struct state *r, const struct check_output *ref,
+                          double ref_seconds, double budget_scale, float *app, double *changed,
+                          struct check_output *out, struct check_output *base_out, int *first) {
+   struct config cfg = *config;
+   struct state *s, *base = NULL;
+   char what[128];
+   int differ = 0;
+   double max_error = 0, seconds = 0, base_seconds = ref_seconds;
+   double budget = code->n_v >= cc->min_n_v ? cc->budget * budget_scale : 0;
+   if(cc->kind == CHECK_TEAM && sysconf(_SC_NPROCESSORS_ONLN) < 2)
+      budget = 0;
+
+   cfg.engine = cc->engine;
+   snprintf(what, sizeof(what), "%s %s %s %s", name, cc->name, check_names[cfg.check],
+            cfg.schedule == SCHEDULE_FLOODING ? "flooding" : "layered");
+   s = state_new(code, &cfg, n_i, cc->kind == CHECK_REDECODE, NULL);
+   if(s != NULL && cc->kind == CHECK_TEAM && !state_start_team(s, 2)) {
+      state_delete(s);
+      s = NULL;
+   }
+   if(s != NULL && cc->kind == CHECK_QC && (base = state_new(generic, &cfg, n_i, 0, NULL)) == NULL) {
+      state_delete(s);
+      s = NULL;
+   }
+   if(s == NULL) {
+      // The GPU and the team depend on the build and the machine
+      int skip = cc->engine == ENGINE_GPU || cc->kind == CHECK_TEAM;
+      if(!skip)
+         fprintf(stderr, "%s: unable to allocate the decoder\n", what);
+      check_print(first, name, cc->name, &cfg, t->n_frames, 0, 0, 0, budget, skip ? "SKIP" : "FAIL");
+      return skip ? -1 : 0;
+   }
+
+   // The lane engines' batches go through state_decode_io(), and
+   // everything else a frame at a time
+   int lanes = cc->kind != CHECK_TEAM && (config_uses_lanes(&cfg) || cfg.engine == ENGINE_GPU);
+   if(cc->kind == CHECK_REDECODE) {
+      differ = check_redecode(r, s, code, t, changed, &seconds, &base_seconds);
+      if(differ != 0)
+         fprintf(stderr, "%s: %d frames differ from a full decode\n", what, differ);
+   } else if(cc->kind == CHECK_QC) {
+      base_seconds = check_timed(base, generic, lanes, t, app, base_out);
+      seconds = check_timed(s, code, lanes, t, app, out);
+      differ = check_compare(code, base_out, out, t->n_frames, 0, &max_error, what);
+   } else {
+      seconds = check_timed(s, code, lanes, t, app, out);
+      differ = check_compare(code, ref, out, t->n_frames, lanes ? CHECK_TOLERANCE : 0, &max_error, what);
+   }
+   state_delete(s);
+   if(base != NULL)
+      state_delete(base);
+
+   double ratio = base_seconds > 0 ? seconds / base_seconds : 0;
+   int slow = budget > 0 && ratio > budget;
+   if(slow)
+      fprintf(stderr, "%s: took %.2f times as long, over the budget of %.2f\n", what, ratio, budget);
+   check_print(first, name, cc->name, &cfg, t->n_frames, differ, max_error, ratio, budget,
+               differ != 0 || slow ? "FAIL" : "PASS");
+   return differ == 0 && !slow;
+}
+
+
+// Run every case for one code. Returns the number that failed, and
+// counts those run and skipped.
+static int check_code(const char *name, const struct code *code, int johnson, int n_i, int n_random,
+                      double budget_scale, int *first, int *n_run, int *n_skipped) {
+   int n_v = code->n_v, failed = 0;
+   struct check_vectors t;
+   struct check_output ref, out, base_out;
+
+   // The same code without its circulants, for CHECK_QC
+   struct code generic = *code;
+   generic.circ_start = NULL;
+   generic.circ       = NULL;
+
+   int ok = check_make_vectors(&t, code, johnson, n_random);
+   float *app = malloc(sizeof(float) * n_v * t.n_frames);
+   double *changed = malloc(sizeof(double) * n_v);
+   ok &= check_output_alloc(&ref, n_v, t.n_frames);
+   ok &= check_output_alloc(&out, n_v, t.n_frames);
+   ok &= check_output_alloc(&base_out, n_v, t.n_frames);
+   ok = ok && app != NULL && changed != NULL;
+
+   for(int check = 0; ok && check < CHECK_ALGORITHM_COUNT; check++) {
+      for(int schedule = SCHEDULE_FLOODING; schedule <= SCHEDULE_LAYERED; schedule++) {
+         struct config config;
+         config_default(&config);
+         config.check    = check;
+         config.schedule = schedule;
+
+         // The reference, with every iteration kept
+         struct state *r = state_new(code, &config, n_i, 1, NULL);
+         if(r == NULL) {
+            fprintf(stderr, "Unable to allocate the reference decoder for %s\n", name);
+            failed++;
+            continue;
          }
-         b = (current->l[v] < 0) ? 1 : 0;
-         current->codeword[v] = b;
-         for(int i = 0; i < s->n_c; i++) {
-            if(s->matrix[i][v])
-               current->parity[i] ^= b;
+         double ref_seconds = check_timed(r, code, 0, &t, app, &ref);
+
+         for(int c = 0; c < (int)(sizeof(check_cases)/sizeof(check_cases[0])); c++) {
+            const struct check_case *cc = &check_cases[c];
+            // Only the flooding schedule has teams, re-decoding and
+            // block column paths
+            if(cc->kind != CHECK_BATCH && schedule != SCHEDULE_FLOODING)
+               continue;
+            if((cc->engine == ENGINE_FIXED || cc->engine == ENGINE_GPU) && check == CHECK_SUM_PRODUCT)
+               continue;
+            if(cc->kind == CHECK_QC && code->circ == NULL)
+               continue;
+            int passed = check_case_run(cc, name, code, &generic, &config, n_i, &t, r, &ref, ref_seconds,
+                                        budget_scale, app, changed, &out, &base_out, first);
+            if(passed < 0) {
+               (*n_skipped)++;
+            } else {
+               failed += !passed;
+               (*n_run)++;
+            }
          }
-         
+         state_delete(r);
       }
-      
-      if(current->next != NULL) {
-         for(int c = 0; c < s->n_c; c++) {  // For each check node
-            for(int v = 0; v < s->n_v; v++) {  // message for each check node 
-                current->next->message_c_to_v[c][v] = calc_message_c_to_v(s, current, v, c);
-            }
+   }
+   if(!ok) {
+      fprintf(stderr, "Unable to set up the test vectors for %s\n", name);
+      failed++;
+   }
+   check_output_free(&ref);
+   check_output_free(&out);
+   check_output_free(&base_out);
+   check_vectors_free(&t);
+   free(app);
+   free(changed);
+   return failed;
+}
+
+
+// Run the regression checks over the benchmark's codes, or just
+// 'code' if one was given. Returns 0 if any failed.
+int check_suite(const struct code *only, const char *only_name, int n_i, int n_random, double budget_scale) {
+   int n_codes = only != NULL ? 1 : sizeof(bench_codes)/sizeof(bench_codes[0]);
+   int first = 1, failed = 0, n_run = 0, n_skipped = 0;
+
+   for(int c = 0; c < n_codes; c++) {
+      struct code *loaded = NULL;
+      const struct code *code = only;
+      const char *name = only_name;
+      if(only == NULL) {
+         name = bench_codes[c].name;
+         if(bench_codes[c].qc_file != NULL)
+            loaded = code_load_qc(bench_codes[c].qc_file, 0);
+         else
+            loaded = code_new_dense(&matrix[0][0], sizeof(matrix)/sizeof(matrix[0]), sizeof(matrix[0])/sizeof(matrix[0][0]));
+         code = loaded;
+      }
+      if(code == NULL) {
+         fprintf(stderr, "Unable to set up %s\n", name);
+         failed++;
+         continue;
+      }
+      // The paper's example goes first on its own code
+      failed += check_code(name, code, only == NULL && bench_codes[c].qc_file == NULL, n_i, n_random,
+                           budget_scale, &first, &n_run, &n_skipped);
+      if(loaded != NULL)
+         code_delete(loaded);
+   }
+   printf("%d checks, %d failed, %d skipped\n", n_run, failed, n_skipped);
+   return failed == 0;
+}
+
+
+// Traces
+//
+// -X writes the trace of the test vectors decoded by one decoder, and
+// -Y decodes the frames again with the decoder in the trace's header
+// and checks every iteration matches, after rounding to float. A
+// trace written by a build that is known to be good so catches any
+// change to the double or fixed point arithmetic.
+
+// The values of one iteration, as floats in the order they are
+// written
+static void trace_values(const struct code *code, const struct iteration *it, float *values) {
+   for(int e = 0; e < code->n_edges; e++) {
+      values[e]                 = it->message_v_to_c[e];
+      values[code->n_edges + e] = it->message_c_to_v[e];
+   }
+   for(int v = 0; v < code->n_v; v++) {
+      values[2*code->n_edges + v] = it->l[v];
+   }
+}
+
+
+static int run_write_trace(const struct code *code, const struct config *config, int n_i, int johnson,
+                           int n_random, const char *filename) {
+   struct trace_file_header h;
+   int n_v = code->n_v, n_values = 2*code->n_edges + n_v, rtn = 0;
+   struct check_vectors t;
+   int ok = check_make_vectors(&t, code, johnson, n_random);
+   float *values = malloc(sizeof(float) * n_values);
+   struct state *s = state_new(code, config, n_i, 1, NULL);
+   FILE *out = NULL;
+
+   if(config->engine != ENGINE_DOUBLE && config->engine != ENGINE_FIXED) {
+      fprintf(stderr, "Traces are of the double and fixed point engines\n");
+      rtn = 1;
+   } else if(!ok || values == NULL || s == NULL) {
+      fprintf(stderr, "Unable to allocate the decoder\n");
+      rtn = 1;
+   } else if((out = fopen(filename, "wb")) == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", filename);
+      rtn = 1;
+   }
+   if(out != NULL) {
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, TRACE_FILE_MAGIC, 8);
+      h.code_id  = code_hash(code);
+      h.n_frames = t.n_frames;
+      h.n_v      = n_v;
+      h.n_edges  = code->n_edges;
+      h.n_i      = n_i;
+      h.check    = config->check;
+      h.engine   = config->engine;
+      h.schedule = config->schedule;
+      h.q_bits   = config->q_bits;
+      h.offset   = config->offset;
+      h.scale    = config->scale;
+      h.q_scale  = config->q_scale;
+      fwrite(&h, sizeof(h), 1, out);
+      for(int f = 0; f < t.n_frames; f++) {
+         struct trace_frame_header fh;
+         fh.valid      = state_decode(s, t.llr_d + (size_t)f*n_v);
+         fh.iterations = state_iterations_used(s);
+         fwrite(t.llr + (size_t)f*n_v, sizeof(float), n_v, out);
+         fwrite(&fh, sizeof(fh), 1, out);
+         for(int it = 0; it < (int)fh.iterations; it++) {
+            const struct iteration *current = state_get_iteration(s, it);
+            trace_values(code, current, values);
+            fwrite(current->hard, sizeof(uint64_t), code->hard_words, out);
+            fwrite(current->syndrome, sizeof(uint64_t), code->syndrome_words, out);
+            fwrite(values, sizeof(float), n_values, out);
          }
       }
-      current = current->next;
+      int bad = ferror(out);
+      if(fclose(out) != 0 || bad) {
+         fprintf(stderr, "Unable to write '%s'\n", filename);
+         rtn = 1;
+      }
    }
+   if(s != NULL)
+      state_delete(s);
+   check_vectors_free(&t);
+   free(values);
+   return rtn;
 }
 
-void state_delete(struct state *s) {
-   while(s->first_iteration != NULL) {
-     struct iteration *x = s->first_iteration;
-     s->first_iteration = x->next;
-     free(x->l);
-     free(x->codeword);
-     free(x->parity);
-     for(int i = 0; i < s->n_c; i++) {
-        free(x->message_v_to_c[i]);
-        free(x->message_c_to_v[i]);
-     }
-     free(x->message_v_to_c);
-     free(x->message_c_to_v);
-     free(x);
+
+static int run_check_trace(const struct code *code, const char *filename) {
+   struct trace_file_header h;
+   struct config config;
+   int n_v = code->n_v, n_values = 2*code->n_edges + n_v, words = code->hard_words + code->syndrome_words;
+   int differ = 0, rtn = 0;
+   FILE *in = fopen(filename, "rb");
+
+   if(in == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", filename);
+      return 1;
    }
-   free(s->channel);
-   free(s->channel_llr);
-   for(int i = 0; i < s->n_c; i++) {
-      free(s->matrix[i]); 
+   if(fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, TRACE_FILE_MAGIC, 8) != 0) {
+      fprintf(stderr, "Bad trace file header\n");
+      fclose(in);
+      return 1;
+   }
+   if(h.code_id != code_hash(code) || h.n_v != n_v || h.n_edges != code->n_edges) {
+      fprintf(stderr, "The trace is not for this code\n");
+      fclose(in);
+      return 1;
+   }
+   config_default(&config);
+   config.check    = h.check;
+   config.engine   = h.engine;
+   config.schedule = h.schedule;
+   config.q_bits   = h.q_bits;
+   config.offset   = h.offset;
+   config.scale    = h.scale;
+   config.q_scale  = h.q_scale;
+
+   // Assumes malloc() always succeeds...
+   float *llr      = malloc(sizeof(float) * n_v);
+   double *llr_d   = malloc(sizeof(double) * n_v);
+   float *values   = malloc(sizeof(float) * n_values);
+   float *expected = malloc(sizeof(float) * n_values);
+   uint64_t *bits  = malloc(sizeof(uint64_t) * words);
+   struct state *s = h.check < CHECK_ALGORITHM_COUNT && h.n_i > 0 ? state_new(code, &config, h.n_i, 1, NULL) : NULL;
+   if(s == NULL) {
+      fprintf(stderr, "Unable to allocate the trace's decoder\n");
+      rtn = 1;
+   }
+
+   for(uint64_t f = 0; !rtn && f < h.n_frames; f++) {
+      struct trace_frame_header fh;
+      if(fread(llr, sizeof(float), n_v, in) != n_v || fread(&fh, sizeof(fh), 1, in) != 1) {
+         fprintf(stderr, "The trace file is short\n");
+         rtn = 1;
+         break;
+      }
+      for(int v = 0; v < n_v; v++) {
+         llr_d[v] = llr[v];
+      }
+      int valid = state_decode(s, llr_d);
+      int used = state_iterations_used(s);
+      int same = valid == (int)fh.valid && used == (int)fh.iterations;
+      if(!same)
+         fprintf(stderr, "Frame %llu: %d iterations and %s, the trace has %u and %s\n", (unsigned long long)f,
+                 used, valid ? "valid" : "not valid", (unsigned)fh.iterations, fh.valid ? "valid" : "not valid");
+      for(int it = 0; it < (int)fh.iterations; it++) {
+         if(fread(bits, sizeof(uint64_t), words, in) != words ||
+            fread(expected, sizeof(float), n_values, in) != n_values) {
+            fprintf(stderr, "The trace file is short\n");
+            rtn = 1;
+            break;
+         }
+         if(!same || it >= used)
+            continue;
+         const struct iteration *current = state_get_iteration(s, it);
+         trace_values(code, current, values);
+         if(memcmp(bits, current->hard, sizeof(uint64_t) * code->hard_words) != 0 ||
+            memcmp(bits + code->hard_words, current->syndrome, sizeof(uint64_t) * code->syndrome_words) != 0 ||
+            memcmp(values, expected, sizeof(float) * n_values) != 0) {
+            fprintf(stderr, "Frame %llu differs from iteration %d\n", (unsigned long long)f, it+1);
+            same = 0;
+         }
+      }
+      differ += !same;
    }
-   free(s->matrix);
-   free(s);
+   if(!rtn) {
+      printf("%llu frames, %d differ\n", (unsigned long long)h.n_frames, differ);
+      rtn = differ != 0;
+   }
+   if(s != NULL)
+      state_delete(s);
+   fclose(in);
+   free(llr);
+   free(llr_d);
+   free(values);
+   free(expected);
+   free(bits);
+   return rtn;
 }
 
-int process_keys(struct state *s) {
+
+#ifndef NO_CURSES
+int process_keys(struct viewer *s) {
    int key = getch();
    switch(key) {
       case 27  :  return 0; 
@@ -368,14 +1692,48 @@ int process_keys(struct state *s) {
       case 'q' :
       case 'Q' :  return 0; 
 
+      case 'm' :
+      case 'M' :  s->config.check = (s->config.check+1) % CHECK_ALGORITHM_COUNT;
+                  if(s->config.engine == ENGINE_FIXED && s->config.check == CHECK_SUM_PRODUCT)
+                     s->config.check++;
+                  state_set_config(s->s, &s->config);
+                  viewer_solve(s);
+                  break;
+
+      case 'l' :
+      case 'L' :  s->config.schedule = !s->config.schedule;
+                  state_set_config(s->s, &s->config);
+                  viewer_solve(s);
+                  break;
+
       case KEY_PPAGE:  if(s->page > 0)
                           s->page--;
                        break;
  
-      case KEY_NPAGE:  if(s->page < s->iterations-1)
+      case KEY_NPAGE:  if(s->page < state_iterations_used(s->s)-1)
                           s->page++;
                        break;
  
+      case 's' :
+      case 'S' :  s->view = s->view == VIEW_MESSAGES ? VIEW_SUMMARY : VIEW_MESSAGES;
+                  break;
+
+      case '[' :  s->first_c -= viewer_rows(s);
+                  break;
+
+      case ']' :  s->first_c += viewer_rows(s);
+                  break;
+
+      case '<' :  s->cursor = s->cursor > viewer_columns(s) ? s->cursor - viewer_columns(s) : 0;
+                  s->first_v = s->first_v > viewer_columns(s) ? s->first_v - viewer_columns(s) : 0;
+                  break;
+
+      case '>' :  s->cursor = s->cursor + viewer_columns(s) < s->n_v ? s->cursor + viewer_columns(s) : s->n_v-1;
+                  s->first_v += viewer_columns(s);
+                  if(s->first_v > s->n_v - viewer_columns(s))
+                     s->first_v = s->n_v - viewer_columns(s);
+                  break;
+
       case KEY_LEFT:   if(s->cursor == 0)
                            s->cursor = s->n_v-1;
                        else
@@ -393,7 +1751,7 @@ int process_keys(struct state *s) {
                           s->channel[s->cursor] -= 0.01001;
                        else
                           s->channel[s->cursor] = 0.01;
-                       state_solve(s);
+                       viewer_solve_cursor(s);
                        break;
 
       case KEY_DOWN:   s->channel[s->cursor] = floor(s->channel[s->cursor]*100)/100;
@@ -401,7 +1759,7 @@ int process_keys(struct state *s) {
                           s->channel[s->cursor] += 0.01001;
                        else
                           s->channel[s->cursor] = 0.99;
-                       state_solve(s);
+                       viewer_solve_cursor(s);
 
                        break;
    };
@@ -422,12 +1780,20 @@ void welcome_screen(void) {
 }
 
 
-int main(int argc, char *argv[]) {
-   struct state *s;
+static int run_interactive(const struct code *code, const struct config *config, int n_i) {
+   struct viewer viewer;
+   struct viewer *s = &viewer;
+   if(!viewer_init(s, code, config, n_i)) {
+      fprintf(stderr, "Unable to allocate the decoder\n");
+      viewer_free(s);
+      return 1;
+   }
+
    initscr();
    if(!has_colors()) {
       endwin();
       fprintf(stderr,"Console does not support color\n");
+      viewer_free(s);
       return 0;
    }
    start_color();
@@ -441,13 +1807,795 @@ int main(int argc, char *argv[]) {
 
    welcome_screen(); 
 
-   s = state_new(N_ITERATIONS);
-   state_solve(s);
+   viewer_solve(s);
 
    do {
       state_display(s);
    } while(process_keys(s));
-   state_delete(s);
 
    endwin();
+   viewer_free(s);
+   return 0;
+}
+#endif
+
+
+// One line of batch output for a frame
+static void print_frame(char *line, const uint8_t *bits, int n_v, long frame, const struct frame_result *r) {
+   for(int i = 0; i < n_v; i++) {
+      line[i] = bits[i] ? '1' : '0';
+   }
+   line[n_v] = '\0';
+   printf("%s frame=%ld valid=%d iterations=%d unsatisfied=%d\n",
+          line, frame, r->valid, r->iterations, r->unsatisfied);
+}
+
+
+// Read frames of n_v LLRs (positive means a '0' is more likely)
+// and decode each one. For each frame a line is written giving the
+// hard decision, whether it is a valid codeword, the number of
+// iterations used and the number of unsatisfied checks at the end.
+// Frames are decoded batch_frames at a time per decoder.
+static int run_batch(const struct code *code, struct state *s, struct pool *pool, FILE *in,
+                     int batch_frames) {
+   int frame = 0;
+   int n_v = code->n_v;
+   int n_read = pool ? batch_frames * pool_workers(pool) * 8 : batch_frames;
+   // Assumes malloc() always succeeds...
+   float *llr = malloc(sizeof(float) * n_v * n_read);
+   uint8_t *bits = malloc(n_v * n_read);
+   char *line = malloc(n_v+1);
+   struct frame_result *results = malloc(sizeof(struct frame_result) * n_read);
+   int rtn = 0;
+
+   while(1) {
+      // Read as many frames as will fit in a batch
+      int i = 0, n;
+      STATS_START(t_read);
+      for(n = 0; n < n_read; n++) {
+         for(i = 0; i < n_v; i++) {
+            if(fscanf(in, "%f", &llr[n*n_v+i]) != 1)
+               break;
+         }
+         if(i != n_v)
+            break;
+      }
+      if(i != 0 && i != n_v) {
+         fprintf(stderr, "Frame %d is short (%d of %d LLRs)\n", frame+n, i, n_v);
+         rtn = 1;
+      }
+      STATS_LAP(t_read, PHASE_IO);
+
+      if(pool)
+         pool_decode(pool, llr, n, bits, results);
+      else
+         state_decode_frames(s, llr, n, bits, results);
+      STATS_START(t_write);
+      for(int f = 0; f < n; f++) {
+         print_frame(line, bits + f*n_v, n_v, frame, &results[f]);
+         frame++;
+      }
+      STATS_LAP(t_write, PHASE_IO);
+      if(n != n_read)
+         break;
+   }
+   free(llr);
+   free(bits);
+   free(line);
+   free(results);
+   return rtn;
+}
+
+
+// Decode text frames as run_batch() does, but through a queue. Each
+// frame is submitted as soon as it is read, with the queue's latency
+// as its deadline, and the lines are written in frame order as frames
+// complete. At the end the number of frames that missed their
+// deadline is given on stderr.
+#define QUEUE_WINDOW 4096   // Frames submitted and not yet written, at most
+
+static int run_batch_queue(const struct code *code, struct queue *q, FILE *in) {
+   int n_v = code->n_v;
+   // Assumes malloc() always succeeds...
+   float *llr = malloc(sizeof(float) * n_v);
+   uint8_t *bits = malloc((size_t)n_v * QUEUE_WINDOW);
+   struct frame_result *results = malloc(sizeof(struct frame_result) * QUEUE_WINDOW);
+   char *ready = calloc(QUEUE_WINDOW, 1);
+   char *line = malloc(n_v+1);
+   long submitted = 0, written = 0, late = 0;
+   int have_frame = 0, eof = 0, rtn = 0;
+   struct queue_done done;
+
+   while(!eof || written < submitted) {
+      if(!have_frame && !eof) {
+         int i;
+         for(i = 0; i < n_v; i++) {
+            if(fscanf(in, "%f", &llr[i]) != 1)
+               break;
+         }
+         if(i == n_v) {
+            have_frame = 1;
+         } else {
+            if(i != 0) {
+               fprintf(stderr, "Frame %ld is short (%d of %d LLRs)\n", submitted, i, n_v);
+               rtn = 1;
+            }
+            eof = 1;
+            queue_flush(q);
+         }
+      }
+      if(have_frame && submitted - written < QUEUE_WINDOW &&
+         queue_submit(q, llr, bits + (submitted % QUEUE_WINDOW) * n_v, 0, NULL, NULL) >= 0) {
+         submitted++;
+         have_frame = 0;
+      }
+
+      // Take what has finished, waiting when there is nothing else to do
+      int wait = have_frame || eof;
+      while(queue_complete(q, &done, wait)) {
+         results[done.id % QUEUE_WINDOW] = done.result;
+         ready[done.id % QUEUE_WINDOW] = 1;
+         late += done.late;
+         wait = 0;
+      }
+      while(written < submitted && ready[written % QUEUE_WINDOW]) {
+         int k = written % QUEUE_WINDOW;
+         print_frame(line, bits + (size_t)k*n_v, n_v, written, &results[k]);
+         ready[k] = 0;
+         written++;
+      }
+   }
+   if(late > 0)
+      fprintf(stderr, "%ld of %ld frames finished after their deadline\n", late, submitted);
+   free(llr);
+   free(bits);
+   free(results);
+   free(ready);
+   free(line);
+   return rtn;
+}
+
+
+// Binary batch decoding
+//
+// An LLR file (see ldpc.h) that is a regular file is mapped, and the
+// decoders read the frames straight from the mapped pages. From a
+// pipe, a chunk of frames at a time is read into one buffer and
+// decoded from there. With an output file the hard decisions are
+// written as a hard decision file: when it is a regular file it is
+// mapped and the decoders write the packed bits and results straight
+// into it, otherwise each chunk of packed bits is written as it is
+// done and the results are copied in after the last chunk. Without
+// one, a text line is written per frame as for text input.
+static int run_batch_binary(const struct code *code, struct state *s, struct pool *pool, FILE *in,
+                            const char *output_file, int batch_frames) {
+   struct llr_file_header h;
+   struct hard_file_header oh;
+   struct stat st;
+   int n_v = code->n_v, words = WORDS(n_v);
+   int n_read = (pool ? batch_frames * pool_workers(pool) : batch_frames) * 8;
+   long start = ftell(in);
+   size_t sample;
+
+   if(fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, LLR_FILE_MAGIC, 8) != 0) {
+      fprintf(stderr, "Bad LLR file header\n");
+      return 1;
+   }
+   if(h.n_v != n_v || (h.code_id != 0 && h.code_id != code_hash(code))) {
+      fprintf(stderr, "The LLR file is not for this code\n");
+      return 1;
+   }
+   if(h.type == LLR_FLOAT32) {
+      sample = sizeof(float);
+   } else if(h.type == LLR_INT8 && h.scale > 0) {
+      sample = sizeof(int8_t);
+   } else {
+      fprintf(stderr, "Unknown LLR type %u\n", (unsigned)h.type);
+      return 1;
+   }
+   size_t frame_bytes = sample * n_v;
+   size_t out_frame_bytes = sizeof(uint64_t) * words + sizeof(struct frame_result);
+   if(h.n_frames > (SIZE_MAX - sizeof(oh)) / out_frame_bytes) {
+      fprintf(stderr, "Bad LLR file header\n");
+      return 1;
+   }
+
+   // Map the input if we can
+   void *in_map = MAP_FAILED;
+   size_t in_size = 0;
+   const char *frames = NULL;
+   if(start >= 0 && fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode)) {
+      in_size = st.st_size;
+      if(in_size < start + sizeof(h) || h.n_frames > (in_size - start - sizeof(h)) / frame_bytes) {
+         fprintf(stderr, "The LLR file is short\n");
+         return 1;
+      }
+      in_map = mmap(NULL, in_size, PROT_READ, MAP_PRIVATE, fileno(in), 0);
+      if(in_map != MAP_FAILED) {
+         madvise(in_map, in_size, MADV_SEQUENTIAL);
+         frames = (const char *)in_map + start + sizeof(h);
+      }
+   }
+
+   // And the output
+   FILE *out = NULL;
+   void *out_map = MAP_FAILED;
+   size_t out_size = sizeof(oh) + h.n_frames * out_frame_bytes;
+   uint64_t *packed_out = NULL;
+   struct frame_result *results_out = NULL;
+   if(output_file != NULL) {
+      out = strcmp(output_file, "-") ? fopen(output_file, "w+") : stdout;
+      if(out == NULL) {
+         fprintf(stderr, "Unable to open '%s'\n", output_file);
+         if(in_map != MAP_FAILED)
+            munmap(in_map, in_size);
+         return 1;
+      }
+      memset(&oh, 0, sizeof(oh));
+      memcpy(oh.magic, HARD_FILE_MAGIC, 8);
+      oh.code_id  = code_hash(code);
+      oh.n_frames = h.n_frames;
+      oh.n_v      = n_v;
+      oh.words    = words;
+      if(fstat(fileno(out), &st) == 0 && S_ISREG(st.st_mode) && ftruncate(fileno(out), out_size) == 0)
+         out_map = mmap(NULL, out_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+      if(out_map != MAP_FAILED) {
+         memcpy(out_map, &oh, sizeof(oh));
+         packed_out  = (uint64_t *)((char *)out_map + sizeof(oh));
+         results_out = (struct frame_result *)(packed_out + h.n_frames * words);
+      } else {
+         fwrite(&oh, sizeof(oh), 1, out);
+      }
+   }
+
+   // Anything that is not mapped goes through a chunk's worth of
+   // buffer. Streamed results go to a temporary file a chunk at a
+   // time, and are copied to the end of the output after the bits.
+   char *buffer   = frames == NULL ? malloc(frame_bytes * n_read) : NULL;
+   uint8_t *bits  = out == NULL ? malloc(n_v * n_read) : NULL;
+   char *line     = out == NULL ? malloc(n_v+1) : NULL;
+   uint64_t *packed = out != NULL && packed_out == NULL ? malloc(sizeof(uint64_t) * words * n_read) : NULL;
+   struct frame_result *results = results_out == NULL ? malloc(sizeof(struct frame_result) * n_read) : NULL;
+   FILE *spill = out != NULL && results_out == NULL ? tmpfile() : NULL;
+   int rtn = 0;
+
+   if((frames == NULL && buffer == NULL) || (out == NULL && (bits == NULL || line == NULL)) ||
+      (out != NULL && packed_out == NULL && packed == NULL) || (results_out == NULL && results == NULL)) {
+      fprintf(stderr, "Unable to allocate the frame buffers\n");
+      rtn = 1;
+      h.n_frames = 0;
+   } else if(out != NULL && results_out == NULL && spill == NULL) {
+      fprintf(stderr, "Unable to open a temporary file for the results\n");
+      rtn = 1;
+      h.n_frames = 0;
+   }
+
+   for(uint64_t first = 0; first < h.n_frames; first += n_read) {
+      int n = h.n_frames - first < n_read ? h.n_frames - first : n_read;
+      struct frame_io io;
+
+      STATS_START(t_read);
+      if(frames != NULL) {
+         io.llr = frames + first * frame_bytes;
+      } else if(fread(buffer, frame_bytes, n, in) != n) {
+         fprintf(stderr, "The LLR file is short\n");
+         rtn = 1;
+         break;
+      } else {
+         io.llr = buffer;
+      }
+      STATS_LAP(t_read, PHASE_IO);
+      io.type    = h.type;
+      io.scale   = h.scale;
+      io.bits    = bits;
+      io.packed  = packed_out != NULL ? packed_out + first * words : packed;
+      io.results = results_out != NULL ? results_out + first : results;
+      io.app       = NULL;
+      io.extrinsic = NULL;
+      io.rm        = NULL;
+      if(pool)
+         pool_decode_io(pool, &io, 0, n);
+      else
+         state_decode_io(s, &io, 0, n);
+
+      STATS_START(t_write);
+      if(packed != NULL && fwrite(packed, sizeof(uint64_t) * words, n, out) != n)
+         rtn = 1;
+      if(spill != NULL && fwrite(results, sizeof(struct frame_result), n, spill) != n)
+         rtn = 1;
+      for(int f = 0; out == NULL && f < n; f++) {
+         print_frame(line, bits + (size_t)f*n_v, n_v, first + f, &results[f]);
+      }
+      STATS_LAP(t_write, PHASE_IO);
+   }
+
+   if(spill != NULL && !rtn) {
+      rewind(spill);
+      for(uint64_t first = 0; !rtn && first < h.n_frames; first += n_read) {
+         int n = h.n_frames - first < n_read ? h.n_frames - first : n_read;
+         if(fread(results, sizeof(struct frame_result), n, spill) != n ||
+            fwrite(results, sizeof(struct frame_result), n, out) != n)
+            rtn = 1;
+      }
+   }
+   if(spill != NULL)
+      fclose(spill);
+   if(out_map != MAP_FAILED && munmap(out_map, out_size) != 0)
+      rtn = 1;
+   if(out != NULL && out != stdout && fclose(out) != 0)
+      rtn = 1;
+   if(out == stdout && fflush(out) != 0)
+      rtn = 1;
+   if(rtn && output_file != NULL)
+      fprintf(stderr, "Unable to write '%s'\n", output_file);
+   if(in_map != MAP_FAILED)
+      munmap(in_map, in_size);
+   free(buffer);
+   free(bits);
+   free(line);
+   free(packed);
+   free(results);
+   return rtn;
+}
+
+
+// Read text frames of n_v LLRs and write them out as a float LLR file
+// for the code, for decoding with -i
+static int run_write_llr(const struct code *code, FILE *in, const char *filename) {
+   struct llr_file_header h;
+   int n_v = code->n_v, i = 0, rtn = 0;
+   float *llr = malloc(sizeof(float) * n_v);
+   FILE *out = fopen(filename, "wb");
+
+   if(out == NULL || llr == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", filename);
+      free(llr);
+      return 1;
+   }
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, LLR_FILE_MAGIC, 8);
+   h.code_id = code_hash(code);
+   h.n_v     = n_v;
+   h.type    = LLR_FLOAT32;
+   fwrite(&h, sizeof(h), 1, out);
+   while(1) {
+      for(i = 0; i < n_v; i++) {
+         if(fscanf(in, "%f", &llr[i]) != 1)
+            break;
+      }
+      if(i != n_v)
+         break;
+      fwrite(llr, sizeof(float), n_v, out);
+      h.n_frames++;
+   }
+   if(i != 0) {
+      fprintf(stderr, "Frame %llu is short (%d of %d LLRs)\n", (unsigned long long)h.n_frames, i, n_v);
+      rtn = 1;
+   }
+   // Now the frame count is known
+   if(fseek(out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, out) != 1 || fclose(out) != 0) {
+      fprintf(stderr, "Unable to write '%s'\n", filename);
+      rtn = 1;
+   }
+   free(llr);
+   return rtn;
+}
+
+
+// Read frames of k data bits, as '0' and '1' characters, and write
+// out each codeword on a line.
+static int run_encode(const struct code *code, FILE *in) {
+   struct encoder *e = encoder_new(code);
+   int n_v = code->n_v, frame = 0, rtn = 0;
+   uint64_t *data, *codeword, *scratch;
+   char *line;
+
+   if(e == NULL) {
+      fprintf(stderr, "Unable to build an encoder for this code\n");
+      return 1;
+   }
+   // Assumes malloc() always succeeds...
+   int k = encoder_k(e);
+   data     = malloc(sizeof(uint64_t) * (WORDS(k) + 1));
+   codeword = malloc(sizeof(uint64_t) * WORDS(n_v));
+   scratch  = malloc(sizeof(uint64_t) * (encoder_scratch_words(e) + 1));
+   line     = malloc(n_v+1);
+   while(1) {
+      int i = 0, c = 0;
+      memset(data, 0, sizeof(uint64_t) * (WORDS(k) + 1));
+      while(i < k && (c = fgetc(in)) != EOF) {
+         if(c == '0' || c == '1') {
+            if(c == '1')
+               bit_flip(data, i);
+            i++;
+         } else if(c > ' ') {
+            break;
+         }
+      }
+      if(i != k) {
+         if(i != 0 || (c != EOF && c > ' ')) {
+            fprintf(stderr, "Frame %d is short (%d of %d bits)\n", frame, i, k);
+            rtn = 1;
+         }
+         break;
+      }
+      encoder_encode(e, data, codeword, scratch);
+      for(i = 0; i < n_v; i++)
+         line[i] = bit_get(codeword, i) ? '1' : '0';
+      line[n_v] = '\0';
+      printf("%s\n", line);
+      frame++;
+   }
+   free(data);
+   free(codeword);
+   free(scratch);
+   free(line);
+   encoder_delete(e);
+   return rtn;
+}
+
+
+static void usage(const char *name) {
+   fprintf(stderr, "Usage: %s [-a file.alist] [-q file.qc [-z Z]] [-C dir] [-n iterations] [-m alg] [-f bits[:scale] | -s | -g] [-l] [-b [-t threads] [-T threads] [-A ms] [-i file] [-o file]] [-e [-i file]]\n"
+                   "          [-S start:stop:step [-E errors] [-H count | -R e[:p[:f[:s]]]] [-F frames] [-r seed] [-t threads]] [-D seconds] [-W file [-i file]]\n"
+                   "          [-V scale [-F frames] | -X file [-F frames] | -Y file]\n", name);
+   fprintf(stderr, "  -a file   Load the parity check matrix from an alist file\n");
+   fprintf(stderr, "  -q file   Load a quasi-cyclic base matrix file\n");
+   fprintf(stderr, "  -z Z      Lifting size for the base matrix (overrides the file)\n");
+   fprintf(stderr, "  -C dir    Keep the built code and encoder tables in dir, and map them from there\n");
+   fprintf(stderr, "            when the same code is loaded again\n");
+   fprintf(stderr, "  -n count  Maximum number of iterations (default %d)\n", N_ITERATIONS);
+   fprintf(stderr, "  -m alg    Check node algorithm: sp (sum-product, the default), ms (min-sum),\n");
+   fprintf(stderr, "            oms[:offset] (offset min-sum) or nms[:scale] (normalized min-sum)\n");
+   fprintf(stderr, "  -f fmt    Use the fixed point engine. fmt is bits[:scale], the message width\n");
+   fprintf(stderr, "            and the units per 1.0 of LLR (default 6:2). Needs a min-sum -m\n");
+   fprintf(stderr, "  -s        Use the single precision engine (batch and simulation only)\n");
+   fprintf(stderr, "  -g        Use the GPU engine (batch and simulation only, needs a min-sum -m\n");
+   fprintf(stderr, "            and a build with LDPC_OPENCL)\n");
+   fprintf(stderr, "  -l        Use the layered schedule rather than flooding\n");
+   fprintf(stderr, "  -b        Batch mode, decode LLR frames without the display\n");
+   fprintf(stderr, "  -t count  Number of decoder threads in batch mode\n");
+   fprintf(stderr, "  -T count  Number of threads to split each frame across in batch mode\n");
+   fprintf(stderr, "  -A ms     Decode text frames as they are read on -t threads, batching frames\n");
+   fprintf(stderr, "            for up to ms milliseconds each\n");
+   fprintf(stderr, "  -i file   Read batch LLR frames (or data to encode) from a file rather than stdin\n");
+   fprintf(stderr, "            Binary LLR files (see -W) are recognised by their header\n");
+   fprintf(stderr, "  -o file   Write the hard decisions of a binary LLR file as a binary file (- for stdout)\n");
+   fprintf(stderr, "  -W file   Convert text LLR frames to a binary LLR file for the code\n");
+   fprintf(stderr, "  -e        Encode frames of data bits rather than decoding\n");
+   fprintf(stderr, "  -G file   Write a decoder specialised to the code and -n, for make ldpc_special\n");
+   fprintf(stderr, "  -B fmt    Run the benchmark (on the -a or -q code if given), fmt is text, csv or json\n");
+   fprintf(stderr, "  -S a:b:c  Simulate over an AWGN channel, at Eb/N0 from a to b dB in steps of c\n");
+   fprintf(stderr, "  -E count  Frame errors to collect at each simulation point (default 100)\n");
+   fprintf(stderr, "  -H count  Simulate HARQ, sending frames that fail up to count times in all\n");
+   fprintf(stderr, "  -R rm     Simulate rate matching, e[:punctured[:filler[:start]]]: send e bits from\n");
+   fprintf(stderr, "            the codeword less its first punctured bits and filler last data bits,\n");
+   fprintf(stderr, "            as a circular buffer from start\n");
+   fprintf(stderr, "  -F count  Most frames to simulate at each point (default 1000000),\n");
+   fprintf(stderr, "            frames per benchmark run (default 64), or random test vectors for -V and\n");
+   fprintf(stderr, "            -X (default %d)\n", CHECK_FRAMES);
+   fprintf(stderr, "  -r seed   Simulation random seed (default 1)\n");
+   fprintf(stderr, "  -D secs   Write the decoder statistics to stderr every secs seconds and at\n");
+   fprintf(stderr, "            the end (needs a build with LDPC_STATS)\n");
+   fprintf(stderr, "  -V scale  Run the regression checks (on the -a or -q code if given), with the run\n");
+   fprintf(stderr, "            time budgets scaled by scale (0 to not enforce them)\n");
+   fprintf(stderr, "  -X file   Write a convergence trace of the test vectors decoded with the -m, -f\n");
+   fprintf(stderr, "            and -l decoder (double or fixed point)\n");
+   fprintf(stderr, "  -Y file   Decode the frames in a trace again and check every iteration matches\n");
+   fprintf(stderr, "With no matrix file the example from the paper is used.\n");
+}
+
+
+int main(int argc, char *argv[]) {
+   struct state *s;
+   struct pool *pool;
+   struct code *code;
+   const char *alist_file = NULL;
+   const char *qc_file = NULL;
+   const char *input_file = NULL;
+   const char *output_file = NULL;
+   const char *llr_file = NULL;
+   const char *cache_dir = NULL;
+#ifdef NO_CURSES
+   int batch = 1;
+#else
+   int batch = 0;
+#endif
+   int z = 0;
+#ifdef LDPC_SPECIAL
+   int n_iterations = state_special_iterations();
+#else
+   int n_iterations = N_ITERATIONS;
+#endif
+   int n_threads = 1;
+   int n_team = 1;
+   int simulation = 0;
+   int encode = 0;
+   const char *special_file = NULL;
+   int bench = -1;
+   double budget_scale = -1;
+   const char *trace_file = NULL;
+   const char *check_file = NULL;
+   long frames = 0;
+   double dump_seconds = 0;
+   double latency = -1;
+   struct queue *queue = NULL;
+   struct sim_settings sim = { 0, 0, 1, 100, 1000000, 1, 1, 1, 0, 0, 0, 0 };
+   int opt, rtn;
+   struct config config;
+
+   config_default(&config);
+
+   while((opt = getopt(argc, argv, "a:q:z:C:n:m:f:sglbt:T:A:i:o:W:eG:B:S:E:H:R:F:r:D:V:X:Y:h")) != -1) {
+      switch(opt) {
+         case 'a': alist_file = optarg;       break;
+         case 'q': qc_file    = optarg;       break;
+         case 'z': z          = atoi(optarg); break;
+         case 'C': cache_dir  = optarg;       break;
+         case 'n': n_iterations = atoi(optarg); break;
+         case 'm': if(!config_parse_check(&config, optarg)) {
+                      fprintf(stderr, "Unknown check node algorithm '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'f': if(!config_parse_fixed(&config, optarg)) {
+                      fprintf(stderr, "Bad fixed point format '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 's': config.engine   = ENGINE_FLOAT;     break;
+         case 'g': config.engine   = ENGINE_GPU;       break;
+         case 'l': config.schedule = SCHEDULE_LAYERED; break;
+         case 'b': batch      = 1;            break;
+         case 't': n_threads  = atoi(optarg); break;
+         case 'T': n_team     = atoi(optarg); break;
+         case 'A': latency    = atof(optarg) / 1000;
+                   if(latency < 0) {
+                      fprintf(stderr, "Bad latency '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'i': input_file = optarg;       break;
+         case 'o': output_file = optarg;      break;
+         case 'W': llr_file   = optarg;       break;
+         case 'e': encode     = 1;            break;
+         case 'G': special_file = optarg;     break;
+         case 'B': if(!strcmp(optarg, "text"))
+                      bench = BENCH_TEXT;
+                   else if(!strcmp(optarg, "csv"))
+                      bench = BENCH_CSV;
+                   else if(!strcmp(optarg, "json"))
+                      bench = BENCH_JSON;
+                   else {
+                      fprintf(stderr, "Unknown benchmark output format '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'S': if(sscanf(optarg, "%lf:%lf:%lf", &sim.start, &sim.stop, &sim.step) != 3 || sim.step <= 0) {
+                      fprintf(stderr, "Bad simulation range '%s'\n", optarg);
+                      return 1;
+                   }
+                   simulation = 1;
+                   break;
+         case 'E': sim.target_errors = atoi(optarg);   break;
+         case 'H': sim.max_transmissions = atoi(optarg); break;
+         case 'R': if(sscanf(optarg, "%d:%d:%d:%d", &sim.rm_e, &sim.rm_punctured, &sim.rm_filler, &sim.rm_start) < 1 ||
+                      sim.rm_e <= 0) {
+                      fprintf(stderr, "Bad rate matching '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'F': frames = atol(optarg);  break;
+         case 'r': sim.seed          = strtoull(optarg, NULL, 0); break;
+         case 'D': dump_seconds = atof(optarg);
+                   if(dump_seconds <= 0) {
+                      fprintf(stderr, "Bad statistics interval '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'V': budget_scale = atof(optarg);
+                   if(budget_scale < 0) {
+                      fprintf(stderr, "Bad budget scale '%s'\n", optarg);
+                      return 1;
+                   }
+                   break;
+         case 'X': trace_file = optarg;       break;
+         case 'Y': check_file = optarg;       break;
+         default:  usage(argv[0]);
+                   return 1;
+      }
+   }
+
+   if(dump_seconds > 0) {
+#ifdef LDPC_STATS
+      if(!stats_start_dump(stderr, dump_seconds)) {
+         fprintf(stderr, "Unable to start the statistics thread\n");
+         return 1;
+      }
+      atexit(stats_stop_dump);
+#else
+      fprintf(stderr, "Statistics need a build with LDPC_STATS (make ldpc_stats)\n");
+      return 1;
+#endif
+   }
+   if(frames > 0)
+      sim.max_frames = frames;
+   if(bench >= 0 && alist_file == NULL && qc_file == NULL) {
+      if(n_iterations < 1) {
+         fprintf(stderr, "Need at least one iteration\n");
+         return 1;
+      }
+      return !benchmark(NULL, NULL, n_iterations, frames > 0 ? frames : 64, bench);
+   }
+   if(budget_scale >= 0 && alist_file == NULL && qc_file == NULL) {
+      if(n_iterations < 1) {
+         fprintf(stderr, "Need at least one iteration\n");
+         return 1;
+      }
+      return !check_suite(NULL, NULL, n_iterations, frames > 0 ? frames : CHECK_FRAMES, budget_scale);
+   }
+
+   if(alist_file != NULL)
+      code = code_load_cached(cache_dir, alist_file, 0, 0);
+   else if(qc_file != NULL)
+      code = code_load_cached(cache_dir, qc_file, 1, z);
+   else
+      code = code_new_dense(&matrix[0][0], sizeof(matrix)/sizeof(matrix[0]), sizeof(matrix[0])/sizeof(matrix[0][0]));
+   if(code == NULL)
+      return 1;
+
+   if(config.engine == ENGINE_FIXED && config.check == CHECK_SUM_PRODUCT) {
+      fprintf(stderr, "The fixed point engine needs a min-sum check node algorithm\n");
+      code_delete(code);
+      return 1;
+   }
+   if(check_file != NULL) {
+      rtn = run_check_trace(code, check_file);
+      code_delete(code);
+      return rtn;
+   }
+   if(config.engine == ENGINE_FLOAT && !batch && !simulation) {
+      fprintf(stderr, "The single precision engine is only for batch decoding and simulation\n");
+      code_delete(code);
+      return 1;
+   }
+   if(config.engine == ENGINE_GPU && ((!batch && !simulation) || config.check == CHECK_SUM_PRODUCT)) {
+      fprintf(stderr, "The GPU engine is only for batch decoding and simulation, with a min-sum -m\n");
+      code_delete(code);
+      return 1;
+   }
+   if(n_iterations < 1) {
+      fprintf(stderr, "Need at least one iteration\n");
+      code_delete(code);
+      return 1;
+   }
+   if(bench >= 0) {
+      rtn = !benchmark(code, alist_file ? alist_file : qc_file, n_iterations, frames > 0 ? frames : 64, bench);
+      code_delete(code);
+      return rtn;
+   }
+   if(budget_scale >= 0) {
+      rtn = !check_suite(code, alist_file ? alist_file : qc_file, n_iterations, frames > 0 ? frames : CHECK_FRAMES,
+                         budget_scale);
+      code_delete(code);
+      return rtn;
+   }
+   if(trace_file != NULL) {
+      rtn = run_write_trace(code, &config, n_iterations, alist_file == NULL && qc_file == NULL,
+                            frames > 0 ? frames : CHECK_FRAMES, trace_file);
+      code_delete(code);
+      return rtn;
+   }
+   if(special_file != NULL) {
+      FILE *out = fopen(special_file, "w");
+      const char *source = alist_file ? alist_file : qc_file ? qc_file : "the built in example";
+      rtn = 0;
+      if(out == NULL || !code_write_special(code, n_iterations, source, out)) {
+         fprintf(stderr, "Unable to write '%s'\n", special_file);
+         rtn = 1;
+      }
+      if(out != NULL && fclose(out) != 0)
+         rtn = 1;
+      code_delete(code);
+      return rtn;
+   }
+   if(encode) {
+      FILE *in = stdin;
+      if(input_file != NULL && (in = fopen(input_file, "r")) == NULL) {
+         fprintf(stderr, "Unable to open '%s'\n", input_file);
+         rtn = 1;
+      } else {
+         rtn = run_encode(code, in);
+         if(in != stdin)
+            fclose(in);
+      }
+      code_delete(code);
+      return rtn;
+   }
+   if(llr_file != NULL) {
+      FILE *in = stdin;
+      if(input_file != NULL && (in = fopen(input_file, "r")) == NULL) {
+         fprintf(stderr, "Unable to open '%s'\n", input_file);
+         rtn = 1;
+      } else {
+         rtn = run_write_llr(code, in, llr_file);
+         if(in != stdin)
+            fclose(in);
+      }
+      code_delete(code);
+      return rtn;
+   }
+   if(simulation && sim.rm_e > 0 && sim.max_transmissions > 1) {
+      fprintf(stderr, "HARQ (-H) and rate matching (-R) cannot be simulated together\n");
+      code_delete(code);
+      return 1;
+   }
+   if(simulation) {
+      sim.n_threads = n_threads;
+      rtn = !simulate(code, &config, n_iterations, &sim);
+      if(rtn)
+         fprintf(stderr, "Unable to set up the simulation\n");
+      code_delete(code);
+      return rtn;
+   }
+
+#ifndef NO_CURSES
+   if(!batch && output_file == NULL) {
+      rtn = run_interactive(code, &config, n_iterations);
+      code_delete(code);
+      return rtn;
+   }
+#endif
+
+   if(latency >= 0) {
+      s = NULL;
+      pool = NULL;
+      queue = queue_new(code, &config, n_iterations, n_threads, latency);
+   } else if(n_threads > 1) {
+      s = NULL;
+      pool = pool_new(code, &config, n_iterations, n_threads);
+   } else {
+      pool = NULL;
+      s = state_new(code, &config, n_iterations, 0, NULL);
+   }
+   if(s == NULL && pool == NULL && queue == NULL) {
+      fprintf(stderr, "Unable to allocate the decoder\n");
+      code_delete(code);
+      return 1;
+   }
+   if(s != NULL && n_team > 1 && !state_start_team(s, n_team))
+      fprintf(stderr, "Unable to start %d decoder threads, using one\n", n_team);
+
+   FILE *in = stdin;
+   if(input_file != NULL && (in = fopen(input_file, "r")) == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", input_file);
+      rtn = 1;
+   } else {
+      // Binary LLR files start with their magic, text ones with a number
+      int c = getc(in);
+      ungetc(c, in);
+      if(queue != NULL && (c == LLR_FILE_MAGIC[0] || output_file != NULL)) {
+         fprintf(stderr, "Decoding through the queue (-A) is for text frames\n");
+         rtn = 1;
+      } else if(queue != NULL) {
+         rtn = run_batch_queue(code, queue, in);
+      } else if(c == LLR_FILE_MAGIC[0]) {
+         rtn = run_batch_binary(code, s, pool, in, output_file, config_batch_frames(&config));
+      } else if(output_file != NULL) {
+         fprintf(stderr, "Binary output (-o) needs a binary LLR file\n");
+         rtn = 1;
+      } else {
+         rtn = run_batch(code, s, pool, in, config_batch_frames(&config));
+      }
+      if(in != stdin)
+         fclose(in);
+   }
+   if(s != NULL)
+      state_delete(s);
+   if(pool != NULL)
+      pool_delete(pool);
+   if(queue != NULL)
+      queue_delete(queue);
+   code_delete(code);
+   return rtn;
 }
@@ -0,0 +1,439 @@
+/////////////////////////////////////////////////////////////
+// ldpc.h : the LDPC decoder library
+//
+// (c) 2022 Mike Field <hamster@snap.net.nz>
+//
+// The decoder, encoder and code loading from ldpc_demo, without
+// the display, for building into other programs (see libldpc.c).
+// The interactive viewer and the batch tools in ldpc.c are written
+// against this header alone.
+//
+// There is no global state: every decoder has its own buffers,
+// from the caller's arena or one of its own, and only reads the
+// code, so any number of decoders can work on one code in as many
+// threads. Input LLRs and output buffers belong to the caller and
+// are used in place.
+//
+/////////////////////////////////////////////////////////////
+#ifndef LDPC_H
+#define LDPC_H
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// One Z x Z block of a quasi-cyclic code, see struct code
+struct circulant {
+   int first;    // Edge for row 0 of the block row
+   int stride;   // Edges between rows of the block row
+   int shift;
+};
+
+// Sparse form of the parity check matrix.
+//
+// Every '1' in the matrix is an edge between a check node and a
+// variable node. Edges are numbered in row (check) order, so the
+// edges of check c are row_start[c] to row_start[c+1]-1, and
+// edge_v[] gives the variable each edge connects to.
+//
+// col_edge[] lists the same edges again grouped by column, so the
+// edges of variable v are col_edge[col_start[v]] to
+// col_edge[col_start[v+1]-1].
+struct code {
+   int n_v;
+   int n_c;
+   int n_edges;
+   int max_row_degree;
+   int *row_start;
+   int *edge_v;
+   int *col_start;
+   int *col_edge;
+
+   // Quasi-cyclic codes also keep their base matrix, with the
+   // shift of each Z x Z block or -1 for a zero block. Other codes
+   // have z = 1 and no base matrix.
+   int z;
+   int base_rows;
+   int base_cols;
+   int *base;
+
+   // QC codes also have their edges grouped by circulant, so that a
+   // variable pass can work through a block column a Z x Z block at a
+   // time with no per edge lookups. The circulants of block column j
+   // are circ[circ_start[j]] to circ[circ_start[j+1]-1], in block row
+   // order. Circulant i's edge for row k of its block row is
+   // circ[i].first + k*circ[i].stride, and goes to variable
+   // (k + circ[i].shift) % z of the block column. NULL for other codes.
+   int *circ_start;
+   struct circulant *circ;
+
+   // Set when the tables are in a mapped code file, see
+   // code_load_cached()
+   void *map;
+   size_t map_size;
+
+   // Sizes of the packed hard decision and syndrome. QC blocks are
+   // padded out to block_words words each.
+   int block_words;
+   int hard_words;
+   int syndrome_words;
+};
+
+// Messages are held per edge, in the same order as code->edge_v
+struct iteration {
+   double *message_v_to_c;
+   double *l;
+   double *message_c_to_v;
+   uint64_t *hard;       // Packed hard decision
+   uint64_t *syndrome;   // Packed check results
+   int unsatisfied;
+};
+
+// Packed bits
+//
+// Hard decisions and syndromes are kept 64 bits to a word. For QC
+// codes each Z bit block starts on a new word, so a whole block row
+// of the syndrome can be formed from the codeword blocks with a few
+// word shifts per circulant. Other codes pack the bits end to end.
+// Codewords from the encoder are packed end to end.
+
+#define WORDS(bits) (((bits) + 63) / 64)
+
+static inline int bit_get(const uint64_t *bits, int i) {
+   return (bits[i/64] >> (i%64)) & 1;
+}
+
+
+static inline void bit_flip(uint64_t *bits, int i) {
+   bits[i/64] ^= (uint64_t)1 << (i%64);
+}
+
+// Where codeword bit or check i goes in the packed form
+int code_packed_bit(const struct code *code, int i);
+
+// Codes. The loaders print what went wrong to stderr and return NULL.
+struct code *code_new_dense(const uint8_t *m, int n_c, int n_v);
+struct code *code_load_alist(const char *filename);
+struct code *code_load_qc(const char *filename, int z);
+void code_delete(struct code *code);
+uint64_t code_hash(const struct code *code);
+int code_write_special(const struct code *code, int n_i, const char *source, FILE *out);
+struct code *code_load_cached(const char *cache_dir, const char *filename, int qc, int z);
+
+// Check node update algorithms
+enum check_algorithm {
+   CHECK_SUM_PRODUCT,
+   CHECK_MIN_SUM,
+   CHECK_OFFSET_MIN_SUM,
+   CHECK_NORMALIZED_MIN_SUM,
+   CHECK_ALGORITHM_COUNT
+};
+
+extern const char *const check_names[CHECK_ALGORITHM_COUNT];
+
+// Decoder engines
+enum engine {
+   ENGINE_DOUBLE,
+   ENGINE_FIXED,
+   ENGINE_FLOAT,   // Single precision, BATCH_LANES frames at a time
+   ENGINE_GPU      // Min-sum on an OpenCL device, built with LDPC_OPENCL
+};
+
+// Message passing schedules
+enum schedule {
+   SCHEDULE_FLOODING,
+   SCHEDULE_LAYERED
+};
+
+// How the decoder is to be run
+struct config {
+   int check;        // One of enum check_algorithm
+   double offset;    // Subtracted from magnitudes by offset min-sum
+   double scale;     // Magnitudes are multiplied by this in normalized min-sum
+   int engine;       // One of enum engine
+   int q_bits;       // Fixed point message width, including the sign
+   double q_scale;   // Fixed point units per 1.0 of LLR
+   int schedule;     // One of enum schedule
+};
+
+void config_default(struct config *config);
+int config_parse_fixed(struct config *config, const char *arg);
+int config_parse_check(struct config *config, const char *arg);
+int config_uses_lanes(const struct config *config);
+int config_batch_frames(const struct config *config);
+
+// Number of frames decoded together by state_decode_frames()
+#define BATCH_LANES 16
+
+// Per frame results from state_decode_frames()
+struct frame_result {
+   int valid;
+   int iterations;
+   int unsatisfied;
+};
+
+// Arena allocator
+//
+// All of a decoder's buffers are carved out of one block of memory.
+// state_size() works out how big that block needs to be, so it can
+// be allocated up front. A caller that creates and deletes decoders
+// can keep an arena and reset it between uses, so that a new
+// decoder does not go to the system allocator at all.
+struct arena {
+   char *base;
+   size_t size;
+   size_t used;
+};
+
+int arena_init(struct arena *a, size_t size);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+
+// LLR sample types
+enum llr_type {
+   LLR_FLOAT32,
+   LLR_INT8      // The LLR is the value divided by a scale
+};
+
+// Frames for state_decode_io(). Frame f's n_v LLRs start at element
+// f*n_v of llr[]. Its hard decision goes to n_v bytes at
+// bits + f*n_v, and packed end to end (as the encoder's codewords
+// are) to WORDS(n_v) words at packed + f*WORDS(n_v), and its outcome
+// to results[f]. For iterative receivers, the final a-posteriori
+// LLRs (L) go to n_v floats at app + f*n_v and the extrinsic LLRs
+// (L less the input LLR) to extrinsic + f*n_v. Any of the outputs
+// but results may be NULL. With rate matching (rm), frame f is the
+// rate_match_length() received LLRs from element f*rate_match_length()
+// instead, for a decoder made for rate_match_code(), and the outputs
+// are for the shortened code.
+struct rate_match;
+
+struct frame_io {
+   const void *llr;
+   int type;       // One of enum llr_type
+   float scale;    // LLR_INT8 values per 1.0 of LLR
+   uint8_t *bits;
+   uint64_t *packed;
+   struct frame_result *results;
+   float *app;
+   float *extrinsic;
+   const struct rate_match *rm;
+};
+
+// Binary frame files
+//
+// An LLR file is a struct llr_file_header followed by n_frames frames
+// of n_v LLRs, each a float or an int8_t as given by type. A hard
+// decision file is a struct hard_file_header followed by n_frames
+// frames of WORDS(n_v) words of packed bits, then n_frames struct
+// frame_results. Both are in the host's byte order, and the headers
+// are 64 bytes so that the frames after them are aligned. A code_id
+// is the code_hash() of the code, or 0 in an LLR file for any code
+// with n_v bits.
+#define LLR_FILE_MAGIC  "LDPCLLR1"
+#define HARD_FILE_MAGIC "LDPCHRD1"
+
+struct llr_file_header {
+   char magic[8];
+   uint64_t code_id;
+   uint64_t n_frames;
+   uint32_t n_v;
+   uint32_t type;       // One of enum llr_type
+   float scale;         // For LLR_INT8
+   uint8_t reserved[28];
+};
+
+struct hard_file_header {
+   char magic[8];
+   uint64_t code_id;
+   uint64_t n_frames;
+   uint32_t n_v;
+   uint32_t words;      // Per frame, WORDS(n_v)
+   uint8_t reserved[32];
+};
+
+// Convergence traces
+//
+// A trace file is a struct trace_file_header followed by n_frames
+// frames. Each frame is its n_v float input LLRs, a struct
+// trace_frame_header, then each iteration the decoder went to: the
+// packed hard decision and syndrome (hard_words and syndrome_words of
+// the code's words), then message_v_to_c[], message_c_to_v[] (n_edges
+// floats each, in edge order) and l[] (n_v floats) as in struct
+// iteration, rounded to float. The header has the decoder's config,
+// which must be the double or fixed point engine, in the host's byte
+// order like the frame files.
+#define TRACE_FILE_MAGIC "LDPCTRC1"
+
+struct trace_file_header {
+   char magic[8];
+   uint64_t code_id;     // code_hash() of the code
+   uint64_t n_frames;
+   uint32_t n_v;
+   uint32_t n_edges;
+   uint32_t n_i;         // Most iterations
+   uint8_t check;        // As in struct config
+   uint8_t engine;
+   uint8_t schedule;
+   uint8_t q_bits;
+   double offset;
+   double scale;
+   double q_scale;
+};
+
+struct trace_frame_header {
+   uint32_t iterations;  // Iterations that follow
+   uint32_t valid;
+};
+
+// Decoders
+//
+// state_new() makes a decoder for a code, state_decode() decodes one
+// frame of double LLRs (positive means a '0' is more likely) read in
+// place from the caller's buffer, and state_delete() frees it. The
+// outcome is left in the decoder's iteration buffers, see
+// state_get_iteration(). state_decode_io() decodes any number of
+// frames straight from and to the caller's buffers, and
+// state_decode_frames() is the same for float frames and byte hard
+// decisions.
+struct state;
+
+size_t state_size(const struct code *code, const struct config *config, int n_i, int history);
+struct state *state_new(const struct code *code, const struct config *config, int n_i, int history,
+                        struct arena *arena);
+void state_delete(struct state *s);
+int state_set_config(struct state *s, const struct config *config);
+int state_start_team(struct state *s, int n_threads);
+void state_stop_team(struct state *s);
+int state_decode(struct state *s, const double *llr);
+int state_redecode(struct state *s, const double *llr, int v);
+int state_decode_io(struct state *s, const struct frame_io *io, long first, int n_frames);
+int state_decode_frames(struct state *s, const float *llr, int n_frames, uint8_t *bits,
+                        struct frame_result *results);
+int state_iterations_used(const struct state *s);
+const struct iteration *state_get_iteration(const struct state *s, int it);
+#ifdef LDPC_SPECIAL
+int state_special_iterations(void);
+#endif
+
+// A pool of decoder threads
+struct pool;
+
+struct pool *pool_new(const struct code *code, const struct config *config, int n_i, int n_workers);
+void pool_delete(struct pool *pool);
+int pool_workers(const struct pool *pool);
+int pool_decode_io(struct pool *pool, const struct frame_io *io, long first, long n_frames);
+int pool_decode(struct pool *pool, const float *llr, int n_frames, uint8_t *bits,
+                struct frame_result *results);
+
+// Asynchronous decoding: frames are submitted one at a time with a
+// deadline, decoded in batches by worker threads, and come back by
+// callback or through the completion list. See libldpc.c.
+struct queue;
+
+struct queue_done {
+   long id;                      // From queue_submit()
+   void *arg;                    // As given to queue_submit()
+   struct frame_result result;
+   int late;                     // Finished after its deadline
+};
+
+typedef void (*queue_callback)(const struct queue_done *done);
+
+struct queue *queue_new(const struct code *code, const struct config *config, int n_i, int n_workers,
+                        double latency);
+void queue_delete(struct queue *q);
+long queue_submit(struct queue *q, const float *llr, uint8_t *bits, double deadline,
+                  queue_callback callback, void *arg);
+int queue_complete(struct queue *q, struct queue_done *done, int wait);
+void queue_flush(struct queue *q);
+
+// Systematic encoder
+struct encoder;
+
+struct encoder *encoder_new(const struct code *code);
+void encoder_delete(struct encoder *e);
+int encoder_k(const struct encoder *e);
+const int *encoder_info_pos(const struct encoder *e);
+int encoder_scratch_words(const struct encoder *e);
+void encoder_encode(const struct encoder *e, const uint64_t *data, uint64_t *codeword, uint64_t *scratch);
+
+// Rate matching: puncturing, shortening with filler bits and
+// circular buffer selection, see libldpc.c
+struct rate_match *rate_match_new(const struct code *code, int punctured, int filler_first, int n_filler,
+                                  int start, int e);
+void rate_match_delete(struct rate_match *rm);
+const struct code *rate_match_code(const struct rate_match *rm);
+int rate_match_length(const struct rate_match *rm);
+const int *rate_match_positions(const struct rate_match *rm);
+void rate_match_llr(const struct rate_match *rm, const float *rx, float *llr);
+void rate_match_bits(const struct rate_match *rm, const uint8_t *bits, uint8_t *codeword);
+
+// HARQ soft buffers, one per process, see libldpc.c
+struct harq;
+
+#define HARQ_DEFAULT_SCALE 4.0f
+
+struct harq *harq_new(int n_v, int n_processes, float scale);
+void harq_delete(struct harq *h);
+void harq_clear(struct harq *h, int process);
+int harq_combine(struct harq *h, int process, const float *llr, float *combined);
+void harq_frame(const struct harq *h, int process, struct frame_io *io);
+
+// Code registry: each code is loaded once and shared, along with its
+// encoder, until the registry is deleted. See libldpc.c.
+struct registry;
+
+struct registry *registry_new(const char *cache_dir);
+void registry_delete(struct registry *r);
+const struct code *registry_code(struct registry *r, const char *filename, int qc, int z);
+const struct encoder *registry_encoder(struct registry *r, const struct code *code);
+
+// xoshiro256** random number generator, seeded with splitmix64
+struct rng {
+   uint64_t s[4];
+};
+
+void rng_seed(struct rng *r, uint64_t seed);
+void rng_stream(struct rng *r, uint64_t seed, uint64_t point, uint64_t frame);
+uint64_t rng_next(struct rng *r);
+void rng_gaussian(struct rng *r, float *out, int n);
+
+// Instrumentation, see libldpc.c
+enum stats_phase {
+   PHASE_CHECK,      // Check node pass (all of each row for layered)
+   PHASE_VARIABLE,   // Variable node pass
+   PHASE_PARITY,     // Hard decision, syndrome and copying out results
+   PHASE_IO,         // Reading frames and writing results
+   PHASE_COUNT
+};
+
+// Frames that took more iterations land in the last bucket
+#define STATS_HISTOGRAM 64
+
+struct stats {
+   uint64_t cycles[PHASE_COUNT];
+   uint64_t frames;
+   uint64_t not_converged;
+   uint64_t iterations[STATS_HISTOGRAM];   // Frames that finished after i iterations
+   uint64_t channel_clipped;               // Fixed point inputs beyond the message range
+   uint64_t saturated;                     // Fixed point messages and sums saturated
+};
+
+#ifdef LDPC_STATS
+void stats_read(struct stats *out);
+void stats_reset(void);
+void stats_print(FILE *out, const struct stats *st);
+int stats_start_dump(FILE *out, double seconds);
+void stats_stop_dump(void);
+uint64_t stats_clock(void);
+void stats_lap(uint64_t *t, int phase);
+
+#define STATS_START(t)           uint64_t t = stats_clock()
+#define STATS_LAP(t, phase)      stats_lap(&t, phase)
+#else
+#define STATS_START(t)
+#define STATS_LAP(t, phase)
+#endif
+
+#endif
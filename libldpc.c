@@ -0,0 +1,5248 @@
+/////////////////////////////////////////////////////////////
+// libldpc.c : the LDPC decoder library
+//
+// (c) 2022 Mike Field <hamster@snap.net.nz>
+//
+// Code loading, the decoders and the encoder, with no display.
+// See ldpc.h for the interface, and ldpc.c for the programs that
+// use it.
+//
+/////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(LDPC_STATS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+#ifdef LDPC_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+#include "ldpc.h"
+
+// Packed bits, see ldpc.h
+
+// Where codeword bit or check i goes in the packed form
+int code_packed_bit(const struct code *code, int i) {
+   if(code->base == NULL)
+      return i;
+   return (i / code->z) * code->block_words * 64 + i % code->z;
+}
+
+
+// The first variable in packed codeword word w, or n_v past the end
+static int code_word_first_v(const struct code *code, int w) {
+   if(code->base == NULL)
+      return w*64 < code->n_v ? w*64 : code->n_v;
+   int b = w / code->block_words, o = (w % code->block_words) * 64;
+   return b*code->z + (o < code->z ? o : code->z);
+}
+
+
+// dst ^= the z bit block src turned by shift, so dst[l] ^= src[(l+shift)%z]
+// for each l. This is what a block row picks up from a block column
+// through a circulant with that shift.
+static void block_rotate_xor(uint64_t *dst, const uint64_t *src, int z, int shift) {
+   int n_words = WORDS(z);
+   int word = shift / 64, bit = shift % 64;
+   int back = z - shift;
+   int back_word = back / 64, back_bit = back % 64;
+
+   // src >> shift
+   for(int i = 0; i + word < n_words; i++) {
+      uint64_t x = src[i + word] >> bit;
+      if(bit != 0 && i + word + 1 < n_words)
+         x |= src[i + word + 1] << (64 - bit);
+      dst[i] ^= x;
+   }
+   // src << (z - shift), keeping only the low z bits
+   if(shift != 0) {
+      for(int i = n_words - 1; i >= back_word; i--) {
+         uint64_t x = src[i - back_word] << back_bit;
+         if(back_bit != 0 && i - back_word - 1 >= 0)
+            x |= src[i - back_word - 1] >> (64 - back_bit);
+         if(i == n_words - 1 && z % 64 != 0)
+            x &= ((uint64_t)1 << (z % 64)) - 1;
+         dst[i] ^= x;
+      }
+   }
+}
+
+
+// Pack the signs of l[] into words first to last-1 of the hard
+// decision. A word is built up in a register and stored once.
+static void hard_pack(const struct code *code, const double *l, uint64_t *hard, int first, int last) {
+   for(int w = first; w < last; w++) {
+      int v = code_word_first_v(code, w), n = code_word_first_v(code, w+1) - v;
+      uint64_t x = 0;
+      for(int i = 0; i < n; i++)
+         x |= (uint64_t)(l[v+i] < 0) << i;
+      hard[w] = x;
+   }
+}
+
+
+static void hard_pack_fixed(const struct code *code, const int16_t *l, uint64_t *hard) {
+   for(int w = 0; w < code->hard_words; w++) {
+      int v = code_word_first_v(code, w), n = code_word_first_v(code, w+1) - v;
+      uint64_t x = 0;
+      for(int i = 0; i < n; i++)
+         x |= (uint64_t)(l[v+i] < 0) << i;
+      hard[w] = x;
+   }
+}
+
+
+// One byte per bit, for output
+static void hard_unpack(const struct code *code, const uint64_t *hard, uint8_t *bits) {
+   for(int w = 0; w < code->hard_words; w++) {
+      int v = code_word_first_v(code, w), n = code_word_first_v(code, w+1) - v;
+      for(int i = 0; i < n; i++)
+         bits[v+i] = (hard[w] >> i) & 1;
+   }
+}
+
+
+// The hard decision packed end to end, bit v in bit v%64 of word
+// v/64, as codewords from the encoder are. out[] is WORDS(n_v) words.
+static void hard_repack(const struct code *code, const uint64_t *hard, uint64_t *out) {
+   if(code->base == NULL) {
+      memcpy(out, hard, sizeof(uint64_t) * WORDS(code->n_v));
+      return;
+   }
+   memset(out, 0, sizeof(uint64_t) * WORDS(code->n_v));
+   for(int w = 0; w < code->hard_words; w++) {
+      int v = code_word_first_v(code, w), n = code_word_first_v(code, w+1) - v;
+      if(n == 0)
+         continue;
+      uint64_t x = n == 64 ? hard[w] : hard[w] & (((uint64_t)1 << n) - 1);
+      out[v/64] |= x << (v%64);
+      if(v%64 + n > 64)
+         out[v/64 + 1] |= x >> (64 - v%64);
+   }
+}
+
+
+// Work out syndrome units first to last-1 from the hard decision,
+// where a unit is a block row of a QC code, or a word of 64 checks.
+// Returns the number of unsatisfied checks among them.
+static int code_syndrome(const struct code *code, const uint64_t *hard, uint64_t *syndrome,
+                         int first, int last) {
+   int unsatisfied = 0;
+   if(code->base != NULL) {
+      int bw = code->block_words;
+      for(int r = first; r < last; r++) {
+         const int *row = code->base + r*code->base_cols;
+         uint64_t *out = syndrome + r*bw;
+         memset(out, 0, sizeof(uint64_t) * bw);
+         for(int j = 0; j < code->base_cols; j++) {
+            if(row[j] >= 0)
+               block_rotate_xor(out, hard + j*bw, code->z, row[j]);
+         }
+         for(int i = 0; i < bw; i++)
+            unsatisfied += __builtin_popcountll(out[i]);
+      }
+      return unsatisfied;
+   }
+   for(int w = first; w < last; w++) {
+      int end = (w+1)*64 < code->n_c ? (w+1)*64 : code->n_c;
+      uint64_t x = 0;
+      for(int c = w*64; c < end; c++) {
+         uint64_t p = 0;
+         for(int e = code->row_start[c]; e < code->row_start[c+1]; e++)
+            p ^= hard[code->edge_v[e] / 64] >> (code->edge_v[e] % 64);
+         x |= (p & 1) << (c - w*64);
+      }
+      syndrome[w] = x;
+      unsatisfied += __builtin_popcountll(x);
+   }
+   return unsatisfied;
+}
+
+
+static int code_syndrome_units(const struct code *code) {
+   return code->base != NULL ? code->base_rows : code->syndrome_words;
+}
+
+
+const char *const check_names[CHECK_ALGORITHM_COUNT] = {
+   "sp", "ms", "oms", "nms"
+};
+
+// Arena allocator, see ldpc.h
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(n) (((size_t)(n) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+
+// Returns 0 if the memory could not be allocated
+int arena_init(struct arena *a, size_t size) {
+   a->size = ARENA_ROUND(size);
+   a->used = 0;
+   a->base = aligned_alloc(ARENA_ALIGN, a->size);
+   return a->base != NULL;
+}
+
+
+void arena_reset(struct arena *a) {
+   a->used = 0;
+}
+
+
+void arena_free(struct arena *a) {
+   free(a->base);
+   a->base = NULL;
+   a->size = 0;
+   a->used = 0;
+}
+
+
+// Returns NULL if the arena is full
+void *arena_alloc(struct arena *a, size_t size) {
+   size = ARENA_ROUND(size);
+   if(size > a->size - a->used)
+      return NULL;
+   void *p = a->base + a->used;
+   a->used += size;
+   return p;
+}
+
+
+// Instrumentation
+//
+// Built with -DLDPC_STATS (make ldpc_stats) the decoders keep running
+// totals of the time spent in each phase, how many iterations frames
+// took to converge, the frames that never did and, for the fixed
+// point engine, how many values were clipped. Without it the STATS_*
+// macros are empty and none of this is compiled in.
+//
+// Totals are shared by every thread and updated with relaxed atomic
+// adds, once per phase per iteration rather than per edge, so the
+// cost is small even when built in. Phase times are in cycles of the
+// time stamp counter where there is one (nanoseconds otherwise), and
+// are summed over threads. The totals are the one piece of state
+// shared by every decoder in the process.
+#ifdef LDPC_STATS
+static const char *stats_phase_names[PHASE_COUNT] = {
+   "check", "variable", "parity", "io"
+};
+
+static struct stats stats_total;
+
+// Fixed point saturation is counted per thread and added to the
+// totals at the end of each frame
+static _Thread_local uint64_t stats_saturated;
+
+uint64_t stats_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return (uint64_t)t.tv_sec * 1000000000u + t.tv_nsec;
+#endif
+}
+
+static inline void stats_add(uint64_t *total, uint64_t n) {
+   __atomic_fetch_add(total, n, __ATOMIC_RELAXED);
+}
+
+// Add the time since *t to a phase, and restart *t
+void stats_lap(uint64_t *t, int phase) {
+   uint64_t now = stats_clock();
+   stats_add(&stats_total.cycles[phase], now - *t);
+   *t = now;
+}
+
+static void stats_frame(int valid, int iterations) {
+   stats_add(&stats_total.frames, 1);
+   stats_add(&stats_total.not_converged, !valid);
+   stats_add(&stats_total.iterations[iterations < STATS_HISTOGRAM ? iterations : STATS_HISTOGRAM-1], 1);
+}
+
+#define STATS_FRAME(valid, its)  stats_frame(valid, its)
+#define STATS_COUNT(field, n)    stats_add(&stats_total.field, n)
+#define STATS_SATURATED()        (stats_saturated++)
+#define STATS_FLUSH_SATURATED()  (stats_add(&stats_total.saturated, stats_saturated), stats_saturated = 0)
+
+// Take a copy of the totals so far
+void stats_read(struct stats *out) {
+   uint64_t *from = (uint64_t *)&stats_total;
+   uint64_t *to   = (uint64_t *)out;
+   for(size_t i = 0; i < sizeof(struct stats)/sizeof(uint64_t); i++) {
+      to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+   }
+}
+
+
+void stats_reset(void) {
+   uint64_t *total = (uint64_t *)&stats_total;
+   for(size_t i = 0; i < sizeof(struct stats)/sizeof(uint64_t); i++) {
+      __atomic_store_n(&total[i], 0, __ATOMIC_RELAXED);
+   }
+}
+
+
+// Write the totals as "name value" lines, with a line starting with
+// '#' between dumps. Empty histogram buckets are left out.
+void stats_print(FILE *out, const struct stats *st) {
+   fprintf(out, "# ldpc stats\n");
+   for(int p = 0; p < PHASE_COUNT; p++) {
+      fprintf(out, "ldpc_cycles{phase=\"%s\"} %llu\n", stats_phase_names[p],
+              (unsigned long long)st->cycles[p]);
+   }
+   fprintf(out, "ldpc_frames %llu\n", (unsigned long long)st->frames);
+   fprintf(out, "ldpc_not_converged %llu\n", (unsigned long long)st->not_converged);
+   for(int i = 0; i < STATS_HISTOGRAM; i++) {
+      if(st->iterations[i] != 0)
+         fprintf(out, "ldpc_iterations{n=\"%d%s\"} %llu\n", i, i == STATS_HISTOGRAM-1 ? "+" : "",
+                 (unsigned long long)st->iterations[i]);
+   }
+   fprintf(out, "ldpc_channel_clipped %llu\n", (unsigned long long)st->channel_clipped);
+   fprintf(out, "ldpc_saturated %llu\n", (unsigned long long)st->saturated);
+   fflush(out);
+}
+
+
+// Periodic dump
+//
+// stats_start_dump() starts a thread that writes the totals to 'out'
+// every 'seconds'. stats_stop_dump() stops it and writes them one
+// last time.
+static struct {
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   FILE *out;
+   double seconds;
+   int running;
+   int quit;
+} stats_dump = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static void *stats_dump_main(void *arg) {
+   struct stats st;
+   pthread_mutex_lock(&stats_dump.lock);
+   while(!stats_dump.quit) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      double t = until.tv_sec + until.tv_nsec * 1e-9 + stats_dump.seconds;
+      until.tv_sec  = (time_t)t;
+      until.tv_nsec = (long)((t - until.tv_sec) * 1e9);
+      while(!stats_dump.quit && pthread_cond_timedwait(&stats_dump.wake, &stats_dump.lock, &until) == 0)
+         ;
+      if(stats_dump.quit)
+         break;
+      stats_read(&st);
+      stats_print(stats_dump.out, &st);
+   }
+   pthread_mutex_unlock(&stats_dump.lock);
+   return NULL;
+}
+
+
+// Returns 0 if the thread could not be started
+int stats_start_dump(FILE *out, double seconds) {
+   stats_dump.out     = out;
+   stats_dump.seconds = seconds;
+   stats_dump.quit    = 0;
+   stats_dump.running = pthread_create(&stats_dump.thread, NULL, stats_dump_main, NULL) == 0;
+   return stats_dump.running;
+}
+
+
+void stats_stop_dump(void) {
+   struct stats st;
+   if(!stats_dump.running)
+      return;
+   pthread_mutex_lock(&stats_dump.lock);
+   stats_dump.quit = 1;
+   pthread_cond_signal(&stats_dump.wake);
+   pthread_mutex_unlock(&stats_dump.lock);
+   pthread_join(stats_dump.thread, NULL);
+   stats_dump.running = 0;
+   stats_read(&st);
+   stats_print(stats_dump.out, &st);
+}
+#else
+#define STATS_FRAME(valid, its)
+#define STATS_COUNT(field, n)
+#define STATS_SATURATED()
+#define STATS_FLUSH_SATURATED()
+#endif
+
+
+// Limits on the fixed point message width. The a-posteriori sums
+// are FIXED_APP_EXTRA_BITS wider than the messages, and everything
+// is held in int16_t.
+#define FIXED_MIN_BITS       2
+#define FIXED_MAX_BITS       14
+#define FIXED_APP_EXTRA_BITS 2
+// Normalized min-sum scale factors are applied as (m*scale) >> 4
+#define FIXED_SCALE_SHIFT    4
+
+// The BATCH_LANES frames decoded together, one per vector element
+typedef float   lanes_f __attribute__((vector_size(BATCH_LANES*sizeof(float))));
+typedef int32_t lanes_i __attribute__((vector_size(BATCH_LANES*sizeof(int32_t))));
+
+struct team;
+
+struct state {
+   int iterations;
+   int iterations_used;
+   int n_v;
+   int n_c;
+   // The frame being decoded. This is the caller's buffer during
+   // state_decode(), or frame_llr[] for state_decode_frames().
+   const double *channel_llr;
+   double *frame_llr;
+   double *scratch;
+   int16_t *q_channel;
+   int16_t *q_v_to_c;
+   int16_t *q_c_to_v;
+   int16_t *q_l;
+   int16_t *q_scratch;
+   int32_t *q_sum;       // A block column's sums, for QC codes
+   lanes_f *lane_channel;
+   lanes_f *lane_l;
+   lanes_f *lane_v_to_c;
+   lanes_f *lane_c_to_v;
+   lanes_f *lane_scratch;
+   struct config config;
+   const struct code *code;
+   // With history every iteration has its own storage, so they can
+   // all be looked at once decoding is done. Without it, only one
+   // set is allocated and each iteration overwrites the last, so
+   // the memory used does not depend on the iteration count.
+   int history;
+   struct iteration *iteration;
+   struct iteration *last_iteration;
+
+   // Where the buffers came from. If the state made its own arena it
+   // frees it when deleted.
+   struct arena *arena;
+   struct arena own_arena;
+
+   // Threads to share each decode with, see state_start_team()
+   struct team *team;
+
+   // Set if the code and iteration count match the decoder built in
+   // with LDPC_SPECIAL
+   int special;
+
+   // The device, queues and buffers of the GPU engine
+   struct gpu *gpu;
+
+   // For state_redecode(), with history. Set if the last decode was
+   // the generic double flooding one, so its iterations can be
+   // updated in place. Nodes go on the lists when their stamp in the
+   // marks is not yet that of the current pass.
+   int resumable;
+   double *row_out;      // A check's new outputs, max_row_degree of them
+   int *edge_c;          // The check of each edge
+   int *mark_v;
+   int *mark_c;
+   int *list_v;
+   int *list_c;
+   int stamp;
+};
+
+// Where iteration 'it' (from 0) is kept
+static struct iteration *state_iteration(struct state *s, int it) {
+   return &s->iteration[s->history ? it : 0];
+}
+
+
+// The buffers for one iteration. iteration_size() must match.
+static int iteration_init(struct state *s, struct iteration *new_i) {
+   int n_e = s->code->n_edges;
+   new_i->l                = arena_alloc(s->arena, sizeof(double)  *s->n_v);
+   new_i->message_v_to_c   = arena_alloc(s->arena, sizeof(double)  *n_e);
+   new_i->message_c_to_v   = arena_alloc(s->arena, sizeof(double)  *n_e);
+   new_i->hard             = arena_alloc(s->arena, sizeof(uint64_t)*s->code->hard_words);
+   new_i->syndrome         = arena_alloc(s->arena, sizeof(uint64_t)*s->code->syndrome_words);
+   new_i->unsatisfied      = 0;
+   return new_i->l != NULL && new_i->message_v_to_c != NULL && new_i->message_c_to_v != NULL &&
+          new_i->hard != NULL && new_i->syndrome != NULL;
+}
+
+
+static size_t iteration_size(const struct code *code) {
+   return ARENA_ROUND(sizeof(double)  * code->n_v) +
+          ARENA_ROUND(sizeof(double)  * code->n_edges) * 2 +
+          ARENA_ROUND(sizeof(uint64_t) * code->hard_words) +
+          ARENA_ROUND(sizeof(uint64_t) * code->syndrome_words);
+}
+
+
+// A code with its edge lists allocated but not filled in, or NULL if
+// there is not enough memory
+static struct code *code_alloc(int n_c, int n_v, int n_e) {
+   struct code *code = malloc(sizeof(struct code));
+   if(code == NULL)
+      return NULL;
+   code->n_v            = n_v;
+   code->n_c            = n_c;
+   code->n_edges        = n_e;
+   code->max_row_degree = 0;
+   code->z              = 1;
+   code->base_rows      = 0;
+   code->base_cols      = 0;
+   code->base           = NULL;
+   code->circ_start     = NULL;
+   code->circ           = NULL;
+   code->map            = NULL;
+   code->map_size       = 0;
+   code->row_start      = malloc(sizeof(int) * (n_c+1));
+   code->edge_v         = malloc(sizeof(int) * (n_e > 0 ? n_e : 1));
+   code->col_start      = malloc(sizeof(int) * (n_v+1));
+   code->col_edge       = malloc(sizeof(int) * (n_e > 0 ? n_e : 1));
+   if(code->row_start == NULL || code->edge_v == NULL || code->col_start == NULL || code->col_edge == NULL) {
+      code_delete(code);
+      return NULL;
+   }
+   return code;
+}
+
+
+// Once row_start[] and edge_v[] are filled in, work out the row
+// degree and build the column view of the same edges. Count the
+// column weights, turn them into start offsets, then drop each
+// edge into place. Returns 0 if there is not enough memory.
+static int code_build_columns(struct code *code) {
+   code->max_row_degree = 0;
+   for(int c = 0; c < code->n_c; c++) {
+      int d = code->row_start[c+1] - code->row_start[c];
+      if(d > code->max_row_degree)
+         code->max_row_degree = d;
+   }
+
+   for(int v = 0; v <= code->n_v; v++) {
+      code->col_start[v] = 0;
+   }
+   for(int e = 0; e < code->n_edges; e++) {
+      code->col_start[code->edge_v[e]+1]++;
+   }
+   for(int v = 0; v < code->n_v; v++) {
+      code->col_start[v+1] += code->col_start[v];
+   }
+   int *fill = malloc(sizeof(int) * code->n_v);
+   if(fill == NULL)
+      return 0;
+   for(int v = 0; v < code->n_v; v++) {
+      fill[v] = code->col_start[v];
+   }
+   for(int e = 0; e < code->n_edges; e++) {
+      code->col_edge[fill[code->edge_v[e]]++] = e;
+   }
+   free(fill);
+
+   if(code->base != NULL) {
+      code->block_words    = WORDS(code->z);
+      code->hard_words     = code->base_cols * code->block_words;
+      code->syndrome_words = code->base_rows * code->block_words;
+   } else {
+      code->block_words    = 0;
+      code->hard_words     = WORDS(code->n_v);
+      code->syndrome_words = WORDS(code->n_c);
+   }
+   return 1;
+}
+
+
+void code_delete(struct code *code) {
+   if(code->map != NULL) {
+      munmap(code->map, code->map_size);
+      free(code);
+      return;
+   }
+   free(code->row_start);
+   free(code->edge_v);
+   free(code->col_start);
+   free(code->col_edge);
+   free(code->base);
+   free(code->circ_start);
+   free(code->circ);
+   free(code);
+}
+
+
+// Build the sparse edge lists from a dense n_c x n_v matrix. Returns
+// NULL if there is not enough memory.
+struct code *code_new_dense(const uint8_t *m, int n_c, int n_v) {
+   int n_e = 0;
+   for(int i = 0; i < n_c*n_v; i++) {
+      if(m[i])
+        n_e++;
+   }
+   struct code *code = code_alloc(n_c, n_v, n_e);
+   if(code == NULL)
+      return NULL;
+
+   int e = 0;
+   for(int c = 0; c < n_c; c++) {
+      code->row_start[c] = e;
+      for(int v = 0; v < n_v; v++) {
+         if(m[c*n_v+v])
+            code->edge_v[e++] = v;
+      }
+   }
+   code->row_start[n_c] = e;
+   if(!code_build_columns(code)) {
+      code_delete(code);
+      return NULL;
+   }
+   return code;
+}
+
+
+// Read the next integer from a matrix file, skipping '#' comments
+static int read_int(FILE *f, int *value) {
+   int ch;
+   while((ch = fgetc(f)) != EOF) {
+      if(ch == '#') {
+         while(ch != EOF && ch != '\n')
+            ch = fgetc(f);
+      } else if(ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n') {
+         ungetc(ch, f);
+         return fscanf(f, "%d", value) == 1;
+      }
+   }
+   return 0;
+}
+
+
+// Load a matrix in MacKay's alist format:
+//
+//   n m
+//   max_col_weight max_row_weight
+//   n column weights
+//   m row weights
+//   n lines listing the (1-based) rows in each column
+//   m lines listing the (1-based) columns in each row
+//
+// Column lists may be padded with zeros, and may not list a row more
+// than once. The column lists are streamed straight into the row
+// ordered edge list, the row lists just repeat the same information
+// and are not read.
+struct code *code_load_alist(const char *filename) {
+   FILE *f = fopen(filename, "r");
+   if(f == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", filename);
+      return NULL;
+   }
+
+   int n_v, n_c, max_cw, max_rw;
+   if(!read_int(f, &n_v) || !read_int(f, &n_c) || n_v <= 0 || n_c <= 0 ||
+      !read_int(f, &max_cw) || !read_int(f, &max_rw)) {
+      fprintf(stderr, "%s: bad alist header\n", filename);
+      fclose(f);
+      return NULL;
+   }
+
+   int *col_weight = malloc(sizeof(int) * n_v);
+   int *row_weight = malloc(sizeof(int) * n_c);
+   int n_e = 0, n_e_rows = 0, ok = 1;
+   if(col_weight == NULL || row_weight == NULL) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      free(col_weight);
+      free(row_weight);
+      fclose(f);
+      return NULL;
+   }
+   for(int v = 0; ok && v < n_v; v++) {
+      ok = read_int(f, &col_weight[v]) && col_weight[v] >= 0;
+      n_e += col_weight[v];
+   }
+   for(int c = 0; ok && c < n_c; c++) {
+      ok = read_int(f, &row_weight[c]) && row_weight[c] >= 0;
+      n_e_rows += row_weight[c];
+   }
+   if(!ok || n_e != n_e_rows) {
+      fprintf(stderr, "%s: bad alist weights\n", filename);
+      free(col_weight);
+      free(row_weight);
+      fclose(f);
+      return NULL;
+   }
+
+   struct code *code = code_alloc(n_c, n_v, n_e);
+   if(code == NULL) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      free(col_weight);
+      free(row_weight);
+      fclose(f);
+      return NULL;
+   }
+   code->row_start[0] = 0;
+   for(int c = 0; c < n_c; c++) {
+      code->row_start[c+1] = code->row_start[c] + row_weight[c];
+   }
+
+   // Reuse row_weight[] as the fill point for each row. As columns
+   // are read in order, each row's edges end up sorted by column, so
+   // a row listed twice in one column is the row's last edge so far.
+   for(int c = 0; c < n_c; c++) {
+      row_weight[c] = code->row_start[c];
+   }
+   int repeated = 0;
+   for(int v = 0; ok && v < n_v; v++) {
+      for(int i = 0; ok && i < col_weight[v]; i++) {
+         int r;
+         do {
+            ok = read_int(f, &r);
+         } while(ok && r == 0);
+         if(ok && (r > n_c || r < 0 || row_weight[r-1] == code->row_start[r]))
+            ok = 0;
+         if(ok && row_weight[r-1] > code->row_start[r-1] && code->edge_v[row_weight[r-1]-1] == v) {
+            fprintf(stderr, "%s: row %d is listed twice for column %d\n", filename, r, v+1);
+            ok = 0;
+            repeated = 1;
+         }
+         if(ok)
+            code->edge_v[row_weight[r-1]++] = v;
+      }
+   }
+   free(col_weight);
+   free(row_weight);
+   fclose(f);
+
+   if(!ok) {
+      if(!repeated)
+         fprintf(stderr, "%s: bad alist column lists\n", filename);
+      code_delete(code);
+      return NULL;
+   }
+   if(!code_build_columns(code)) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      code_delete(code);
+      return NULL;
+   }
+   return code;
+}
+
+
+// Load a quasi-cyclic base matrix and lift it:
+//
+//   rows cols Z
+//   rows x cols shift values, -1 for an all-zero block
+//
+// Each shift value s puts a Z x Z identity matrix cyclically
+// shifted by (s mod Z) at that block, so that row k of the block
+// connects to column (k+s) mod Z. Shift tables in the standards
+// are given for the largest lifting size, so the 'z' argument can
+// override the file's Z when it is not zero.
+//
+// Only the base matrix is held, the lifted edges are written
+// directly into the sparse edge lists.
+struct code *code_load_qc(const char *filename, int z) {
+   FILE *f = fopen(filename, "r");
+   if(f == NULL) {
+      fprintf(stderr, "Unable to open '%s'\n", filename);
+      return NULL;
+   }
+
+   int rows, cols, file_z;
+   if(!read_int(f, &rows) || !read_int(f, &cols) || !read_int(f, &file_z) ||
+      rows <= 0 || cols <= 0) {
+      fprintf(stderr, "%s: bad base matrix header\n", filename);
+      fclose(f);
+      return NULL;
+   }
+   if(z <= 0)
+      z = file_z;
+   if(z <= 0) {
+      fprintf(stderr, "%s: no lifting size given\n", filename);
+      fclose(f);
+      return NULL;
+   }
+
+   int *base = malloc(sizeof(int) * rows * cols);
+   int n_blocks = 0;
+   if(base == NULL) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      fclose(f);
+      return NULL;
+   }
+   for(int i = 0; i < rows*cols; i++) {
+      if(!read_int(f, &base[i]) || base[i] < -1) {
+         fprintf(stderr, "%s: bad base matrix entry\n", filename);
+         free(base);
+         fclose(f);
+         return NULL;
+      }
+      if(base[i] >= 0) {
+         base[i] %= z;
+         n_blocks++;
+      }
+   }
+   fclose(f);
+
+   struct code *code = code_alloc(rows*z, cols*z, n_blocks*z);
+   if(code == NULL) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      free(base);
+      return NULL;
+   }
+   code->z         = z;
+   code->base_rows = rows;
+   code->base_cols = cols;
+   code->base      = base;
+
+   int e = 0;
+   for(int i = 0; i < rows; i++) {
+      for(int k = 0; k < z; k++) {
+         code->row_start[i*z+k] = e;
+         for(int j = 0; j < cols; j++) {
+            int shift = base[i*cols+j];
+            if(shift >= 0)
+               code->edge_v[e++] = j*z + (k+shift)%z;
+         }
+      }
+   }
+   code->row_start[rows*z] = e;
+
+   // The circulants by block column. The rows of block row i all
+   // have one edge per circulant, in block column order, so a
+   // circulant's edges are a row's worth of edges apart.
+   code->circ_start = malloc(sizeof(int) * (cols+1));
+   code->circ       = malloc(sizeof(struct circulant) * (n_blocks > 0 ? n_blocks : 1));
+   if(!code_build_columns(code) || code->circ_start == NULL || code->circ == NULL) {
+      fprintf(stderr, "%s: unable to allocate the code\n", filename);
+      code_delete(code);
+      return NULL;
+   }
+   int n = 0;
+   for(int j = 0; j < cols; j++) {
+      code->circ_start[j] = n;
+      for(int i = 0; i < rows; i++) {
+         int first = code->row_start[i*z];
+         int d     = code->row_start[i*z+1] - first;
+         for(int k = 0; k < j; k++) {
+            if(base[i*cols+k] >= 0)
+               first++;
+         }
+         if(base[i*cols+j] >= 0) {
+            code->circ[n].first  = first;
+            code->circ[n].stride = d;
+            code->circ[n].shift  = base[i*cols+j];
+            n++;
+         }
+      }
+   }
+   code->circ_start[cols] = n;
+   return code;
+}
+
+
+// A 64 bit FNV-1a hash of the code's edges, so a specialised decoder
+// can tell whether it was made for this code
+uint64_t code_hash(const struct code *code) {
+   uint64_t h = 0xCBF29CE484222325ull;
+   const int *lists[2] = { code->row_start, code->edge_v };
+   int lengths[2] = { code->n_c + 1, code->n_edges };
+
+   for(int k = 0; k < 2; k++) {
+      for(int i = 0; i < lengths[k]; i++) {
+         h ^= (uint32_t)lists[k][i];
+         h *= 0x100000001B3ull;
+      }
+   }
+   return h;
+}
+
+
+// Write out a decoder specialised to this code and iteration count,
+// to be built in with -DLDPC_SPECIAL (see the Makefile). Every row
+// degree, edge offset and QC shift becomes a constant. For QC codes
+// the rows and variables of each block are loops over Z around the
+// constants, otherwise every row and variable is written out.
+// Returns 0 if the file could not be written.
+int code_write_special(const struct code *code, int n_i, const char *source, FILE *out) {
+   fprintf(out, "// Decoder specialised for %s, written by ldpc -G. Do not edit.\n", source);
+   fprintf(out, "#define SPECIAL_N_V        %d\n", code->n_v);
+   fprintf(out, "#define SPECIAL_N_C        %d\n", code->n_c);
+   fprintf(out, "#define SPECIAL_N_EDGES    %d\n", code->n_edges);
+   fprintf(out, "#define SPECIAL_ITERATIONS %d\n", n_i);
+   fprintf(out, "#define SPECIAL_HASH       0x%016llxull\n\n", (unsigned long long)code_hash(code));
+
+   // Check nodes
+   fprintf(out, "static void special_checks(struct state *s, struct iteration *it) {\n");
+   fprintf(out, "   double *in = it->message_c_to_v, *out = it->message_v_to_c;\n");
+   if(code->base != NULL) {
+      for(int i = 0; i < code->base_rows; i++) {
+         int first = code->row_start[i*code->z];
+         int d     = code->row_start[i*code->z+1] - first;
+         fprintf(out, "   for(int r = 0; r < %d; r++)\n", code->z);
+         fprintf(out, "      check_row(s, in + %d + r*%d, out + %d + r*%d, %d, s->scratch);\n",
+                 first, d, first, d, d);
+      }
+   } else {
+      for(int c = 0; c < code->n_c; c++) {
+         int first = code->row_start[c];
+         fprintf(out, "   check_row(s, in + %d, out + %d, %d, s->scratch);\n",
+                 first, first, code->row_start[c+1] - first);
+      }
+   }
+   fprintf(out, "}\n\n");
+
+   // Variable nodes, summing the edges in the same order as
+   // calc_message_c_to_v() so the results are the same
+   fprintf(out, "static void special_vars(struct state *s, struct iteration *it, double *next) {\n");
+   fprintf(out, "   const double *ch = s->channel_llr, *m = it->message_v_to_c;\n");
+   fprintf(out, "   double *l = it->l;\n");
+   if(code->base != NULL) {
+      int z = code->z;
+      for(int j = 0; j < code->base_cols; j++) {
+         int n = 0;
+         fprintf(out, "   for(int k = 0; k < %d; k++) {\n", z);
+         for(int i = 0; i < code->base_rows; i++) {
+            int shift = code->base[i*code->base_cols + j];
+            int first = code->row_start[i*z];
+            int d     = code->row_start[i*z+1] - first;
+            int pos   = 0;
+            if(shift < 0)
+               continue;
+            while(code->edge_v[first + pos] / z != j)
+               pos++;
+            fprintf(out, "      int e%d = %d + (k >= %d ? k - %d : k + %d)*%d;\n",
+                    n++, first + pos, shift, shift, z - shift, d);
+         }
+         fprintf(out, "      double sum = ch[%d + k]", j*z);
+         for(int i = 0; i < n; i++)
+            fprintf(out, " + m[e%d]", i);
+         fprintf(out, ";\n      l[%d + k] = sum;\n      if(next != NULL) {\n", j*z);
+         for(int i = 0; i < n; i++)
+            fprintf(out, "         next[e%d] = sum - m[e%d];\n", i, i);
+         fprintf(out, "      }\n   }\n");
+      }
+   } else {
+      fprintf(out, "   double sum;\n");
+      for(int v = 0; v < code->n_v; v++) {
+         fprintf(out, "   sum = ch[%d]", v);
+         for(int k = code->col_start[v]; k < code->col_start[v+1]; k++)
+            fprintf(out, " + m[%d]", code->col_edge[k]);
+         fprintf(out, ";\n   l[%d] = sum;\n   if(next != NULL) {\n", v);
+         for(int k = code->col_start[v]; k < code->col_start[v+1]; k++)
+            fprintf(out, "      next[%d] = sum - m[%d];\n", code->col_edge[k], code->col_edge[k]);
+         fprintf(out, "   }\n");
+      }
+   }
+   fprintf(out, "}\n");
+   return !ferror(out);
+}
+
+
+void config_default(struct config *config) {
+   config->check  = CHECK_SUM_PRODUCT;
+   config->offset = 0.5;
+   config->scale  = 0.75;
+   config->engine = ENGINE_DOUBLE;
+   config->q_bits = 6;
+   config->q_scale = 2.0;
+   config->schedule = SCHEDULE_FLOODING;
+}
+
+
+// Parse the fixed point format, given as "bits" or "bits:scale"
+int config_parse_fixed(struct config *config, const char *arg) {
+   char *end;
+   int bits = strtol(arg, &end, 10);
+   if(bits < FIXED_MIN_BITS || bits > FIXED_MAX_BITS)
+      return 0;
+   if(*end == ':') {
+      double q_scale = atof(end+1);
+      if(q_scale <= 0)
+         return 0;
+      config->q_scale = q_scale;
+   } else if(*end != '\0') {
+      return 0;
+   }
+   config->engine = ENGINE_FIXED;
+   config->q_bits = bits;
+   return 1;
+}
+
+
+// Parse a check node algorithm given as "name" or "name:value",
+// where the value is the offset or scale for oms and nms
+int config_parse_check(struct config *config, const char *arg) {
+   for(int i = 0; i < CHECK_ALGORITHM_COUNT; i++) {
+      size_t len = strlen(check_names[i]);
+      if(strncmp(arg, check_names[i], len) != 0 || (arg[len] != '\0' && arg[len] != ':'))
+         continue;
+      config->check = i;
+      if(arg[len] == ':') {
+         double value = atof(arg+len+1);
+         if(i == CHECK_OFFSET_MIN_SUM && value >= 0)
+            config->offset = value;
+         else if(i == CHECK_NORMALIZED_MIN_SUM && value > 0 && value <= 1)
+            config->scale = value;
+         else
+            return 0;
+      }
+      return 1;
+   }
+   return 0;
+}
+
+
+// The multi-frame kernels are the float engine, and are also used for
+// the min-sum forms with the double engine
+int config_uses_lanes(const struct config *config) {
+   return config->engine == ENGINE_FLOAT ||
+          (config->engine == ENGINE_DOUBLE && config->check != CHECK_SUM_PRODUCT);
+}
+
+
+// How many frames to hand state_decode_io() at a time to keep the
+// engine busy: a block of lanes, or for the GPU engine enough
+// launches to fill every queue twice over
+#define GPU_BATCH_FRAMES 512   // Frames per kernel launch
+#define GPU_STREAMS      2     // Command queues, each with its own buffers
+
+int config_batch_frames(const struct config *config) {
+   if(config->engine == ENGINE_GPU)
+      return GPU_BATCH_FRAMES * GPU_STREAMS * 2;
+   return BATCH_LANES;
+}
+
+
+// How much arena space state_new() needs. This must match the
+// allocations made there.
+size_t state_size(const struct code *code, const struct config *config, int n_i, int history) {
+   int n_v = code->n_v;
+   int n_e = code->n_edges;
+   int n_nodes = history ? n_i : 1;
+   size_t size = ARENA_ROUND(sizeof(struct state)) +
+                 ARENA_ROUND(sizeof(double)  * n_v) * 2 +
+                 ARENA_ROUND(sizeof(double)  * code->max_row_degree) +
+                 ARENA_ROUND(sizeof(int16_t) * n_v) * 2 +
+                 ARENA_ROUND(sizeof(int16_t) * n_e) * 2 +
+                 ARENA_ROUND(sizeof(int16_t) * code->max_row_degree) +
+                 ARENA_ROUND(sizeof(int32_t) * code->z) +
+                 ARENA_ROUND(sizeof(struct iteration) * n_nodes) +
+                 iteration_size(code) * n_nodes;
+   if(config_uses_lanes(config))
+      size += ARENA_ROUND(sizeof(lanes_f) * n_v) * 2 +
+              ARENA_ROUND(sizeof(lanes_f) * n_e) * 2 +
+              ARENA_ROUND(sizeof(lanes_f) * code->max_row_degree);
+   if(history)
+      size += ARENA_ROUND(sizeof(double) * code->max_row_degree) +
+              ARENA_ROUND(sizeof(int) * n_e) +
+              ARENA_ROUND(sizeof(int) * n_v) * 2 +
+              ARENA_ROUND(sizeof(int) * code->n_c) * 2;
+   return size;
+}
+
+
+#ifdef LDPC_SPECIAL
+static int special_matches(const struct code *code, int n_i);
+#endif
+#ifdef LDPC_OPENCL
+static struct gpu *gpu_new(const struct code *code);
+static void gpu_delete(struct gpu *g);
+#endif
+
+
+// Make a new decoder for a code. The code is only read, so many
+// decoders can share it, and it must outlive them. If 'history' is
+// set, the messages from every iteration are kept.
+//
+// The state's buffers all come from the arena if one is given, else
+// the state allocates an arena of its own. Returns NULL if there is
+// not enough memory (or not enough space left in the arena), or if
+// the GPU engine cannot be set up, which is reported on stderr. The
+// single precision and GPU engines only keep the final iteration, so
+// they cannot have history.
+struct state *state_new(const struct code *code, const struct config *config, int n_i, int history,
+                        struct arena *arena) {
+   int n_v = code->n_v;
+   int n_c = code->n_c;
+   int n_e = code->n_edges;
+   int n_nodes = history ? n_i : 1;
+   struct arena own_arena;
+
+   if(history && (config->engine == ENGINE_FLOAT || config->engine == ENGINE_GPU))
+      return NULL;
+   if(arena == NULL) {
+      if(!arena_init(&own_arena, state_size(code, config, n_i, history)))
+         return NULL;
+      arena = &own_arena;
+   }
+
+   struct state *s = arena_alloc(arena, sizeof(struct state));
+   if(s == NULL)
+      return NULL;
+   if(arena == &own_arena) {
+      s->own_arena = own_arena;
+      s->arena = &s->own_arena;
+   } else {
+      s->own_arena.base = NULL;
+      s->arena = arena;
+   }
+
+   s->code         = code;
+   s->config       = *config;
+   s->n_v          = n_v;
+   s->n_c          = n_c;
+   s->channel_llr  = NULL;
+   s->frame_llr    = arena_alloc(s->arena, sizeof(double) * n_v);
+   s->scratch      = arena_alloc(s->arena, sizeof(double) * code->max_row_degree);
+   s->q_channel    = arena_alloc(s->arena, sizeof(int16_t) * n_v);
+   s->q_l          = arena_alloc(s->arena, sizeof(int16_t) * n_v);
+   s->q_v_to_c     = arena_alloc(s->arena, sizeof(int16_t) * n_e);
+   s->q_c_to_v     = arena_alloc(s->arena, sizeof(int16_t) * n_e);
+   s->q_scratch    = arena_alloc(s->arena, sizeof(int16_t) * code->max_row_degree);
+   s->q_sum        = arena_alloc(s->arena, sizeof(int32_t) * code->z);
+   s->iteration    = arena_alloc(s->arena, sizeof(struct iteration) * n_nodes);
+   s->lane_channel = NULL;
+   s->lane_l       = NULL;
+   s->lane_v_to_c  = NULL;
+   s->lane_c_to_v  = NULL;
+   s->lane_scratch = NULL;
+   if(config_uses_lanes(config)) {
+      s->lane_channel = arena_alloc(s->arena, sizeof(lanes_f) * n_v);
+      s->lane_l       = arena_alloc(s->arena, sizeof(lanes_f) * n_v);
+      s->lane_v_to_c  = arena_alloc(s->arena, sizeof(lanes_f) * n_e);
+      s->lane_c_to_v  = arena_alloc(s->arena, sizeof(lanes_f) * n_e);
+      s->lane_scratch = arena_alloc(s->arena, sizeof(lanes_f) * code->max_row_degree);
+   }
+
+   s->row_out = NULL;
+   s->edge_c = NULL;
+   s->mark_v = NULL;
+   s->mark_c = NULL;
+   s->list_v = NULL;
+   s->list_c = NULL;
+   if(history) {
+      s->row_out = arena_alloc(s->arena, sizeof(double) * code->max_row_degree);
+      s->edge_c = arena_alloc(s->arena, sizeof(int) * n_e);
+      s->mark_v = arena_alloc(s->arena, sizeof(int) * n_v);
+      s->mark_c = arena_alloc(s->arena, sizeof(int) * n_c);
+      s->list_v = arena_alloc(s->arena, sizeof(int) * n_v);
+      s->list_c = arena_alloc(s->arena, sizeof(int) * n_c);
+   }
+
+   int ok = s->frame_llr != NULL && s->scratch != NULL &&
+            s->q_channel != NULL && s->q_l != NULL && s->q_v_to_c != NULL &&
+            s->q_c_to_v != NULL && s->q_scratch != NULL && s->q_sum != NULL && s->iteration != NULL &&
+            (!config_uses_lanes(config) || (s->lane_channel != NULL && s->lane_l != NULL &&
+                                            s->lane_v_to_c != NULL && s->lane_c_to_v != NULL &&
+                                            s->lane_scratch != NULL)) &&
+            (!history || (s->row_out != NULL && s->edge_c != NULL && s->mark_v != NULL && s->mark_c != NULL &&
+                          s->list_v != NULL && s->list_c != NULL));
+   for(int i = 0; ok && i < n_nodes; i++) {
+      ok = iteration_init(s, &s->iteration[i]);
+   }
+   if(!ok) {
+      if(s->arena == &s->own_arena)
+         arena_free(&own_arena);
+      return NULL;
+   }
+
+   // Setting all the elements
+   s->iterations      = n_i;
+   s->iterations_used = 0;
+   s->history         = history;
+   s->last_iteration  = NULL;
+   s->team            = NULL;
+   s->special         = 0;
+#ifdef LDPC_SPECIAL
+   s->special = special_matches(code, n_i);
+#endif
+   s->resumable       = 0;
+   s->stamp           = 0;
+   for(int c = 0; history && c < n_c; c++) {
+      for(int e = code->row_start[c]; e < code->row_start[c+1]; e++) {
+         s->edge_c[e] = c;
+      }
+      s->mark_c[c] = 0;
+   }
+   for(int v = 0; history && v < n_v; v++) {
+      s->mark_v[v] = 0;
+   }
+   s->gpu             = NULL;
+   if(config->engine == ENGINE_GPU) {
+#ifdef LDPC_OPENCL
+      if(config->check == CHECK_SUM_PRODUCT)
+         fprintf(stderr, "The GPU engine needs a min-sum check node algorithm\n");
+      else
+         s->gpu = gpu_new(code);
+#else
+      fprintf(stderr, "The GPU engine needs a build with LDPC_OPENCL (make ldpc_gpu)\n");
+#endif
+      if(s->gpu == NULL) {
+         if(s->arena == &s->own_arena)
+            arena_free(&own_arena);
+         return NULL;
+      }
+   }
+   return s;
+}
+
+
+// Change how the decoder is run. The engine decides which buffers
+// the state has, so it cannot change. (Without lane buffers the
+// double engine's min-sum forms are decoded a frame at a time.)
+// Returns 0 if the new config needs a new state.
+int state_set_config(struct state *s, const struct config *config) {
+   if(config->engine != s->config.engine ||
+      (config->engine == ENGINE_FIXED && config->check == CHECK_SUM_PRODUCT) ||
+      (config->engine == ENGINE_GPU && config->check == CHECK_SUM_PRODUCT))
+      return 0;
+   s->config    = *config;
+   s->resumable = 0;
+   return 1;
+}
+
+
+int state_iterations_used(const struct state *s) {
+   return s->iterations_used;
+}
+
+
+// The buffers for iteration 'it' (from 0) of the last decode, or NULL
+// if it did not get that far. Without history only the last
+// iteration is kept, whatever 'it' is.
+const struct iteration *state_get_iteration(const struct state *s, int it) {
+   if(it < 0 || it >= s->iterations_used)
+      return NULL;
+   return &s->iteration[s->history ? it : 0];
+}
+
+
+// The check node kernels work on one row's worth of messages. The
+// d incoming messages in in[] give the d outgoing messages in out[].
+
+// Exact sum-product. Each outgoing message uses the product of
+// tanh(m/2) over all the other edges in the row. Rather than redo
+// that product for each edge, the tanh values are computed once
+// (into t[]), and a running product from the left (held in out[])
+// is combined with a running product from the right.
+//
+// Once the product rounds to +/-1 the log would be infinite, and an
+// infinite message turns into NaN at the variable node, so outputs
+// are limited to SP_MAX_LLR, just beyond the largest finite output.
+#define SP_MAX_LLR 38.0
+
+static void check_sum_product(const double *in, double *out, int d, double *t) {
+   double left = 1.0, right = 1.0;
+
+   for(int i = 0; i < d; i++) {
+      t[i]   = tanh(in[i]/2);
+      out[i] = left;
+      left  *= t[i];
+   }
+   for(int i = d-1; i >= 0; i--) {
+      double p = out[i] * right;
+      out[i]   = log((1+p)/(1-p));
+      if(out[i] > SP_MAX_LLR)
+         out[i] = SP_MAX_LLR;
+      else if(out[i] < -SP_MAX_LLR)
+         out[i] = -SP_MAX_LLR;
+      right   *= t[i];
+   }
+}
+
+// Min-sum and its offset and normalized forms. The magnitude of
+// each outgoing message is the smallest incoming magnitude from the
+// other edges, which is the row minimum everywhere except at the
+// edge that holds the minimum, where it is the second smallest. So
+// one pass finds the two minimums and the XOR of all the signs, and
+// a second pass writes the messages out.
+//
+// Plain min-sum is offset = 0, scale = 1.
+static void check_min_sum(const double *in, double *out, int d, double offset, double scale) {
+   double min1 = HUGE_VAL, min2 = HUGE_VAL;
+   int min_index = 0;
+   int sign = 0;
+
+   for(int i = 0; i < d; i++) {
+      double m = fabs(in[i]);
+      sign ^= (in[i] < 0);
+      if(m < min1) {
+         min2      = min1;
+         min1      = m;
+         min_index = i;
+      } else if(m < min2) {
+         min2 = m;
+      }
+   }
+
+   min1 = (min1 - offset) * scale;
+   min2 = (min2 - offset) * scale;
+   if(min1 < 0) min1 = 0;
+   if(min2 < 0) min2 = 0;
+
+   for(int i = 0; i < d; i++) {
+      double m = (i == min_index) ? min2 : min1;
+      out[i] = (sign ^ (in[i] < 0)) ? -m : m;
+   }
+}
+
+// Run the configured check node kernel over one row, with t[] as
+// scratch space for up to max_row_degree values
+static void check_row(struct state *s, const double *in, double *out, int d, double *t) {
+   switch(s->config.check) {
+      case CHECK_MIN_SUM:
+         check_min_sum(in, out, d, 0.0, 1.0);
+         break;
+      case CHECK_OFFSET_MIN_SUM:
+         check_min_sum(in, out, d, s->config.offset, 1.0);
+         break;
+      case CHECK_NORMALIZED_MIN_SUM:
+         check_min_sum(in, out, d, 0.0, s->config.scale);
+         break;
+      default:
+         check_sum_product(in, out, d, t);
+         break;
+   }
+}
+
+// Work out all the messages leaving check node c.
+void calc_message_v_to_c(struct state *s, struct iteration *iteration, int c) {
+   int first = s->code->row_start[c];
+   check_row(s, iteration->message_c_to_v + first, iteration->message_v_to_c + first,
+             s->code->row_start[c+1] - first, s->scratch);
+}
+
+// Work out all the messages leaving variable node v, and the
+// total (L) for that variable while we are at it.
+double calc_message_c_to_v(struct state *s, struct iteration *iteration, struct iteration *next, int v) {
+   double l = s->channel_llr[v];
+   for(int k = s->code->col_start[v]; k < s->code->col_start[v+1]; k++) {
+      l += iteration->message_v_to_c[s->code->col_edge[k]];
+   }
+   if(next != NULL) {
+      for(int k = s->code->col_start[v]; k < s->code->col_start[v+1]; k++) {
+         int e = s->code->col_edge[k];
+         next->message_c_to_v[e] = l - iteration->message_v_to_c[e];
+      }
+   }
+   return l;
+} 
+
+// The same for the Z variables of block column j of a QC code, a
+// circulant at a time. Variable t of the block column is joined to
+// row t - shift of each circulant, wrapping round, so a circulant is
+// two runs of evenly spaced edges. The sums are in the same order as
+// calc_message_c_to_v()'s, so the results are the same.
+static void calc_block_column(struct state *s, struct iteration *iteration, struct iteration *next, int j) {
+   const struct code *code = s->code;
+   int z = code->z;
+   double *l = iteration->l + j*z;
+   const double *channel = s->channel_llr + j*z;
+
+   for(int t = 0; t < z; t++) {
+      l[t] = channel[t];
+   }
+   for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+      const double *m = iteration->message_v_to_c + code->circ[i].first;
+      int stride = code->circ[i].stride;
+      int shift  = code->circ[i].shift;
+      for(int t = 0; t < shift; t++) {
+         l[t] += m[(t+z-shift)*stride];
+      }
+      for(int t = shift; t < z; t++) {
+         l[t] += m[(t-shift)*stride];
+      }
+   }
+   for(int i = code->circ_start[j]; next != NULL && i < code->circ_start[j+1]; i++) {
+      const double *m = iteration->message_v_to_c + code->circ[i].first;
+      double *out = next->message_c_to_v + code->circ[i].first;
+      int stride = code->circ[i].stride;
+      int shift  = code->circ[i].shift;
+      for(int t = 0; t < shift; t++) {
+         out[(t+z-shift)*stride] = l[t] - m[(t+z-shift)*stride];
+      }
+      for(int t = shift; t < z; t++) {
+         out[(t-shift)*stride] = l[t] - m[(t-shift)*stride];
+      }
+   }
+}
+
+
+// Work out the syndrome from the iteration's hard decision, and note
+// that the iteration has been used. Returns 1 if all checks are
+// satisfied.
+static int iteration_done(struct state *s, struct iteration *current) {
+   current->unsatisfied = code_syndrome(s->code, current->hard, current->syndrome,
+                                        0, code_syndrome_units(s->code));
+   s->iterations_used++;
+   s->last_iteration = current;
+   return current->unsatisfied == 0;
+}
+
+
+// Fixed point decoder
+//
+// Messages are q_bits wide two's complement values, saturated to
+// +/-(2^(q_bits-1)-1) so the range is symmetric. The a-posteriori
+// sums are FIXED_APP_EXTRA_BITS wider and saturate the same way.
+// Only the min-sum check node forms are supported. The offset is
+// rounded to whole units, and the normalized min-sum scale is
+// rounded to 1/16ths and applied as (m*scale) >> 4.
+//
+// Apart from quantising the channel LLRs on the way in, this is all
+// integer arithmetic, so results are reproducible bit for bit.
+static int saturate(int x, int max) {
+   if(x > max || x < -max) {
+      STATS_SATURATED();
+      return x > max ? max : -max;
+   }
+   return x;
+}
+
+
+static void check_min_sum_fixed(const int16_t *in, int16_t *out, int d, int offset, int scale) {
+   int min1 = INT16_MAX, min2 = INT16_MAX;
+   int min_index = 0;
+   int sign = 0;
+
+   for(int i = 0; i < d; i++) {
+      int m = in[i] < 0 ? -in[i] : in[i];
+      sign ^= (in[i] < 0);
+      if(m < min1) {
+         min2      = min1;
+         min1      = m;
+         min_index = i;
+      } else if(m < min2) {
+         min2 = m;
+      }
+   }
+
+   min1 -= offset;
+   min2 -= offset;
+   if(min1 < 0) min1 = 0;
+   if(min2 < 0) min2 = 0;
+   min1 = (min1 * scale) >> FIXED_SCALE_SHIFT;
+   min2 = (min2 * scale) >> FIXED_SCALE_SHIFT;
+
+   for(int i = 0; i < d; i++) {
+      int m = (i == min_index) ? min2 : min1;
+      out[i] = (sign ^ (in[i] < 0)) ? -m : m;
+   }
+}
+
+
+static int state_decode_fixed(struct state *s) {
+   const struct code *code = s->code;
+   int msg_max = (1 << (s->config.q_bits-1)) - 1;
+   int app_max = (1 << (s->config.q_bits-1+FIXED_APP_EXTRA_BITS)) - 1;
+   int offset  = 0;
+   int scale   = 1 << FIXED_SCALE_SHIFT;
+   int z       = code->z;
+   int valid   = 0;
+
+   if(s->config.check == CHECK_OFFSET_MIN_SUM)
+      offset = (int)floor(s->config.offset * s->config.q_scale + 0.5);
+   if(s->config.check == CHECK_NORMALIZED_MIN_SUM)
+      scale  = (int)floor(s->config.scale * (1 << FIXED_SCALE_SHIFT) + 0.5);
+
+   // Quantise the input
+   for(int v = 0; v < s->n_v; v++) {
+      double q = floor(s->channel_llr[v] * s->config.q_scale + 0.5);
+      if(q > msg_max || q < -msg_max) {
+         STATS_COUNT(channel_clipped, 1);
+         q = q > msg_max ? msg_max : -msg_max;
+      }
+      s->q_channel[v] = (int16_t)q;
+   }
+   for(int e = 0; e < code->n_edges; e++) {
+      s->q_v_to_c[e] = s->q_channel[code->edge_v[e]];
+      s->q_c_to_v[e] = 0;
+   }
+   for(int v = 0; v < s->n_v; v++) {
+      s->q_l[v] = s->q_channel[v];
+   }
+
+   for(int it = 0; it < s->iterations; it++) {
+      struct iteration *current = state_iteration(s, it);
+      STATS_START(t);
+      if(s->config.schedule == SCHEDULE_LAYERED) {
+         // Each row takes its inputs from the a-posteriori sums,
+         // minus what it contributed last time, and puts its new
+         // messages straight back in. The sums before limiting
+         // to the message width are kept in q_scratch[].
+         for(int c = 0; c < s->n_c; c++) {
+            int first = code->row_start[c];
+            int d     = code->row_start[c+1] - first;
+            for(int i = 0; i < d; i++) {
+               int e = first + i;
+               int t = saturate(s->q_l[code->edge_v[e]] - s->q_c_to_v[e], app_max);
+               s->q_scratch[i] = t;
+               s->q_v_to_c[e]  = saturate(t, msg_max);
+            }
+            check_min_sum_fixed(s->q_v_to_c + first, s->q_c_to_v + first, d, offset, scale);
+            for(int i = 0; i < d; i++) {
+               int e = first + i;
+               s->q_l[code->edge_v[e]] = saturate(s->q_scratch[i] + s->q_c_to_v[e], app_max);
+            }
+         }
+         STATS_LAP(t, PHASE_CHECK);
+      } else {
+         for(int c = 0; c < s->n_c; c++) {
+            int first = code->row_start[c];
+            check_min_sum_fixed(s->q_v_to_c + first, s->q_c_to_v + first,
+                                code->row_start[c+1] - first, offset, scale);
+         }
+         STATS_LAP(t, PHASE_CHECK);
+
+         if(code->circ != NULL) {
+            // A block column at a time, as calc_block_column()
+            for(int j = 0; j < code->base_cols; j++) {
+               int32_t *sum = s->q_sum;
+               for(int t = 0; t < z; t++) {
+                  sum[t] = s->q_channel[j*z+t];
+               }
+               for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+                  const int16_t *m = s->q_c_to_v + code->circ[i].first;
+                  int stride = code->circ[i].stride;
+                  int shift  = code->circ[i].shift;
+                  for(int t = 0; t < shift; t++) {
+                     sum[t] += m[(t+z-shift)*stride];
+                  }
+                  for(int t = shift; t < z; t++) {
+                     sum[t] += m[(t-shift)*stride];
+                  }
+               }
+               for(int t = 0; t < z; t++) {
+                  s->q_l[j*z+t] = saturate(sum[t], app_max);
+               }
+            }
+         } else {
+            for(int v = 0; v < s->n_v; v++) {
+               int l = s->q_channel[v];
+               for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+                  l += s->q_c_to_v[code->col_edge[k]];
+               }
+               l = saturate(l, app_max);
+               s->q_l[v] = l;
+            }
+         }
+         STATS_LAP(t, PHASE_VARIABLE);
+      }
+      hard_pack_fixed(code, s->q_l, current->hard);
+
+      // Keep a copy of this iteration's messages for display
+      for(int e = 0; s->history && e < code->n_edges; e++) {
+         current->message_c_to_v[e] = s->q_v_to_c[e] / s->config.q_scale;
+         current->message_v_to_c[e] = s->q_c_to_v[e] / s->config.q_scale;
+      }
+      for(int v = 0; v < s->n_v; v++) {
+         current->l[v] = s->q_l[v] / s->config.q_scale;
+      }
+
+      valid = iteration_done(s, current);
+      STATS_LAP(t, PHASE_PARITY);
+      if(valid)
+         break;
+
+      int flooding = s->config.schedule == SCHEDULE_FLOODING;
+      if(flooding && code->circ != NULL) {
+         for(int j = 0; j < code->base_cols; j++) {
+            const int16_t *l = s->q_l + j*z;
+            for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+               const int16_t *m = s->q_c_to_v + code->circ[i].first;
+               int16_t *out = s->q_v_to_c + code->circ[i].first;
+               int stride = code->circ[i].stride;
+               int shift  = code->circ[i].shift;
+               for(int t = 0; t < shift; t++) {
+                  int e = (t+z-shift)*stride;
+                  out[e] = saturate(l[t] - m[e], msg_max);
+               }
+               for(int t = shift; t < z; t++) {
+                  int e = (t-shift)*stride;
+                  out[e] = saturate(l[t] - m[e], msg_max);
+               }
+            }
+         }
+      } else if(flooding) {
+         for(int v = 0; v < s->n_v; v++) {
+            for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+               int e = code->col_edge[k];
+               s->q_v_to_c[e] = saturate(s->q_l[v] - s->q_c_to_v[e], msg_max);
+            }
+         }
+      }
+      STATS_LAP(t, PHASE_VARIABLE);
+   }
+   STATS_FLUSH_SATURATED();
+   return valid;
+}
+
+
+// Layered (row serial) schedule
+//
+// Rather than every check working from the last iteration's
+// messages, each row is updated in turn against a running set of
+// a-posteriori sums (L), so later rows in an iteration already see
+// the work done by earlier ones. Only L and the check-to-variable
+// messages need to be kept between rows.
+//
+// Rows are taken one layer at a time, and every row of a layer reads
+// the same L: the inputs of the whole layer are formed first, then
+// its checks are run, then L is written back. For a QC code a layer
+// is a block row of Z rows. Its circulants touch each column at most
+// once, so writing back input plus output is the layer's whole
+// update. Other codes have one row per layer.
+static int state_decode_layered(struct state *s) {
+   const struct code *code = s->code;
+   struct iteration *previous = NULL;
+   int valid = 0;
+
+   for(int it = 0; it < s->iterations; it++) {
+      struct iteration *current = state_iteration(s, it);
+      // Carry L and the check-to-variable messages on from the
+      // last iteration. Without history these are updated in place.
+      for(int v = 0; v < s->n_v; v++) {
+         current->l[v] = previous ? previous->l[v] : s->channel_llr[v];
+      }
+
+      STATS_START(t);
+      for(int layer = 0; layer < s->n_c; layer += code->z) {
+         int first = code->row_start[layer];
+         int last  = code->row_start[layer + code->z];
+         double *in  = current->message_c_to_v;
+         double *out = current->message_v_to_c;
+         for(int e = first; e < last; e++) {
+            double old = previous ? previous->message_v_to_c[e] : 0.0;
+            in[e] = current->l[code->edge_v[e]] - old;
+         }
+         for(int c = layer; c < layer + code->z; c++) {
+            int row = code->row_start[c];
+            check_row(s, in + row, out + row, code->row_start[c+1] - row, s->scratch);
+         }
+         for(int e = first; e < last; e++) {
+            current->l[code->edge_v[e]] = in[e] + out[e];
+         }
+      }
+      STATS_LAP(t, PHASE_CHECK);
+
+      hard_pack(code, current->l, current->hard, 0, code->hard_words);
+      valid = iteration_done(s, current);
+      STATS_LAP(t, PHASE_PARITY);
+      if(valid)
+         break;
+      previous = current;
+   }
+   return valid;
+}
+
+
+// Intra-frame threading
+//
+// For very long codes a single frame can be split across a team of
+// threads. Each member owns a range of rows and a range of
+// variables, and every iteration runs in three phases with a barrier
+// after each:
+//
+//   1. Check nodes: for the member's rows, form the variable-to-check
+//      messages as L[v] minus the row's last message (the same sum
+//      the single threaded code makes) and run the check kernel.
+//   2. Variable nodes: for the member's variables, sum L and pack
+//      the hard decision.
+//   3. Parity: for the member's share of the syndrome (block rows, or
+//      words of 64 checks), count the unsatisfied checks.
+//
+// Members only ever write to their own rows' edges, their own
+// variables and their own words of the packed hard decision and
+// syndrome, and the ranges are split on cache line boundaries where
+// possible, so they do not fight over cache lines. Results are the
+// same as the single threaded decoder.
+//
+// Only the double engine's flooding schedule without history is
+// split this way, anything else runs on the calling thread.
+struct team_member {
+   int first_row, last_row;
+   int first_v, last_v;
+   int first_word, last_word;   // Of the packed hard decision
+   int first_unit, last_unit;   // Of the syndrome
+   int unsatisfied;
+   double *scratch;
+} __attribute__((aligned(ARENA_ALIGN)));
+
+struct team {
+   struct state *s;
+   int n;
+   int quit;   // Set before the barrier to take the team down
+   pthread_t *thread;
+   struct team_member *member;
+   pthread_barrier_t barrier;
+
+   // Members wait for 'ready' before first using the barrier, so
+   // that a team which fails to start can be taken down again, with
+   // 'failed' set
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int ready;
+   int failed;
+};
+
+struct team_start {
+   struct team *team;
+   int index;
+};
+
+
+// Run one decode as team member 'index'. Returns 1 if valid.
+static int team_decode(struct team *team, int index) {
+   struct state *s = team->s;
+   const struct code *code = s->code;
+   struct team_member *m = &team->member[index];
+   struct iteration *current = &s->iteration[0];
+   int valid = 0;
+
+   for(int it = 0; it < s->iterations; it++) {
+      STATS_START(t);
+      for(int c = m->first_row; c < m->last_row; c++) {
+         int first = code->row_start[c];
+         int last  = code->row_start[c+1];
+         for(int e = first; e < last; e++) {
+            int v = code->edge_v[e];
+            current->message_c_to_v[e] = it == 0 ? s->channel_llr[v]
+                                                 : current->l[v] - current->message_v_to_c[e];
+         }
+         check_row(s, current->message_c_to_v + first, current->message_v_to_c + first,
+                   last - first, m->scratch);
+      }
+      STATS_LAP(t, PHASE_CHECK);
+      pthread_barrier_wait(&team->barrier);
+
+      for(int v = m->first_v; v < m->last_v; v++) {
+         double l = s->channel_llr[v];
+         for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+            l += current->message_v_to_c[code->col_edge[k]];
+         }
+         current->l[v] = l;
+      }
+      STATS_LAP(t, PHASE_VARIABLE);
+      hard_pack(code, current->l, current->hard, m->first_word, m->last_word);
+      STATS_LAP(t, PHASE_PARITY);
+      pthread_barrier_wait(&team->barrier);
+
+      STATS_START(t_parity);
+      m->unsatisfied = code_syndrome(code, current->hard, current->syndrome,
+                                     m->first_unit, m->last_unit);
+      STATS_LAP(t_parity, PHASE_PARITY);
+      pthread_barrier_wait(&team->barrier);
+
+      int unsatisfied = 0;
+      for(int i = 0; i < team->n; i++) {
+         unsatisfied += team->member[i].unsatisfied;
+      }
+      if(index == 0) {
+         current->unsatisfied = unsatisfied;
+         s->iterations_used++;
+         s->last_iteration = current;
+      }
+      valid = (unsatisfied == 0);
+      if(valid)
+         break;
+   }
+   return valid;
+}
+
+
+static void *team_main(void *arg) {
+   struct team_start *start = arg;
+   struct team *team = start->team;
+   int index = start->index;
+   free(start);
+
+   pthread_mutex_lock(&team->lock);
+   while(!team->ready)
+      pthread_cond_wait(&team->cond, &team->lock);
+   int failed = team->failed;
+   pthread_mutex_unlock(&team->lock);
+
+   while(!failed) {
+      pthread_barrier_wait(&team->barrier);
+      if(team->quit)
+         break;
+      team_decode(team, index);
+      pthread_barrier_wait(&team->barrier);
+   }
+   return NULL;
+}
+
+
+// Split 'n' rows into 'parts' ranges with about the same number of
+// edges. Boundaries are moved to where the edge index is a multiple
+// of 'align' if there is one close by.
+static int team_split_rows(const int *weight, int n, int parts, int part, int align) {
+   if(part == 0)
+      return 0;
+   if(part == parts)
+      return n;
+   long target = (long)weight[n] * part / parts;
+   int i = 0;
+   while(i < n && weight[i] < target)
+      i++;
+   for(int d = 0; d < 4*align; d++) {
+      if(i+d <= n && weight[i+d] % align == 0) return i+d;
+      if(i-d >= 0 && weight[i-d] % align == 0) return i-d;
+   }
+   return i;
+}
+
+
+// Split 'n' variables into 'parts' ranges that start on a multiple
+// of 'align'
+static int team_split_vars(int n, int parts, int part, int align) {
+   if(part == parts)
+      return n;
+   return (int)((long)n * part / parts) / align * align;
+}
+
+
+// Take down a team, where the first n_started members have threads
+static void team_delete(struct team *team, int n_started) {
+   if(n_started != team->n) {
+      pthread_mutex_lock(&team->lock);
+      team->failed = 1;
+      team->ready  = 1;
+      pthread_cond_broadcast(&team->cond);
+      pthread_mutex_unlock(&team->lock);
+   }
+   for(int i = 1; i < n_started; i++) {
+      pthread_join(team->thread[i], NULL);
+   }
+   if(n_started == team->n)
+      pthread_barrier_destroy(&team->barrier);
+   pthread_mutex_destroy(&team->lock);
+   pthread_cond_destroy(&team->cond);
+   for(int i = 0; i < team->n; i++) {
+      free(team->member[i].scratch);
+   }
+   free(team->member);
+   free(team->thread);
+   free(team);
+}
+
+
+void state_stop_team(struct state *s) {
+   struct team *team = s->team;
+   if(team == NULL)
+      return;
+   // Release the members from the barrier at the top of their loop
+   team->quit = 1;
+   pthread_barrier_wait(&team->barrier);
+   team_delete(team, team->n);
+   s->team = NULL;
+}
+
+
+// Give the state a team of n_threads (including the caller) to
+// decode each frame with. Returns 0 if that was not possible.
+int state_start_team(struct state *s, int n_threads) {
+   const struct code *code = s->code;
+   if(s->team != NULL || n_threads < 2 || s->history)
+      return 0;
+
+   struct team *team = calloc(1, sizeof(struct team));
+   if(team == NULL)
+      return 0;
+   team->s      = s;
+   team->n      = n_threads;
+   team->thread = calloc(n_threads, sizeof(pthread_t));
+   team->member = aligned_alloc(ARENA_ALIGN, ARENA_ROUND(sizeof(struct team_member) * n_threads));
+   if(team->thread == NULL || team->member == NULL) {
+      free(team->thread);
+      free(team->member);
+      free(team);
+      return 0;
+   }
+
+   // Rows are split by edge count, on 8 edge (64 byte) boundaries.
+   // Variables are split by words of the packed hard decision, which
+   // for other than QC codes is on 64 variable boundaries, so each
+   // member's L values are in their own lines too.
+   int ok = 1;
+   for(int i = 0; i < n_threads; i++) {
+      struct team_member *m = &team->member[i];
+      m->first_row = team_split_rows(code->row_start, code->n_c, n_threads, i, 8);
+      m->last_row  = team_split_rows(code->row_start, code->n_c, n_threads, i+1, 8);
+      m->first_word = team_split_vars(code->hard_words, n_threads, i, 1);
+      m->last_word  = team_split_vars(code->hard_words, n_threads, i+1, 1);
+      m->first_v    = code_word_first_v(code, m->first_word);
+      m->last_v     = code_word_first_v(code, m->last_word);
+      m->first_unit = team_split_vars(code_syndrome_units(code), n_threads, i, 1);
+      m->last_unit  = team_split_vars(code_syndrome_units(code), n_threads, i+1, 1);
+      m->scratch   = malloc(sizeof(double) * (code->max_row_degree+1));
+      if(m->scratch == NULL)
+         ok = 0;
+   }
+   pthread_mutex_init(&team->lock, NULL);
+   pthread_cond_init(&team->cond, NULL);
+
+   int n_started = 1;
+   while(ok && n_started < n_threads) {
+      struct team_start *start = malloc(sizeof(struct team_start));
+      if(start == NULL)
+         break;
+      start->team  = team;
+      start->index = n_started;
+      if(pthread_create(&team->thread[n_started], NULL, team_main, start) != 0) {
+         free(start);
+         break;
+      }
+      n_started++;
+   }
+   if(n_started != n_threads) {
+      team_delete(team, n_started);
+      return 0;
+   }
+
+   pthread_barrier_init(&team->barrier, NULL, n_threads);
+   pthread_mutex_lock(&team->lock);
+   team->ready = 1;
+   pthread_cond_broadcast(&team->cond);
+   pthread_mutex_unlock(&team->lock);
+   s->team = team;
+   return 1;
+}
+
+
+static int state_decode_team(struct state *s) {
+   pthread_barrier_wait(&s->team->barrier);
+   int valid = team_decode(s->team, 0);
+   pthread_barrier_wait(&s->team->barrier);
+   return valid;
+}
+
+
+static int state_decode_float(struct state *s);
+#ifdef LDPC_OPENCL
+static int state_decode_gpu(struct state *s);
+#endif
+
+#ifdef LDPC_SPECIAL
+// Specialised decoder
+//
+// ldpc_special.h is written by "ldpc -G" for one code and iteration
+// count, and gives special_checks() and special_vars(), the flooding
+// passes with every degree and edge offset fixed. This is the same
+// decode as the generic flooding loop below, step for step.
+#include "ldpc_special.h"
+
+static int special_matches(const struct code *code, int n_i) {
+   return code->n_v == SPECIAL_N_V && code->n_c == SPECIAL_N_C &&
+          code->n_edges == SPECIAL_N_EDGES && n_i == SPECIAL_ITERATIONS &&
+          code_hash(code) == SPECIAL_HASH;
+}
+
+
+// The iteration count the built in decoder was made for
+int state_special_iterations(void) {
+   return SPECIAL_ITERATIONS;
+}
+
+
+static int state_decode_special(struct state *s) {
+   int valid = 0;
+
+   for(int e = 0; e < SPECIAL_N_EDGES; e++) {
+      s->iteration[0].message_c_to_v[e] = s->channel_llr[s->code->edge_v[e]];
+   }
+   for(int it = 0; it < SPECIAL_ITERATIONS; it++) {
+      struct iteration *current = state_iteration(s, it);
+      struct iteration *next = (it+1 < SPECIAL_ITERATIONS) ? state_iteration(s, it+1) : NULL;
+      STATS_START(t);
+      special_checks(s, current);
+      STATS_LAP(t, PHASE_CHECK);
+      special_vars(s, current, next ? next->message_c_to_v : NULL);
+      STATS_LAP(t, PHASE_VARIABLE);
+      hard_pack(s->code, current->l, current->hard, 0, s->code->hard_words);
+      valid = iteration_done(s, current);
+      STATS_LAP(t, PHASE_PARITY);
+      if(valid)
+         break;
+   }
+   return valid;
+}
+#endif
+
+// The double engine's flooding schedule
+static int state_decode_flooding(struct state *s) {
+   int valid = 0;
+
+   for(int e = 0; e < s->code->n_edges; e++) {
+      s->iteration[0].message_c_to_v[e] = s->channel_llr[s->code->edge_v[e]];
+   }
+
+   for(int it = 0; it < s->iterations; it++) {
+      struct iteration *current = state_iteration(s, it);
+      struct iteration *next = (it+1 < s->iterations) ? state_iteration(s, it+1) : NULL;
+      STATS_START(t);
+      for(int c = 0; c < s->n_c; c++) {  // For each check node
+         calc_message_v_to_c(s, current, c);
+      }
+      STATS_LAP(t, PHASE_CHECK);
+
+      if(s->code->circ != NULL) {
+         for(int j = 0; j < s->code->base_cols; j++) {
+            calc_block_column(s, current, next, j);
+         }
+      } else {
+         for(int v = 0; v < s->n_v; v++) {
+            current->l[v] = calc_message_c_to_v(s, current, next, v);
+         }
+      }
+      STATS_LAP(t, PHASE_VARIABLE);
+      hard_pack(s->code, current->l, current->hard, 0, s->code->hard_words);
+      valid = iteration_done(s, current);
+      STATS_LAP(t, PHASE_PARITY);
+      if(valid)
+         break;
+   }
+   return valid;
+}
+
+// Decode the n_v LLRs in llr[], which are read in place. Decoding
+// stops early once all the parity checks are satisfied, leaving the
+// number of iterations used in s->iterations_used and the final one
+// in s->last_iteration. Returns 1 if a valid codeword was found.
+int state_decode(struct state *s, const double *llr) {
+   int valid;
+   s->channel_llr     = llr;
+   s->iterations_used = 0;
+   s->last_iteration  = NULL;
+   s->resumable       = 0;
+
+   if(s->config.engine == ENGINE_FIXED)
+      valid = state_decode_fixed(s);
+   else if(s->config.engine == ENGINE_FLOAT)
+      valid = state_decode_float(s);
+#ifdef LDPC_OPENCL
+   else if(s->config.engine == ENGINE_GPU)
+      valid = state_decode_gpu(s);
+#endif
+   else if(s->config.schedule == SCHEDULE_LAYERED)
+      valid = state_decode_layered(s);
+   else if(s->team != NULL)
+      valid = state_decode_team(s);
+#ifdef LDPC_SPECIAL
+   else if(s->special)
+      valid = state_decode_special(s);
+#endif
+   else {
+      valid = state_decode_flooding(s);
+      s->resumable = s->history;
+   }
+   STATS_FRAME(valid, s->iterations_used);
+   return valid;
+}
+
+
+// Whether two messages are the same to the bit, so that everything
+// worked out from them is too
+static inline int same_bits(double a, double b) {
+   uint64_t x, y;
+   memcpy(&x, &a, sizeof(x));
+   memcpy(&y, &b, sizeof(y));
+   return x == y;
+}
+
+
+// Re-decode after a change to the LLR of variable v alone. llr[] is
+// the whole frame, the same as the last state_decode() or
+// state_redecode() of this state in every other variable. The result,
+// in every iteration's buffers, is the same as state_decode(s, llr).
+//
+// With history and the double engine's flooding schedule, only what
+// the change reaches is worked out again. In each iteration the checks
+// with an input that changed are run, and only their outputs that
+// came out different to the bit are stored and passed on to their
+// variables. Those variables (and v itself) are summed again, and only
+// the messages that differ mark their checks for the next iteration.
+// Everything else is the same as last time, as its inputs are. Min-sum
+// mostly settles back to the same messages within a few checks of v,
+// but once more than REDECODE_FULL_FRACTION of the checks are changed
+// the lists cost more than they save, and the rest of the iterations
+// work out every node, as do the iterations past where the last decode
+// went to. Anything else is a full decode.
+#define REDECODE_FULL_FRACTION 0.25
+
+int state_redecode(struct state *s, const double *llr, int v) {
+   if(!s->resumable || s->last_iteration == NULL || v < 0 || v >= s->n_v)
+      return state_decode(s, llr);
+
+   const struct code *code = s->code;
+   int old_used = s->iterations_used;
+   int valid = 0;
+   int n_list_c = 0;
+   int full = 0;
+
+   s->channel_llr     = llr;
+   s->iterations_used = 0;
+   s->last_iteration  = NULL;
+   s->stamp++;
+   for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+      int e = code->col_edge[k];
+      int c = s->edge_c[e];
+      if(!same_bits(s->iteration[0].message_c_to_v[e], llr[v]) && s->mark_c[c] != s->stamp) {
+         s->mark_c[c] = s->stamp;
+         s->list_c[n_list_c++] = c;
+      }
+      s->iteration[0].message_c_to_v[e] = llr[v];
+   }
+
+   for(int it = 0; it < s->iterations; it++) {
+      struct iteration *current = state_iteration(s, it);
+      struct iteration *next = (it+1 < s->iterations) ? state_iteration(s, it+1) : NULL;
+      STATS_START(t);
+      full |= it >= old_used || n_list_c > REDECODE_FULL_FRACTION * s->n_c;
+      if(full) {
+         for(int c = 0; c < s->n_c; c++) {
+            calc_message_v_to_c(s, current, c);
+         }
+         STATS_LAP(t, PHASE_CHECK);
+         for(int u = 0; u < s->n_v; u++) {
+            current->l[u] = calc_message_c_to_v(s, current, next, u);
+         }
+         STATS_LAP(t, PHASE_VARIABLE);
+      } else {
+         int n_list_v = 1;
+         s->stamp++;
+         s->list_v[0] = v;
+         s->mark_v[v] = s->stamp;
+         for(int i = 0; i < n_list_c; i++) {
+            int c = s->list_c[i];
+            int first = code->row_start[c], d = code->row_start[c+1] - first;
+            double *out = current->message_v_to_c + first;
+            check_row(s, current->message_c_to_v + first, s->row_out, d, s->scratch);
+            for(int k = 0; k < d; k++) {
+               int u = code->edge_v[first + k];
+               if(same_bits(s->row_out[k], out[k]))
+                  continue;
+               out[k] = s->row_out[k];
+               if(s->mark_v[u] != s->stamp) {
+                  s->mark_v[u] = s->stamp;
+                  s->list_v[n_list_v++] = u;
+               }
+            }
+         }
+         STATS_LAP(t, PHASE_CHECK);
+
+         // The same sums, in the same order, as calc_message_c_to_v()
+         n_list_c = 0;
+         s->stamp++;
+         for(int i = 0; i < n_list_v; i++) {
+            int u = s->list_v[i];
+            double l = llr[u];
+            for(int k = code->col_start[u]; k < code->col_start[u+1]; k++) {
+               l += current->message_v_to_c[code->col_edge[k]];
+            }
+            current->l[u] = l;
+            for(int k = code->col_start[u]; next != NULL && k < code->col_start[u+1]; k++) {
+               int e = code->col_edge[k];
+               int c = s->edge_c[e];
+               double m = l - current->message_v_to_c[e];
+               if(same_bits(m, next->message_c_to_v[e]))
+                  continue;
+               next->message_c_to_v[e] = m;
+               if(s->mark_c[c] != s->stamp) {
+                  s->mark_c[c] = s->stamp;
+                  s->list_c[n_list_c++] = c;
+               }
+            }
+         }
+         STATS_LAP(t, PHASE_VARIABLE);
+      }
+      hard_pack(code, current->l, current->hard, 0, code->hard_words);
+      valid = iteration_done(s, current);
+      STATS_LAP(t, PHASE_PARITY);
+      if(valid)
+         break;
+   }
+   s->resumable = 1;
+   STATS_FRAME(valid, s->iterations_used);
+   return valid;
+}
+
+// Multi-frame decoding
+//
+// Up to BATCH_LANES frames are decoded together using the min-sum
+// forms, with frame k in lane k of each vector and messages laid out
+// as [edge][lane]. Every frame has the same edge walk, so the loops
+// are the same as the single frame ones with each scalar replaced by
+// a vector of lanes.
+//
+// The vectors are GCC vector types, so the compiler picks the best
+// instructions for the target, and on x86 the kernel is built for
+// AVX-512, AVX2 and baseline SSE with the best one picked at load
+// time. On ARM it builds for NEON.
+#if defined(__x86_64__) && !defined(NO_TARGET_CLONES)
+#define BATCH_TARGETS __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+#define LANE_SIGN ((int32_t)0x80000000)
+
+// Pick a where mask is set, otherwise b
+#define lanes_select(mask, a, b) ((lanes_f)(((mask) & (lanes_i)(a)) | (~(mask) & (lanes_i)(b))))
+
+
+// Single precision sum-product
+//
+// With phi(x) = -log(tanh(x/2)) = 2 atanh(exp(-x)), which is its own
+// inverse for x > 0, the sum-product check update is
+//
+//   |out[i]| = phi(sum over j != i of phi(|in[j]|))
+//
+// with the sign being the product of the other signs. As in the
+// double kernel, the sums over the other edges come from running
+// sums from the left and right, so nothing is subtracted and small
+// sums (strong outputs) keep their precision.
+//
+// exp() is a degree 7 polynomial on [-ln 2/2, ln 2/2] with the
+// exponent set directly, and also gives exp(-x) - 1 so that 1 - e is
+// accurate for small x. atanh(e) for e <= 1/4 and log() of the
+// mantissa both use the odd series r + r^3/3 + ... + r^13/13, which
+// is good to about 1e-10 where it is used. phi() limits its argument
+// to [SP_LANES_MIN, SP_LANES_MAX], where SP_LANES_MIN = phi(SP_LANES_MAX),
+// so outputs are at most 24 as well.
+//
+// Against check_sum_product() in double, given the same inputs
+// limited to +/-24, over 4 million outputs from random rows of degree
+// 2 to 24 with LLRs up to 30, the largest error seen is 2.5e-6
+// absolute, or 4.1e-7 relative for outputs above 1.
+#define SP_LANES_MIN 7.5502e-11f
+#define SP_LANES_MAX 24.0f
+
+// The helpers work in place through pointers, as vectors passed by
+// value would depend on the target's ABI
+static inline __attribute__((always_inline))
+void lanes_odd_series(lanes_f *x) {
+   lanes_f r  = *x;
+   lanes_f r2 = r * r;
+   lanes_f p  = r2 * (1.0f/13);
+   p = p + 1.0f/11;
+   p = p * r2 + 1.0f/9;
+   p = p * r2 + 1.0f/7;
+   p = p * r2 + 1.0f/5;
+   p = p * r2 + 1.0f/3;
+   p = p * r2 + 1.0f;
+   *x = r * p;
+}
+
+
+// exp(-x) for x from 0 to SP_LANES_MAX, and exp(-x) - 1 without
+// the cancellation for small x. x = n ln 2 - r, with ln 2 in two
+// parts so that r is exact.
+static inline __attribute__((always_inline))
+void lanes_exp_neg(lanes_f *x, lanes_f *em1) {
+   lanes_f t = *x * -1.44269504f + 0.5f;
+   lanes_i n = __builtin_convertvector(t, lanes_i);
+   n += __builtin_convertvector(n, lanes_f) > t;   // Round down, not toward zero (true is -1)
+   lanes_f nf = __builtin_convertvector(n, lanes_f);
+   lanes_f r  = -*x - nf * 0.693145752f - nf * 1.42860677e-6f;
+   lanes_f p  = r * (1.0f/5040);
+   p = (p + 1.0f/720) * r;
+   p = (p + 1.0f/120) * r;
+   p = (p + 1.0f/24) * r;
+   p = (p + 1.0f/6) * r;
+   p = (p + 0.5f) * r;
+   p = (p + 1.0f) * r;   // exp(r) - 1
+   *x   = (lanes_f)((lanes_i)(p + 1.0f) + (n << 23));
+   *em1 = lanes_select(n == 0, p, *x - 1.0f);
+}
+
+
+// log(q) for normal q > 0
+static inline __attribute__((always_inline))
+void lanes_log(lanes_f *q) {
+   lanes_i bits = (lanes_i)*q;
+   lanes_i k    = (bits >> 23) - 127;
+   lanes_i big  = (bits & 0x7FFFFF) > 0x3504F3;   // Mantissa above sqrt(2)
+   lanes_f m    = (lanes_f)((bits & 0x7FFFFF) | (0x3F800000 - (big & 0x800000)));
+   lanes_f r    = (m - 1.0f) / (m + 1.0f);
+   k -= big;
+   lanes_odd_series(&r);
+   *q = __builtin_convertvector(k, lanes_f) * 0.693147181f + 2.0f * r;
+}
+
+
+static inline __attribute__((always_inline))
+void lanes_phi(lanes_f *x) {
+   lanes_f e = *x;
+   e = lanes_select(e < SP_LANES_MIN, (lanes_f){0} + SP_LANES_MIN, e);
+   e = lanes_select(e > SP_LANES_MAX, (lanes_f){0} + SP_LANES_MAX, e);
+   lanes_f em1;
+   lanes_exp_neg(&e, &em1);
+   lanes_f small = e, q = (2.0f + em1) / -em1;   // (1 + e) / (1 - e)
+   lanes_odd_series(&small);
+   lanes_log(&q);
+   *x = lanes_select(e <= 0.25f, 2.0f * small, q);
+}
+
+
+static inline __attribute__((always_inline))
+void check_sum_product_lanes(const lanes_f *in, lanes_f *out, int d, lanes_f *t) {
+   lanes_f left = (lanes_f){0}, right = (lanes_f){0};
+   lanes_i sign = (lanes_i){0};
+
+   for(int i = 0; i < d; i++) {
+      lanes_i bits = (lanes_i)in[i];
+      sign  ^= bits & LANE_SIGN;
+      t[i]   = (lanes_f)(bits & ~LANE_SIGN);
+      lanes_phi(&t[i]);
+      out[i] = left;
+      left  += t[i];
+   }
+   for(int i = d-1; i >= 0; i--) {
+      // With no other edges the sum is 0 and phi gives the largest
+      // output, as the double kernel does with a product of 1
+      lanes_f m = out[i] + right;
+      lanes_phi(&m);
+      right   += t[i];
+      out[i]   = (lanes_f)((lanes_i)m ^ (sign ^ ((lanes_i)in[i] & LANE_SIGN)));
+   }
+}
+
+
+static inline __attribute__((always_inline))
+void check_min_sum_lanes(const lanes_f *in, lanes_f *out, int d, float offset, float scale) {
+   lanes_f min1 = (lanes_f){0} + HUGE_VALF;
+   lanes_f min2 = min1;
+   lanes_i min_index = (lanes_i){0};
+   lanes_i sign = (lanes_i){0};
+
+   for(int i = 0; i < d; i++) {
+      lanes_i bits = (lanes_i)in[i];
+      lanes_f m    = (lanes_f)(bits & ~LANE_SIGN);
+      lanes_i lt1  = m < min1;
+      sign ^= bits & LANE_SIGN;
+      min2      = lanes_select(lt1, min1, lanes_select(m < min2, m, min2));
+      min_index = (lt1 & i) | (~lt1 & min_index);
+      min1      = lanes_select(lt1, m, min1);
+   }
+
+   min1 = (min1 - offset) * scale;
+   min2 = (min2 - offset) * scale;
+   min1 = lanes_select(min1 < 0, (lanes_f){0}, min1);
+   min2 = lanes_select(min2 < 0, (lanes_f){0}, min2);
+
+   for(int i = 0; i < d; i++) {
+      lanes_f m = lanes_select(min_index == i, min2, min1);
+      out[i] = (lanes_f)((lanes_i)m ^ (sign ^ ((lanes_i)in[i] & LANE_SIGN)));
+   }
+}
+
+
+// Decode the frames already loaded into s->lane_channel. Lanes that
+// reach a valid codeword have their hard decisions (as bytes unless
+// bits is NULL, and packed unless packed is NULL) and results written
+// out at that point, and decoding stops when all lanes are done.
+// Returns the mask of lanes that were done.
+BATCH_TARGETS
+static uint32_t decode_lanes(struct state *s, uint32_t done, const struct frame_io *out,
+                             float offset, float scale) {
+   const struct code *code = s->code;
+   lanes_f *channel = s->lane_channel;
+   lanes_f *l       = s->lane_l;
+   lanes_f *v_to_c  = s->lane_v_to_c;
+   lanes_f *c_to_v  = s->lane_c_to_v;
+   lanes_f *t       = s->lane_scratch;
+   int sum_product  = s->config.check == CHECK_SUM_PRODUCT;
+   uint32_t all = (1u << BATCH_LANES) - 1;
+
+   for(int e = 0; e < code->n_edges; e++) {
+      v_to_c[e] = channel[code->edge_v[e]];
+      c_to_v[e] = (lanes_f){0};
+   }
+   for(int v = 0; v < code->n_v; v++) {
+      l[v] = channel[v];
+   }
+
+   for(int it = 1; it <= s->iterations && done != all; it++) {
+      STATS_START(t_phase);
+      if(s->config.schedule == SCHEDULE_LAYERED) {
+         for(int c = 0; c < code->n_c; c++) {
+            int first = code->row_start[c];
+            int last  = code->row_start[c+1];
+            for(int e = first; e < last; e++) {
+               v_to_c[e] = l[code->edge_v[e]] - c_to_v[e];
+            }
+            if(sum_product)
+               check_sum_product_lanes(v_to_c + first, c_to_v + first, last - first, t);
+            else
+               check_min_sum_lanes(v_to_c + first, c_to_v + first, last - first, offset, scale);
+            for(int e = first; e < last; e++) {
+               l[code->edge_v[e]] = v_to_c[e] + c_to_v[e];
+            }
+         }
+         STATS_LAP(t_phase, PHASE_CHECK);
+      } else {
+         for(int c = 0; c < code->n_c; c++) {
+            int first = code->row_start[c];
+            int d     = code->row_start[c+1] - first;
+            if(sum_product)
+               check_sum_product_lanes(v_to_c + first, c_to_v + first, d, t);
+            else
+               check_min_sum_lanes(v_to_c + first, c_to_v + first, d, offset, scale);
+         }
+         STATS_LAP(t_phase, PHASE_CHECK);
+
+         if(code->circ != NULL) {
+            // A block column at a time, as calc_block_column()
+            int z = code->z;
+            for(int j = 0; j < code->base_cols; j++) {
+               lanes_f *sum = l + j*z;
+               for(int t = 0; t < z; t++) {
+                  sum[t] = channel[j*z+t];
+               }
+               for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+                  const lanes_f *m = c_to_v + code->circ[i].first;
+                  int stride = code->circ[i].stride;
+                  int shift  = code->circ[i].shift;
+                  for(int t = 0; t < shift; t++) {
+                     sum[t] += m[(t+z-shift)*stride];
+                  }
+                  for(int t = shift; t < z; t++) {
+                     sum[t] += m[(t-shift)*stride];
+                  }
+               }
+               for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+                  const lanes_f *m = c_to_v + code->circ[i].first;
+                  lanes_f *out = v_to_c + code->circ[i].first;
+                  int stride = code->circ[i].stride;
+                  int shift  = code->circ[i].shift;
+                  for(int t = 0; t < shift; t++) {
+                     int e = (t+z-shift)*stride;
+                     out[e] = sum[t] - m[e];
+                  }
+                  for(int t = shift; t < z; t++) {
+                     int e = (t-shift)*stride;
+                     out[e] = sum[t] - m[e];
+                  }
+               }
+            }
+         } else {
+            for(int v = 0; v < code->n_v; v++) {
+               lanes_f sum = channel[v];
+               for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+                  sum += c_to_v[code->col_edge[k]];
+               }
+               l[v] = sum;
+               for(int k = code->col_start[v]; k < code->col_start[v+1]; k++) {
+                  int e = code->col_edge[k];
+                  v_to_c[e] = sum - c_to_v[e];
+               }
+            }
+         }
+         STATS_LAP(t_phase, PHASE_VARIABLE);
+      }
+
+      // Per lane syndrome, and a count of unsatisfied checks. The
+      // bits are l < 0 as for the hard decision, so that -0.0 is a
+      // zero bit here too.
+      lanes_i unsatisfied = (lanes_i){0};
+      for(int c = 0; c < code->n_c; c++) {
+         lanes_i p = (lanes_i){0};
+         for(int e = code->row_start[c]; e < code->row_start[c+1]; e++) {
+            p ^= l[code->edge_v[e]] < 0;
+         }
+         unsatisfied -= p;
+      }
+
+      for(int lane = 0; lane < BATCH_LANES; lane++) {
+         if(done & (1u << lane))
+            continue;
+         if(unsatisfied[lane] != 0 && it != s->iterations)
+            continue;
+         size_t base = (size_t)lane*code->n_v;
+         for(int v = 0; out->bits != NULL && v < code->n_v; v++) {
+            out->bits[base + v] = l[v][lane] < 0;
+         }
+         if(out->packed != NULL) {
+            uint64_t *packed = out->packed + (size_t)lane*WORDS(code->n_v);
+            for(int w = 0; w < WORDS(code->n_v); w++) {
+               int end = (w+1)*64 < code->n_v ? (w+1)*64 : code->n_v;
+               uint64_t x = 0;
+               for(int v = w*64; v < end; v++)
+                  x |= (uint64_t)(l[v][lane] < 0) << (v%64);
+               packed[w] = x;
+            }
+         }
+         for(int v = 0; out->app != NULL && v < code->n_v; v++) {
+            out->app[base + v] = l[v][lane];
+         }
+         for(int v = 0; out->extrinsic != NULL && v < code->n_v; v++) {
+            out->extrinsic[base + v] = l[v][lane] - channel[v][lane];
+         }
+         out->results[lane].valid       = unsatisfied[lane] == 0;
+         out->results[lane].iterations  = it;
+         out->results[lane].unsatisfied = unsatisfied[lane];
+         done |= 1u << lane;
+      }
+      STATS_LAP(t_phase, PHASE_PARITY);
+   }
+   return done;
+}
+
+
+// Rate matching
+//
+// A transmission carries e of the codeword's bits, in this order:
+// the codeword less its first 'punctured' bits and its filler bits
+// is read as a circular buffer from 'start', wrapping round (and so
+// repeating bits) if e is longer than it. Filler bits are known
+// zeros that are never sent, as in shortening.
+//
+// A filler bit's LLR would be saturated, so its messages never
+// change and it adds nothing to any check node, and every edge to it
+// is inactive. So rather than decode the whole code with saturated
+// LLRs, decoders are made for the shortened code (rate_match_code()),
+// which is the code with the filler columns taken out. Its variables
+// are the other codeword bits in order. Punctured bits are decoded
+// from no LLR at all (0).
+struct rate_match {
+   struct code *code;    // The shortened code
+   int n_v;              // Of the whole code
+   int e;
+   int *position;        // Codeword bit sent as each received LLR
+   int *column;          // Codeword bit of each variable of the shortened code
+   // The received LLRs of shortened variable v are the rx_start[v]
+   // to rx_start[v+1]-1 entries of rx[]
+   int *rx_start;
+   int *rx;
+};
+
+
+void rate_match_delete(struct rate_match *rm) {
+   if(rm == NULL)
+      return;
+   if(rm->code != NULL)
+      code_delete(rm->code);
+   free(rm->position);
+   free(rm->column);
+   free(rm->rx_start);
+   free(rm->rx);
+   free(rm);
+}
+
+
+// Build the rate matching for a code, with n_filler filler bits from
+// codeword bit filler_first. Prints what is wrong to stderr and
+// returns NULL if it cannot be done.
+struct rate_match *rate_match_new(const struct code *code, int punctured, int filler_first, int n_filler,
+                                  int start, int e) {
+   int n_v = code->n_v;
+   if(punctured < 0 || n_filler < 0 || filler_first < 0 || filler_first + n_filler > n_v ||
+      start < 0 || e <= 0) {
+      fprintf(stderr, "Bad rate matching parameters\n");
+      return NULL;
+   }
+
+   struct rate_match *rm = calloc(1, sizeof(struct rate_match));
+   int *map = malloc(sizeof(int) * n_v);
+   int *buffer = malloc(sizeof(int) * n_v);
+   int n_short = 0, n_buffer = 0, n_e = 0, ok = 1;
+   if(rm == NULL || map == NULL || buffer == NULL) {
+      fprintf(stderr, "Unable to allocate the rate matching\n");
+      free(rm);
+      free(map);
+      free(buffer);
+      return NULL;
+   }
+
+   rm->n_v = n_v;
+   rm->e   = e;
+   for(int v = 0; v < n_v; v++) {
+      int filler = v >= filler_first && v < filler_first + n_filler;
+      map[v] = filler ? -1 : n_short++;
+      if(!filler && v >= punctured)
+         buffer[n_buffer++] = v;
+   }
+   for(int i = 0; i < code->n_edges; i++) {
+      if(map[code->edge_v[i]] >= 0)
+         n_e++;
+   }
+   if(n_buffer == 0) {
+      fprintf(stderr, "Rate matching leaves no bits to send\n");
+      ok = 0;
+   }
+
+   // The shortened code. A check left with one bit would pin it to 0,
+   // and needs a different code rather than shortening.
+   if(ok && (rm->code = code_alloc(code->n_c, n_short, n_e)) == NULL) {
+      fprintf(stderr, "Unable to allocate the shortened code\n");
+      ok = 0;
+   }
+   if(ok) {
+      struct code *s = rm->code;
+      int k = 0;
+      for(int c = 0; ok && c < code->n_c; c++) {
+         s->row_start[c] = k;
+         for(int i = code->row_start[c]; i < code->row_start[c+1]; i++) {
+            if(map[code->edge_v[i]] >= 0)
+               s->edge_v[k++] = map[code->edge_v[i]];
+         }
+         if(k - s->row_start[c] < 2) {
+            fprintf(stderr, "Shortening leaves check %d with fewer than two bits\n", c);
+            ok = 0;
+         }
+      }
+      s->row_start[code->n_c] = k;
+      if(ok && !code_build_columns(s)) {
+         fprintf(stderr, "Unable to allocate the shortened code\n");
+         ok = 0;
+      }
+   }
+
+   if(ok) {
+      rm->position = malloc(sizeof(int) * e);
+      rm->column   = malloc(sizeof(int) * (n_short > 0 ? n_short : 1));
+      rm->rx_start = calloc(n_short + 1, sizeof(int));
+      rm->rx       = malloc(sizeof(int) * e);
+      if(rm->position == NULL || rm->column == NULL || rm->rx_start == NULL || rm->rx == NULL) {
+         fprintf(stderr, "Unable to allocate the rate matching\n");
+         ok = 0;
+      }
+   }
+   if(ok) {
+      for(int v = 0; v < n_v; v++) {
+         if(map[v] >= 0)
+            rm->column[map[v]] = v;
+      }
+      for(int i = 0; i < e; i++) {
+         rm->position[i] = buffer[((long)start + i) % n_buffer];
+         rm->rx_start[map[rm->position[i]]+1]++;
+      }
+      for(int v = 0; v < n_short; v++) {
+         rm->rx_start[v+1] += rm->rx_start[v];
+      }
+      int *fill = buffer;   // No longer needed
+      memcpy(fill, rm->rx_start, sizeof(int) * n_short);
+      for(int i = 0; i < e; i++) {
+         rm->rx[fill[map[rm->position[i]]]++] = i;
+      }
+   }
+   free(map);
+   free(buffer);
+   if(!ok) {
+      rate_match_delete(rm);
+      return NULL;
+   }
+   return rm;
+}
+
+
+// The code to make decoders for, and the received LLRs per frame
+const struct code *rate_match_code(const struct rate_match *rm) {
+   return rm->code;
+}
+
+
+int rate_match_length(const struct rate_match *rm) {
+   return rm->e;
+}
+
+
+// The codeword bit sent as each of the e received LLRs
+const int *rate_match_positions(const struct rate_match *rm) {
+   return rm->position;
+}
+
+
+// Put a frame of e received LLRs in order for the shortened code,
+// adding up repeated bits
+void rate_match_llr(const struct rate_match *rm, const float *rx, float *llr) {
+   for(int v = 0; v < rm->code->n_v; v++) {
+      float sum = 0.0f;
+      for(int i = rm->rx_start[v]; i < rm->rx_start[v+1]; i++)
+         sum += rx[rm->rx[i]];
+      llr[v] = sum;
+   }
+}
+
+
+// Turn the shortened code's hard decision back into the n_v bit
+// codeword, with the filler bits 0
+void rate_match_bits(const struct rate_match *rm, const uint8_t *bits, uint8_t *codeword) {
+   memset(codeword, 0, rm->n_v);
+   for(int v = 0; v < rm->code->n_v; v++) {
+      codeword[rm->column[v]] = bits[v];
+   }
+}
+
+
+// Sample i of the frames in io
+static inline float frame_sample(const struct frame_io *io, size_t i, float inverse_scale) {
+   if(io->type == LLR_INT8)
+      return ((const int8_t *)io->llr)[i] * inverse_scale;
+   return ((const float *)io->llr)[i];
+}
+
+
+// The LLR of variable v of a frame of io, for a code of n_v bits
+static inline float frame_llr(const struct frame_io *io, size_t frame, int v, int n_v, float inverse_scale) {
+   const struct rate_match *rm = io->rm;
+   if(rm == NULL)
+      return frame_sample(io, frame*n_v + v, inverse_scale);
+
+   float sum = 0.0f;
+   for(int i = rm->rx_start[v]; i < rm->rx_start[v+1]; i++)
+      sum += frame_sample(io, frame*rm->e + rm->rx[i], inverse_scale);
+   return sum;
+}
+
+
+#ifdef LDPC_OPENCL
+// GPU decoding
+//
+// The GPU engine is the float engine's min-sum decoding as an OpenCL
+// kernel, with one work-group per frame and up to GPU_BATCH_FRAMES
+// frames per launch. A frame's messages and L values are kept in the
+// work-group's local memory when they fit, as they do for the usual
+// QC codes of a few thousand bits, else in global memory. Each check
+// and each bit is updated by one work-item, with the arithmetic of
+// check_min_sum_lanes() and decode_lanes() done in the same order and
+// without contraction, so the results are the same as the CPU's.
+//
+// The layered schedule updates a layer of checks at once, where a
+// layer is a run of consecutive checks with no bit in common, so it
+// gives the same result as one check after another. For a QC code a
+// layer is normally a block row.
+//
+// On the host the frames are split into launches, dealt out in turn
+// to GPU_STREAMS in-order command queues that each have their own
+// device and pinned host buffers. While a queue uploads, decodes and
+// reads back its launch, the host is turning the next launch's input
+// into float LLRs and copying an earlier one's outputs out, so the
+// transfers both ways, the decoding and the host's work all overlap.
+#define GPU_GROUP_SIZE 256   // Work-items per frame, at most
+
+static const char gpu_check_source[] =
+   "#pragma OPENCL FP_CONTRACT OFF\n"
+   "#define SIGN 0x80000000u\n"
+   "#if LOCAL_MESSAGES\n"
+   "#define MESSAGES __local\n"
+   "#else\n"
+   "#define MESSAGES __global\n"
+   "#endif\n"
+   "\n"
+   "// Check c, as check_min_sum_lanes(). The messages in are worked out\n"
+   "// from L, which is what the CPU engines hold in v_to_c[].\n"
+   "static void check_min_sum(__global const int *row_start, __global const int *edge_v,\n"
+   "                          MESSAGES float *c_to_v, MESSAGES float *l, int c, int layered,\n"
+   "                          float offset, float scale) {\n"
+   "   float in[MAX_DEGREE];\n"
+   "   int first = row_start[c];\n"
+   "   int d     = row_start[c+1] - first;\n"
+   "   float min1 = INFINITY, min2 = INFINITY;\n"
+   "   int min_index = 0;\n"
+   "   uint sign = 0;\n"
+   "\n"
+   "   for(int i = 0; i < d; i++) {\n"
+   "      in[i] = l[edge_v[first+i]] - c_to_v[first+i];\n"
+   "      uint bits = as_uint(in[i]);\n"
+   "      float m = as_float(bits & ~SIGN);\n"
+   "      sign ^= bits & SIGN;\n"
+   "      if(m < min1) {\n"
+   "         min2 = min1;\n"
+   "         min1 = m;\n"
+   "         min_index = i;\n"
+   "      } else if(m < min2) {\n"
+   "         min2 = m;\n"
+   "      }\n"
+   "   }\n"
+   "\n"
+   "   min1 = (min1 - offset) * scale;\n"
+   "   min2 = (min2 - offset) * scale;\n"
+   "   if(min1 < 0.0f)\n"
+   "      min1 = 0.0f;\n"
+   "   if(min2 < 0.0f)\n"
+   "      min2 = 0.0f;\n"
+   "\n"
+   "   for(int i = 0; i < d; i++) {\n"
+   "      float m = i == min_index ? min2 : min1;\n"
+   "      float out = as_float(as_uint(m) ^ (sign ^ (as_uint(in[i]) & SIGN)));\n"
+   "      c_to_v[first+i] = out;\n"
+   "      if(layered)\n"
+   "         l[edge_v[first+i]] = in[i] + out;\n"
+   "   }\n"
+   "}\n";
+
+static const char gpu_kernel_source[] =
+   "// One frame per work-group. 'work' is the global memory messages\n"
+   "// when they are not in local memory.\n"
+   "__kernel void decode(__global const int *row_start, __global const int *edge_v,\n"
+   "                     __global const int *col_start, __global const int *col_edge,\n"
+   "                     __global const int *layer_start, int n_layers,\n"
+   "                     int n_v, int n_c, int n_e, int iterations, int layered,\n"
+   "                     float offset, float scale, __global const float *channel,\n"
+   "                     __global uchar *bits, __global float *app, int write_app,\n"
+   "                     __global int *results, __global float *work, __local float *local_work) {\n"
+   "   size_t frame = get_group_id(0);\n"
+   "   int id   = get_local_id(0);\n"
+   "   int size = get_local_size(0);\n"
+   "   __local int unsatisfied;\n"
+   "#if LOCAL_MESSAGES\n"
+   "   __local float *c_to_v = local_work;\n"
+   "#else\n"
+   "   __global float *c_to_v = work + frame * (n_e + n_v);\n"
+   "#endif\n"
+   "   MESSAGES float *l = c_to_v + n_e;\n"
+   "\n"
+   "   channel += frame * n_v;\n"
+   "   for(int e = id; e < n_e; e += size)\n"
+   "      c_to_v[e] = 0.0f;\n"
+   "   for(int v = id; v < n_v; v += size)\n"
+   "      l[v] = channel[v];\n"
+   "   barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);\n"
+   "\n"
+   "   for(int it = 1; it <= iterations; it++) {\n"
+   "      if(layered) {\n"
+   "         for(int j = 0; j < n_layers; j++) {\n"
+   "            for(int c = layer_start[j] + id; c < layer_start[j+1]; c += size)\n"
+   "               check_min_sum(row_start, edge_v, c_to_v, l, c, 1, offset, scale);\n"
+   "            barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);\n"
+   "         }\n"
+   "      } else {\n"
+   "         for(int c = id; c < n_c; c += size)\n"
+   "            check_min_sum(row_start, edge_v, c_to_v, l, c, 0, offset, scale);\n"
+   "         barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);\n"
+   "         for(int v = id; v < n_v; v += size) {\n"
+   "            float sum = channel[v];\n"
+   "            for(int k = col_start[v]; k < col_start[v+1]; k++)\n"
+   "               sum += c_to_v[col_edge[k]];\n"
+   "            l[v] = sum;\n"
+   "         }\n"
+   "         barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);\n"
+   "      }\n"
+   "\n"
+   "      // The syndrome from the hard decisions, l < 0 as the CPU engines\n"
+   "      if(id == 0)\n"
+   "         unsatisfied = 0;\n"
+   "      barrier(CLK_LOCAL_MEM_FENCE);\n"
+   "      for(int c = id; c < n_c; c += size) {\n"
+   "         int p = 0;\n"
+   "         for(int e = row_start[c]; e < row_start[c+1]; e++)\n"
+   "            p ^= l[edge_v[e]] < 0.0f;\n"
+   "         if(p)\n"
+   "            atomic_inc(&unsatisfied);\n"
+   "      }\n"
+   "      barrier(CLK_LOCAL_MEM_FENCE);\n"
+   "\n"
+   "      int u = unsatisfied;\n"
+   "      if(u == 0 || it == iterations) {\n"
+   "         for(int v = id; v < n_v; v += size) {\n"
+   "            bits[frame*n_v + v] = l[v] < 0.0f;\n"
+   "            if(write_app)\n"
+   "               app[frame*n_v + v] = l[v];\n"
+   "         }\n"
+   "         if(id == 0) {\n"
+   "            results[frame*3]   = u == 0;\n"
+   "            results[frame*3+1] = it;\n"
+   "            results[frame*3+2] = u;\n"
+   "         }\n"
+   "         break;\n"
+   "      }\n"
+   "   }\n"
+   "}\n";
+
+// A command queue, its device buffers, and the pinned host buffers
+// its transfers go through
+struct gpu_stream {
+   cl_command_queue queue;
+   cl_mem llr, bits, app, results, work;
+   cl_mem host_llr, host_bits, host_app, host_results;
+   float *llr_in;
+   uint8_t *bits_out;
+   float *app_out;
+   int *results_out;
+   // The launch in flight, if n is not 0
+   long first;
+   int n;
+   int app_read;
+};
+
+struct gpu {
+   cl_context context;
+   cl_device_id device;
+   cl_program program;
+   cl_kernel kernel;
+   cl_mem row_start, edge_v, col_start, col_edge, layer_start;
+   int n_layers;
+   size_t group_size;
+   int local_messages;
+   struct gpu_stream stream[GPU_STREAMS];
+   // For single frames from state_decode()
+   float *one_llr;
+   float *one_app;
+};
+
+
+static int gpu_ok(cl_int err, const char *what) {
+   if(err != CL_SUCCESS)
+      fprintf(stderr, "OpenCL error %d %s\n", (int)err, what);
+   return err == CL_SUCCESS;
+}
+
+
+// A read-only device copy of one of the code's tables
+static cl_mem gpu_table(struct gpu *g, const int *table, int n, int *ok) {
+   cl_int err;
+   cl_mem m = clCreateBuffer(g->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                             sizeof(int) * (n > 0 ? n : 1), (void *)table, &err);
+   if(*ok)
+      *ok = gpu_ok(err, "copying the code");
+   return m;
+}
+
+
+// A pinned host buffer, mapped for the life of the stream
+static void *gpu_pinned(struct gpu *g, struct gpu_stream *st, size_t size, cl_map_flags flags,
+                        cl_mem *m, int *ok) {
+   cl_int err;
+   void *p = NULL;
+   *m = clCreateBuffer(g->context, CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+   if(err == CL_SUCCESS)
+      p = clEnqueueMapBuffer(st->queue, *m, CL_TRUE, flags, 0, size, 0, NULL, NULL, &err);
+   if(*ok)
+      *ok = gpu_ok(err, "allocating host buffers");
+   return p;
+}
+
+
+static cl_mem gpu_buffer(struct gpu *g, cl_mem_flags flags, size_t size, int *ok) {
+   cl_int err;
+   cl_mem m = clCreateBuffer(g->context, flags, size, NULL, &err);
+   if(*ok)
+      *ok = gpu_ok(err, "allocating device buffers");
+   return m;
+}
+
+
+static void gpu_release(cl_mem m) {
+   if(m != NULL)
+      clReleaseMemObject(m);
+}
+
+
+static void gpu_unmap(struct gpu_stream *st, cl_mem m, void *p) {
+   if(m != NULL && p != NULL)
+      clEnqueueUnmapMemObject(st->queue, m, p, 0, NULL, NULL);
+}
+
+
+static void gpu_delete(struct gpu *g) {
+   if(g == NULL)
+      return;
+   for(int i = 0; i < GPU_STREAMS; i++) {
+      struct gpu_stream *st = &g->stream[i];
+      if(st->queue != NULL) {
+         gpu_unmap(st, st->host_llr, st->llr_in);
+         gpu_unmap(st, st->host_bits, st->bits_out);
+         gpu_unmap(st, st->host_app, st->app_out);
+         gpu_unmap(st, st->host_results, st->results_out);
+         clFinish(st->queue);
+      }
+      gpu_release(st->llr);
+      gpu_release(st->bits);
+      gpu_release(st->app);
+      gpu_release(st->results);
+      gpu_release(st->work);
+      gpu_release(st->host_llr);
+      gpu_release(st->host_bits);
+      gpu_release(st->host_app);
+      gpu_release(st->host_results);
+      if(st->queue != NULL)
+         clReleaseCommandQueue(st->queue);
+   }
+   gpu_release(g->row_start);
+   gpu_release(g->edge_v);
+   gpu_release(g->col_start);
+   gpu_release(g->col_edge);
+   gpu_release(g->layer_start);
+   if(g->kernel != NULL)
+      clReleaseKernel(g->kernel);
+   if(g->program != NULL)
+      clReleaseProgram(g->program);
+   if(g->context != NULL)
+      clReleaseContext(g->context);
+   free(g->one_llr);
+   free(g->one_app);
+   free(g);
+}
+
+
+// Split the checks into layers of consecutive checks with no bit in
+// common. Returns the start of each layer, and n_c at the end, or
+// NULL if there is not enough memory.
+static int *gpu_layers(const struct code *code, int *n_layers) {
+   int *layer_start = malloc(sizeof(int) * (code->n_c + 1));
+   int *layer_of    = malloc(sizeof(int) * code->n_v);
+   int n = 0;
+   if(layer_start == NULL || layer_of == NULL) {
+      free(layer_start);
+      free(layer_of);
+      return NULL;
+   }
+
+   for(int v = 0; v < code->n_v; v++) {
+      layer_of[v] = -1;
+   }
+   for(int c = 0; c < code->n_c; c++) {
+      int clash = n == 0;
+      for(int e = code->row_start[c]; !clash && e < code->row_start[c+1]; e++) {
+         clash = layer_of[code->edge_v[e]] == n-1;
+      }
+      if(clash)
+         layer_start[n++] = c;
+      for(int e = code->row_start[c]; e < code->row_start[c+1]; e++) {
+         layer_of[code->edge_v[e]] = n-1;
+      }
+   }
+   layer_start[n] = code->n_c;
+   free(layer_of);
+   *n_layers = n;
+   return layer_start;
+}
+
+
+// Set up the first GPU found (or any OpenCL device if there is no
+// GPU) for decoding a code. Prints what went wrong to stderr and
+// returns NULL if it cannot be done.
+static struct gpu *gpu_new(const struct code *code) {
+   int n_v = code->n_v;
+   int n_e = code->n_edges;
+   cl_platform_id platform;
+   cl_uint n_platforms = 0;
+   cl_int err;
+   int ok = 1;
+
+   struct gpu *g = calloc(1, sizeof(struct gpu));
+   if(g == NULL) {
+      fprintf(stderr, "Unable to allocate the GPU engine\n");
+      return NULL;
+   }
+   g->one_llr = malloc(sizeof(float) * n_v);
+   g->one_app = malloc(sizeof(float) * n_v);
+   if(g->one_llr == NULL || g->one_app == NULL) {
+      fprintf(stderr, "Unable to allocate the GPU engine\n");
+      gpu_delete(g);
+      return NULL;
+   }
+
+   if(clGetPlatformIDs(1, &platform, &n_platforms) != CL_SUCCESS || n_platforms == 0) {
+      fprintf(stderr, "No OpenCL platform found\n");
+      gpu_delete(g);
+      return NULL;
+   }
+   if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &g->device, NULL) != CL_SUCCESS &&
+      clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &g->device, NULL) != CL_SUCCESS) {
+      fprintf(stderr, "No OpenCL device found\n");
+      gpu_delete(g);
+      return NULL;
+   }
+   g->context = clCreateContext(NULL, 1, &g->device, NULL, NULL, &err);
+   ok = gpu_ok(err, "creating the context");
+   for(int i = 0; ok && i < GPU_STREAMS; i++) {
+      g->stream[i].queue = clCreateCommandQueue(g->context, g->device, 0, &err);
+      ok = gpu_ok(err, "creating a command queue");
+   }
+
+   // Messages go in local memory if there is room for them, with a
+   // little to spare for the kernel's own use
+   cl_ulong local_size = 0;
+   if(ok)
+      ok = gpu_ok(clGetDeviceInfo(g->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_size), &local_size, NULL),
+                  "reading the device's local memory size");
+   size_t messages = sizeof(float) * (n_e + n_v);
+   g->local_messages = messages + 256 <= local_size;
+
+   if(ok) {
+      char options[64];
+      const char *source[] = { gpu_check_source, gpu_kernel_source };
+      snprintf(options, sizeof(options), "-DMAX_DEGREE=%d -DLOCAL_MESSAGES=%d",
+               code->max_row_degree > 0 ? code->max_row_degree : 1, g->local_messages);
+      g->program = clCreateProgramWithSource(g->context, 2, source, NULL, &err);
+      ok = gpu_ok(err, "creating the program");
+      if(ok && clBuildProgram(g->program, 1, &g->device, options, NULL, NULL) != CL_SUCCESS) {
+         char log[4096] = "";
+         clGetProgramBuildInfo(g->program, g->device, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+         fprintf(stderr, "Unable to build the GPU kernel:\n%s\n", log);
+         ok = 0;
+      }
+   }
+   if(ok) {
+      g->kernel = clCreateKernel(g->program, "decode", &err);
+      ok = gpu_ok(err, "creating the kernel");
+   }
+   if(ok)
+      ok = gpu_ok(clGetKernelWorkGroupInfo(g->kernel, g->device, CL_KERNEL_WORK_GROUP_SIZE,
+                                           sizeof(g->group_size), &g->group_size, NULL),
+                  "reading the work-group size");
+   if(g->group_size > GPU_GROUP_SIZE)
+      g->group_size = GPU_GROUP_SIZE;
+
+   // The code
+   int *layer_start = ok ? gpu_layers(code, &g->n_layers) : NULL;
+   if(ok && layer_start == NULL) {
+      fprintf(stderr, "Unable to allocate the GPU engine\n");
+      ok = 0;
+   }
+   if(ok) {
+      g->row_start   = gpu_table(g, code->row_start, code->n_c + 1, &ok);
+      g->edge_v      = gpu_table(g, code->edge_v, n_e, &ok);
+      g->col_start   = gpu_table(g, code->col_start, n_v + 1, &ok);
+      g->col_edge    = gpu_table(g, code->col_edge, n_e, &ok);
+      g->layer_start = gpu_table(g, layer_start, g->n_layers + 1, &ok);
+   }
+   free(layer_start);
+
+   // Each queue's buffers
+   size_t frames = GPU_BATCH_FRAMES;
+   for(int i = 0; ok && i < GPU_STREAMS; i++) {
+      struct gpu_stream *st = &g->stream[i];
+      st->llr     = gpu_buffer(g, CL_MEM_READ_ONLY,  sizeof(float) * n_v * frames, &ok);
+      st->bits    = gpu_buffer(g, CL_MEM_WRITE_ONLY, n_v * frames, &ok);
+      st->app     = gpu_buffer(g, CL_MEM_WRITE_ONLY, sizeof(float) * n_v * frames, &ok);
+      st->results = gpu_buffer(g, CL_MEM_WRITE_ONLY, sizeof(int) * 3 * frames, &ok);
+      st->work    = gpu_buffer(g, CL_MEM_READ_WRITE, g->local_messages ? sizeof(float) : messages * frames, &ok);
+      st->llr_in      = gpu_pinned(g, st, sizeof(float) * n_v * frames, CL_MAP_WRITE, &st->host_llr, &ok);
+      st->bits_out    = gpu_pinned(g, st, n_v * frames, CL_MAP_READ, &st->host_bits, &ok);
+      st->app_out     = gpu_pinned(g, st, sizeof(float) * n_v * frames, CL_MAP_READ, &st->host_app, &ok);
+      st->results_out = gpu_pinned(g, st, sizeof(int) * 3 * frames, CL_MAP_READ, &st->host_results, &ok);
+   }
+
+   // The arguments that stay the same
+   if(ok) {
+      cl_int n_c = code->n_c, n_layers = g->n_layers, v = n_v, e = n_e;
+      err  = clSetKernelArg(g->kernel, 0, sizeof(cl_mem), &g->row_start);
+      err |= clSetKernelArg(g->kernel, 1, sizeof(cl_mem), &g->edge_v);
+      err |= clSetKernelArg(g->kernel, 2, sizeof(cl_mem), &g->col_start);
+      err |= clSetKernelArg(g->kernel, 3, sizeof(cl_mem), &g->col_edge);
+      err |= clSetKernelArg(g->kernel, 4, sizeof(cl_mem), &g->layer_start);
+      err |= clSetKernelArg(g->kernel, 5, sizeof(cl_int), &n_layers);
+      err |= clSetKernelArg(g->kernel, 6, sizeof(cl_int), &v);
+      err |= clSetKernelArg(g->kernel, 7, sizeof(cl_int), &n_c);
+      err |= clSetKernelArg(g->kernel, 8, sizeof(cl_int), &e);
+      err |= clSetKernelArg(g->kernel, 19, g->local_messages ? messages : sizeof(float), NULL);
+      ok = gpu_ok(err, "setting the kernel arguments");
+   }
+   if(!ok) {
+      gpu_delete(g);
+      return NULL;
+   }
+   return g;
+}
+
+
+// Start decoding frames first to first+n-1 of io on a queue, which
+// must be idle
+static int gpu_launch(struct state *s, struct gpu_stream *st, const struct frame_io *io, long first, int n) {
+   struct gpu *g = s->gpu;
+   int n_v = s->n_v;
+   float inverse_scale = io->type == LLR_INT8 ? 1.0f / io->scale : 1.0f;
+   cl_int iterations = s->iterations;
+   cl_int layered    = s->config.schedule == SCHEDULE_LAYERED;
+   cl_int write_app  = io->app != NULL || io->extrinsic != NULL;
+   cl_float offset   = s->config.check == CHECK_OFFSET_MIN_SUM ? s->config.offset : 0.0f;
+   cl_float scale    = s->config.check == CHECK_NORMALIZED_MIN_SUM ? s->config.scale : 1.0f;
+   size_t global     = g->group_size * n;
+   cl_int err;
+
+   for(int f = 0; f < n; f++) {
+      for(int v = 0; v < n_v; v++) {
+         st->llr_in[(size_t)f*n_v + v] = frame_llr(io, first + f, v, n_v, inverse_scale);
+      }
+   }
+
+   err  = clSetKernelArg(g->kernel,  9, sizeof(cl_int),   &iterations);
+   err |= clSetKernelArg(g->kernel, 10, sizeof(cl_int),   &layered);
+   err |= clSetKernelArg(g->kernel, 11, sizeof(cl_float), &offset);
+   err |= clSetKernelArg(g->kernel, 12, sizeof(cl_float), &scale);
+   err |= clSetKernelArg(g->kernel, 13, sizeof(cl_mem),   &st->llr);
+   err |= clSetKernelArg(g->kernel, 14, sizeof(cl_mem),   &st->bits);
+   err |= clSetKernelArg(g->kernel, 15, sizeof(cl_mem),   &st->app);
+   err |= clSetKernelArg(g->kernel, 16, sizeof(cl_int),   &write_app);
+   err |= clSetKernelArg(g->kernel, 17, sizeof(cl_mem),   &st->results);
+   err |= clSetKernelArg(g->kernel, 18, sizeof(cl_mem),   &st->work);
+   if(err == CL_SUCCESS)
+      err = clEnqueueWriteBuffer(st->queue, st->llr, CL_FALSE, 0, sizeof(float) * n_v * n,
+                                 st->llr_in, 0, NULL, NULL);
+   if(err == CL_SUCCESS)
+      err = clEnqueueNDRangeKernel(st->queue, g->kernel, 1, NULL, &global, &g->group_size,
+                                   0, NULL, NULL);
+   if(err == CL_SUCCESS)
+      err = clEnqueueReadBuffer(st->queue, st->bits, CL_FALSE, 0, (size_t)n_v * n,
+                                st->bits_out, 0, NULL, NULL);
+   if(err == CL_SUCCESS)
+      err = clEnqueueReadBuffer(st->queue, st->results, CL_FALSE, 0, sizeof(int) * 3 * n,
+                                st->results_out, 0, NULL, NULL);
+   if(err == CL_SUCCESS && write_app)
+      err = clEnqueueReadBuffer(st->queue, st->app, CL_FALSE, 0, sizeof(float) * n_v * n,
+                                st->app_out, 0, NULL, NULL);
+   if(err == CL_SUCCESS)
+      err = clFlush(st->queue);
+   st->first    = first;
+   st->n        = n;
+   st->app_read = write_app;
+   return gpu_ok(err, "starting a decode");
+}
+
+
+// Wait for a queue's launch and copy its outputs into io. If the
+// device failed, the frames are given as not decoded.
+static void gpu_finish(struct state *s, struct gpu_stream *st, const struct frame_io *io, int ok) {
+   int n_v = s->n_v;
+   int words = WORDS(n_v);
+
+   if(st->n == 0)
+      return;
+   if(ok)
+      ok = gpu_ok(clFinish(st->queue), "decoding");
+   for(int f = 0; f < st->n; f++) {
+      size_t frame = st->first + f;
+      const uint8_t *bits = st->bits_out + (size_t)f*n_v;
+      const float *l = st->app_out + (size_t)f*n_v;
+
+      if(!ok) {
+         io->results[frame].valid       = 0;
+         io->results[frame].iterations  = 0;
+         io->results[frame].unsatisfied = s->n_c;
+         continue;
+      }
+      io->results[frame].valid       = st->results_out[f*3];
+      io->results[frame].iterations  = st->results_out[f*3+1];
+      io->results[frame].unsatisfied = st->results_out[f*3+2];
+      if(io->bits != NULL)
+         memcpy(io->bits + frame*n_v, bits, n_v);
+      if(io->packed != NULL) {
+         uint64_t *packed = io->packed + frame*words;
+         for(int w = 0; w < words; w++) {
+            int end = (w+1)*64 < n_v ? (w+1)*64 : n_v;
+            uint64_t x = 0;
+            for(int v = w*64; v < end; v++)
+               x |= (uint64_t)bits[v] << (v%64);
+            packed[w] = x;
+         }
+      }
+      for(int v = 0; io->app != NULL && v < n_v; v++) {
+         io->app[frame*n_v + v] = l[v];
+      }
+      for(int v = 0; io->extrinsic != NULL && v < n_v; v++) {
+         io->extrinsic[frame*n_v + v] = l[v] - st->llr_in[(size_t)f*n_v + v];
+      }
+   }
+   st->n = 0;
+}
+
+
+// Decode frames first to first+n_frames-1 of io, a launch per queue
+// in turn
+static void gpu_decode_io(struct state *s, const struct frame_io *io, long first, int n_frames) {
+   struct gpu *g = s->gpu;
+   int ok[GPU_STREAMS] = {0};
+   int next = 0;
+
+   for(int f = 0; f < n_frames; f += GPU_BATCH_FRAMES) {
+      struct gpu_stream *st = &g->stream[next];
+      int n = n_frames - f < GPU_BATCH_FRAMES ? n_frames - f : GPU_BATCH_FRAMES;
+      gpu_finish(s, st, io, ok[next]);
+      ok[next] = gpu_launch(s, st, io, first + f, n);
+      next = (next + 1) % GPU_STREAMS;
+   }
+   for(int i = 0; i < GPU_STREAMS; i++) {
+      gpu_finish(s, &g->stream[next], io, ok[next]);
+      next = (next + 1) % GPU_STREAMS;
+   }
+}
+
+
+// Decode s->channel_llr on its own on the GPU, leaving the final L
+// and hard decision in the first iteration's buffers as
+// state_decode_float() does
+static int state_decode_gpu(struct state *s) {
+   const struct code *code = s->code;
+   struct gpu *g = s->gpu;
+   struct frame_result result = {0, 0, 0};
+   struct frame_io io = { g->one_llr, LLR_FLOAT32, 1.0f, NULL, NULL, &result, g->one_app, NULL, NULL };
+   struct iteration *current = state_iteration(s, 0);
+
+   for(int v = 0; v < code->n_v; v++) {
+      g->one_llr[v] = s->channel_llr[v];
+   }
+   gpu_decode_io(s, &io, 0, 1);
+   for(int v = 0; v < code->n_v; v++) {
+      current->l[v] = g->one_app[v];
+   }
+   hard_pack(code, current->l, current->hard, 0, code->hard_words);
+   s->iterations_used = result.iterations - 1;
+   return iteration_done(s, current);
+}
+#endif
+
+
+// Decode frames first to first+n_frames-1 of io, which are read and
+// written in place. Returns the number of valid codewords.
+//
+// The float engine, and the min-sum forms with the double engine, are
+// decoded BATCH_LANES frames at a time, and the GPU engine up to
+// GPU_BATCH_FRAMES at a time. Anything else is decoded one frame at
+// a time.
+int state_decode_io(struct state *s, const struct frame_io *io, long first, int n_frames) {
+   int n_v = s->n_v;
+   int n_valid = 0;
+   int words = WORDS(n_v);
+   float inverse_scale = io->type == LLR_INT8 ? 1.0f / io->scale : 1.0f;
+   uint8_t *bits    = io->bits   != NULL ? io->bits   + (size_t)first*n_v   : NULL;
+   uint64_t *packed = io->packed != NULL ? io->packed + (size_t)first*words : NULL;
+   float *app       = io->app    != NULL ? io->app    + (size_t)first*n_v   : NULL;
+   float *extrinsic = io->extrinsic != NULL ? io->extrinsic + (size_t)first*n_v : NULL;
+   struct frame_result *results = io->results + first;
+
+#ifdef LDPC_OPENCL
+   if(s->gpu != NULL) {
+      gpu_decode_io(s, io, first, n_frames);
+      for(int f = 0; f < n_frames; f++) {
+         n_valid += results[f].valid;
+         STATS_FRAME(results[f].valid, results[f].iterations);
+      }
+      return n_valid;
+   }
+#endif
+
+   if(!config_uses_lanes(&s->config) || s->lane_channel == NULL || s->team != NULL) {
+      for(int f = 0; f < n_frames; f++) {
+         for(int v = 0; v < n_v; v++) {
+            s->frame_llr[v] = frame_llr(io, first + f, v, n_v, inverse_scale);
+         }
+         results[f].valid       = state_decode(s, s->frame_llr);
+         results[f].iterations  = s->iterations_used;
+         results[f].unsatisfied = s->last_iteration->unsatisfied;
+         if(bits != NULL)
+            hard_unpack(s->code, s->last_iteration->hard, bits + (size_t)f*n_v);
+         if(packed != NULL)
+            hard_repack(s->code, s->last_iteration->hard, packed + (size_t)f*words);
+         for(int v = 0; app != NULL && v < n_v; v++) {
+            app[(size_t)f*n_v + v] = s->last_iteration->l[v];
+         }
+         for(int v = 0; extrinsic != NULL && v < n_v; v++) {
+            extrinsic[(size_t)f*n_v + v] = s->last_iteration->l[v] - s->frame_llr[v];
+         }
+         n_valid += results[f].valid;
+      }
+      return n_valid;
+   }
+
+   float offset = 0.0f, scale = 1.0f;
+   if(s->config.check == CHECK_OFFSET_MIN_SUM)
+      offset = s->config.offset;
+   if(s->config.check == CHECK_NORMALIZED_MIN_SUM)
+      scale = s->config.scale;
+
+   for(int f = 0; f < n_frames; f += BATCH_LANES) {
+      int n = n_frames - f < BATCH_LANES ? n_frames - f : BATCH_LANES;
+      uint32_t done = 0;
+
+      // Transpose into lanes. Unused lanes are given a strong
+      // all-zero frame and marked as done.
+      for(int v = 0; v < n_v; v++) {
+         for(int lane = 0; lane < BATCH_LANES; lane++) {
+            s->lane_channel[v][lane] = lane < n ? frame_llr(io, first+f+lane, v, n_v, inverse_scale)
+                                                : 1.0f;
+         }
+      }
+      for(int lane = n; lane < BATCH_LANES; lane++) {
+         done |= 1u << lane;
+      }
+
+      // Where this block's outputs go
+      struct frame_io out = { NULL, 0, 0.0f,
+                              bits      != NULL ? bits      + (size_t)f*n_v   : NULL,
+                              packed    != NULL ? packed    + (size_t)f*words : NULL,
+                              results + f,
+                              app       != NULL ? app       + (size_t)f*n_v   : NULL,
+                              extrinsic != NULL ? extrinsic + (size_t)f*n_v   : NULL,
+                              NULL };
+      decode_lanes(s, done, &out, offset, scale);
+      for(int i = 0; i < n; i++) {
+         n_valid += results[f+i].valid;
+         STATS_FRAME(results[f+i].valid, results[f+i].iterations);
+      }
+   }
+   return n_valid;
+}
+
+
+// Decode n_frames frames of n_v float LLRs each, held one after
+// another in llr[]. The hard decisions for each frame are written to
+// bits[] as n_v bytes per frame, and the outcome to results[].
+// Returns the number of valid codewords.
+int state_decode_frames(struct state *s, const float *llr, int n_frames, uint8_t *bits,
+                        struct frame_result *results) {
+   struct frame_io io = { llr, LLR_FLOAT32, 1.0f, bits, NULL, results, NULL, NULL, NULL };
+   return state_decode_io(s, &io, 0, n_frames);
+}
+
+// Decode s->channel_llr on its own with the float engine, in lane 0.
+// On a valid codeword it stops in the same iteration the lanes would
+// have, and the final L and hard decision are left in the first
+// iteration's buffers.
+static int state_decode_float(struct state *s) {
+   const struct code *code = s->code;
+   struct frame_result result = {0, 0, 0};
+   struct frame_io out = { NULL, 0, 0.0f, NULL, NULL, &result, NULL, NULL, NULL };
+   struct iteration *current = state_iteration(s, 0);
+
+   if(s->lane_channel == NULL)
+      return 0;
+   for(int v = 0; v < code->n_v; v++) {
+      s->lane_channel[v]    = (lanes_f){0} + 1.0f;
+      s->lane_channel[v][0] = s->channel_llr[v];
+   }
+   decode_lanes(s, ((1u << BATCH_LANES) - 1) & ~1u, &out,
+                s->config.check == CHECK_OFFSET_MIN_SUM ? s->config.offset : 0.0f,
+                s->config.check == CHECK_NORMALIZED_MIN_SUM ? s->config.scale : 1.0f);
+   for(int v = 0; v < code->n_v; v++) {
+      current->l[v] = s->lane_l[v][0];
+   }
+   hard_pack(code, current->l, current->hard, 0, code->hard_words);
+   s->iterations_used = result.iterations - 1;
+   return iteration_done(s, current);
+}
+
+
+// Delete a state. If the state came from a caller's arena, the
+// space is only given back when the arena is reset.
+void state_delete(struct state *s) {
+   state_stop_team(s);
+#ifdef LDPC_OPENCL
+   gpu_delete(s->gpu);
+#endif
+   if(s->arena == &s->own_arena) {
+      // The arena holds the state itself, so work from a copy
+      struct arena a = s->own_arena;
+      arena_free(&a);
+   }
+}
+
+// Decoder pool
+//
+// A set of worker threads, each with its own decoder state (the
+// scratch memory) sharing one read-only code. pool_decode() splits
+// the frames into tasks of up to config_batch_frames() frames (a
+// block of lanes, or a few GPU launches), deals them out to the
+// workers' deques, and waits for them all to be done. A
+// worker takes tasks from the front of its own deque, and when that
+// runs dry steals from the back of the others. Each task writes its
+// results at its own frame offsets, so the results come back in
+// order.
+//
+// A round only starts once every worker is parked waiting for it, so
+// no worker can still be looking for work from the last round when
+// the deques are filled again.
+#define POOL_MAX_TASKS 1024   // Per worker, per round
+
+struct pool_task {
+   int first;
+   int count;
+};
+
+struct pool_deque {
+   pthread_mutex_t lock;
+   struct pool_task task[POOL_MAX_TASKS];
+   int head;
+   int tail;
+};
+
+struct pool;
+
+struct pool_worker {
+   struct pool *pool;
+   int index;
+   pthread_t thread;
+   struct state *state;
+   struct pool_deque deque;
+};
+
+struct pool {
+   int n_workers;
+   int task_frames;   // Frames per task, config_batch_frames()
+   struct pool_worker *worker;
+
+   pthread_mutex_t lock;
+   pthread_cond_t start;
+   pthread_cond_t finished;   // The round is done, or a worker parked
+   int generation;
+   int idle;                  // Workers waiting on start
+   int quit;
+
+   // The current round
+   const struct frame_io *io;
+   long first;
+   atomic_int remaining;
+   atomic_int n_valid;
+};
+
+
+static int pool_deque_pop(struct pool_deque *d, struct pool_task *task) {
+   int got = 0;
+   pthread_mutex_lock(&d->lock);
+   if(d->head != d->tail) {
+      *task = d->task[d->head++];
+      got = 1;
+   }
+   pthread_mutex_unlock(&d->lock);
+   return got;
+}
+
+
+static int pool_deque_steal(struct pool_deque *d, struct pool_task *task) {
+   int got = 0;
+   pthread_mutex_lock(&d->lock);
+   if(d->head != d->tail) {
+      *task = d->task[--d->tail];
+      got = 1;
+   }
+   pthread_mutex_unlock(&d->lock);
+   return got;
+}
+
+
+static int pool_next_task(struct pool_worker *w, struct pool_task *task) {
+   struct pool *pool = w->pool;
+   if(pool_deque_pop(&w->deque, task))
+      return 1;
+   for(int i = 1; i < pool->n_workers; i++) {
+      if(pool_deque_steal(&pool->worker[(w->index + i) % pool->n_workers].deque, task))
+         return 1;
+   }
+   return 0;
+}
+
+
+static void *pool_worker_main(void *arg) {
+   struct pool_worker *w = arg;
+   struct pool *pool = w->pool;
+   int seen = 0;
+
+   while(1) {
+      pthread_mutex_lock(&pool->lock);
+      pool->idle++;
+      pthread_cond_signal(&pool->finished);
+      while(pool->generation == seen && !pool->quit)
+         pthread_cond_wait(&pool->start, &pool->lock);
+      pool->idle--;
+      seen = pool->generation;
+      int quit = pool->quit;
+      pthread_mutex_unlock(&pool->lock);
+      if(quit)
+         break;
+
+      // All of a round's tasks are queued before it starts, so once
+      // every deque is empty there is nothing more to do
+      struct pool_task task;
+      while(pool_next_task(w, &task)) {
+         int n = state_decode_io(w->state, pool->io, pool->first + task.first, task.count);
+         atomic_fetch_add(&pool->n_valid, n);
+         if(atomic_fetch_sub(&pool->remaining, task.count) == task.count) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->finished);
+            pthread_mutex_unlock(&pool->lock);
+         }
+      }
+   }
+   return NULL;
+}
+
+
+void pool_delete(struct pool *pool) {
+   pthread_mutex_lock(&pool->lock);
+   pool->quit = 1;
+   pthread_cond_broadcast(&pool->start);
+   pthread_mutex_unlock(&pool->lock);
+
+   for(int i = 0; i < pool->n_workers; i++) {
+      struct pool_worker *w = &pool->worker[i];
+      if(w->pool != NULL)
+         pthread_join(w->thread, NULL);
+      if(w->state != NULL)
+         state_delete(w->state);
+      pthread_mutex_destroy(&w->deque.lock);
+   }
+   pthread_mutex_destroy(&pool->lock);
+   pthread_cond_destroy(&pool->start);
+   pthread_cond_destroy(&pool->finished);
+   free(pool->worker);
+   free(pool);
+}
+
+
+// Make a pool of n_workers decoders sharing the code, which must
+// outlive the pool. Returns NULL if it could not be set up.
+struct pool *pool_new(const struct code *code, const struct config *config, int n_i, int n_workers) {
+   struct pool *pool = calloc(1, sizeof(struct pool));
+   if(pool == NULL)
+      return NULL;
+   pool->worker = calloc(n_workers, sizeof(struct pool_worker));
+   if(pool->worker == NULL) {
+      free(pool);
+      return NULL;
+   }
+   pool->n_workers = n_workers;
+   pool->task_frames = config_batch_frames(config);
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->start, NULL);
+   pthread_cond_init(&pool->finished, NULL);
+
+   int ok = 1;
+   for(int i = 0; i < n_workers; i++) {
+      struct pool_worker *w = &pool->worker[i];
+      pthread_mutex_init(&w->deque.lock, NULL);
+      w->index = i;
+      w->state = state_new(code, config, n_i, 0, NULL);
+      if(w->state == NULL) {
+         ok = 0;
+         continue;
+      }
+      w->pool = pool;
+      if(pthread_create(&w->thread, NULL, pool_worker_main, w) != 0) {
+         w->pool = NULL;
+         ok = 0;
+      }
+   }
+   if(!ok) {
+      pool_delete(pool);
+      return NULL;
+   }
+   return pool;
+}
+
+
+int pool_workers(const struct pool *pool) {
+   return pool->n_workers;
+}
+
+
+// Decode frames across the pool, with the same arguments and results
+// as state_decode_io()
+int pool_decode_io(struct pool *pool, const struct frame_io *io, long first, long n_frames) {
+   int task_frames = pool->task_frames;
+   int max_frames = POOL_MAX_TASKS * task_frames * pool->n_workers;
+   int n_valid = 0;
+
+   for(long base = 0; base < n_frames; base += max_frames) {
+      int n = n_frames - base < max_frames ? n_frames - base : max_frames;
+      int n_tasks = (n + task_frames - 1) / task_frames;
+
+      // Wait for every worker to be done with the last round, then
+      // set up this one and give each worker a contiguous run of tasks
+      pthread_mutex_lock(&pool->lock);
+      while(pool->idle != pool->n_workers)
+         pthread_cond_wait(&pool->finished, &pool->lock);
+      pool->io    = io;
+      pool->first = first + base;
+      atomic_store(&pool->remaining, n);
+      atomic_store(&pool->n_valid, 0);
+      for(int i = 0; i < pool->n_workers; i++) {
+         struct pool_deque *d = &pool->worker[i].deque;
+         int first = (long)n_tasks * i / pool->n_workers;
+         int last  = (long)n_tasks * (i+1) / pool->n_workers;
+         pthread_mutex_lock(&d->lock);
+         d->head = 0;
+         d->tail = 0;
+         for(int t = first; t < last; t++) {
+            d->task[d->tail].first = t * task_frames;
+            d->task[d->tail].count = (t+1)*task_frames <= n ? task_frames : n - t*task_frames;
+            d->tail++;
+         }
+         pthread_mutex_unlock(&d->lock);
+      }
+      pool->generation++;
+      pthread_cond_broadcast(&pool->start);
+
+      while(atomic_load(&pool->remaining) != 0)
+         pthread_cond_wait(&pool->finished, &pool->lock);
+      pthread_mutex_unlock(&pool->lock);
+      n_valid += atomic_load(&pool->n_valid);
+   }
+   return n_valid;
+}
+
+
+// As state_decode_frames(), across the pool
+int pool_decode(struct pool *pool, const float *llr, int n_frames, uint8_t *bits,
+                struct frame_result *results) {
+   struct frame_io io = { llr, LLR_FLOAT32, 1.0f, bits, NULL, results, NULL, NULL, NULL };
+   return pool_decode_io(pool, &io, 0, n_frames);
+}
+
+
+// Asynchronous decoding
+//
+// queue_submit() copies a frame into a free slot and adds it to the
+// pending list, and returns straight away. Worker threads, each with
+// its own decoder state, take pending frames in order a batch at a
+// time. A worker starts a batch as soon as there is a full one
+// (config_batch_frames() frames), or when waiting any longer would
+// make the most urgent pending frame miss its deadline, going by how
+// long batches have been taking. So the queue's latency, the default
+// deadline, is the one setting that trades latency for throughput: 0
+// decodes every frame as soon as a worker is free, and a longer one
+// lets batches fill.
+//
+// A finished frame is either handed to its callback on the worker
+// thread, after which its slot is free again, or put on the
+// completion list until it is taken with queue_complete().
+#define QUEUE_SLOTS 4   // Batches of slots per worker
+
+struct queue_job {
+   struct queue_done done;
+   uint8_t *bits;
+   double deadline;
+   queue_callback callback;
+};
+
+struct queue_worker {
+   struct queue *queue;
+   pthread_t thread;
+   struct state *state;
+   int *slot;     // The batch being decoded
+   float *llr;
+   uint8_t *bits;
+   struct frame_result *results;
+};
+
+struct queue {
+   int n_v;
+   int batch;
+   int capacity;
+   double latency;
+   double estimate;       // Seconds per batch, a running average
+   long next_id;
+   int n_workers;
+   struct queue_worker *worker;
+
+   // Each slot is free, pending, being decoded or complete
+   float *llr;            // A frame per slot
+   struct queue_job *job;
+   int *free_slot;
+   int n_free;
+   int *pending;          // In order, a ring from pending_head
+   int pending_head;
+   int n_pending;
+   int *done;             // Also a ring
+   int done_head;
+   int n_done;
+   int in_flight;
+   int flushing;
+   int quit;
+
+   pthread_mutex_t lock;
+   pthread_cond_t work;      // Frames were added, or the queue is flushing
+   pthread_cond_t space;     // A slot was freed
+   pthread_cond_t finished;  // A batch was finished
+};
+
+
+static double queue_now(void) {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+// With the lock held, wait for the next batch. Returns the number of
+// frames taken, or 0 when the queue is shutting down.
+static int queue_take(struct queue *q, struct queue_worker *w) {
+   while(1) {
+      if(q->n_pending == 0) {
+         if(q->quit)
+            return 0;
+         pthread_cond_wait(&q->work, &q->lock);
+         continue;
+      }
+      if(q->n_pending < q->batch && !q->flushing && !q->quit) {
+         double start_by = HUGE_VAL;
+         for(int i = 0; i < q->n_pending; i++) {
+            double d = q->job[q->pending[(q->pending_head + i) % q->capacity]].deadline;
+            if(d < start_by)
+               start_by = d;
+         }
+         start_by -= q->estimate;
+         if(queue_now() < start_by) {
+            struct timespec until;
+            until.tv_sec  = (time_t)start_by;
+            until.tv_nsec = (long)((start_by - until.tv_sec) * 1e9);
+            pthread_cond_timedwait(&q->work, &q->lock, &until);
+            continue;
+         }
+      }
+      break;
+   }
+
+   int n = q->n_pending < q->batch ? q->n_pending : q->batch;
+   for(int i = 0; i < n; i++) {
+      w->slot[i] = q->pending[q->pending_head];
+      q->pending_head = (q->pending_head + 1) % q->capacity;
+   }
+   q->n_pending -= n;
+   q->in_flight += n;
+   return n;
+}
+
+
+static void *queue_worker_main(void *arg) {
+   struct queue_worker *w = arg;
+   struct queue *q = w->queue;
+   int n_v = q->n_v;
+
+   pthread_mutex_lock(&q->lock);
+   while(1) {
+      int n = queue_take(q, w);
+      if(n == 0)
+         break;
+      pthread_mutex_unlock(&q->lock);
+
+      for(int i = 0; i < n; i++) {
+         memcpy(w->llr + (size_t)i*n_v, q->llr + (size_t)w->slot[i]*n_v, sizeof(float) * n_v);
+      }
+      double start = queue_now();
+      state_decode_frames(w->state, w->llr, n, w->bits, w->results);
+      double end = queue_now();
+      for(int i = 0; i < n; i++) {
+         struct queue_job *job = &q->job[w->slot[i]];
+         if(job->bits != NULL)
+            memcpy(job->bits, w->bits + (size_t)i*n_v, n_v);
+         job->done.result = w->results[i];
+         job->done.late   = end > job->deadline;
+         if(job->callback != NULL)
+            job->callback(&job->done);
+      }
+
+      pthread_mutex_lock(&q->lock);
+      q->estimate = q->estimate == 0 ? end - start : q->estimate * 0.875 + (end - start) * 0.125;
+      for(int i = 0; i < n; i++) {
+         if(q->job[w->slot[i]].callback != NULL) {
+            q->free_slot[q->n_free++] = w->slot[i];
+         } else {
+            q->done[(q->done_head + q->n_done) % q->capacity] = w->slot[i];
+            q->n_done++;
+         }
+      }
+      q->in_flight -= n;
+      pthread_cond_broadcast(&q->space);
+      pthread_cond_broadcast(&q->finished);
+   }
+   pthread_mutex_unlock(&q->lock);
+   return NULL;
+}
+
+
+// Wait for every frame submitted so far to be decoded, without
+// waiting for batches to fill. Frames for the completion list are
+// then on it.
+void queue_flush(struct queue *q) {
+   pthread_mutex_lock(&q->lock);
+   q->flushing++;
+   pthread_cond_broadcast(&q->work);
+   while(q->n_pending != 0 || q->in_flight != 0)
+      pthread_cond_wait(&q->finished, &q->lock);
+   q->flushing--;
+   pthread_mutex_unlock(&q->lock);
+}
+
+
+// Decode everything still pending, and stop the workers
+void queue_delete(struct queue *q) {
+   pthread_mutex_lock(&q->lock);
+   q->quit = 1;
+   pthread_cond_broadcast(&q->work);
+   pthread_mutex_unlock(&q->lock);
+
+   for(int i = 0; i < q->n_workers; i++) {
+      struct queue_worker *w = &q->worker[i];
+      if(w->queue != NULL)
+         pthread_join(w->thread, NULL);
+      if(w->state != NULL)
+         state_delete(w->state);
+      free(w->slot);
+      free(w->llr);
+      free(w->bits);
+      free(w->results);
+   }
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->work);
+   pthread_cond_destroy(&q->space);
+   pthread_cond_destroy(&q->finished);
+   free(q->worker);
+   free(q->llr);
+   free(q->job);
+   free(q->free_slot);
+   free(q->pending);
+   free(q->done);
+   free(q);
+}
+
+
+// Make a queue of n_workers decoders for a code, which must outlive
+// it. 'latency' is the deadline given to frames that are submitted
+// without one, in seconds. Returns NULL if it could not be set up.
+struct queue *queue_new(const struct code *code, const struct config *config, int n_i, int n_workers,
+                        double latency) {
+   int n_v = code->n_v;
+   pthread_condattr_t attr;
+
+   struct queue *q = calloc(1, sizeof(struct queue));
+   if(q == NULL)
+      return NULL;
+   q->n_v       = n_v;
+   q->batch     = config_batch_frames(config);
+   q->capacity  = q->batch * QUEUE_SLOTS * n_workers;
+   q->latency   = latency;
+   q->n_workers = n_workers;
+   q->worker    = calloc(n_workers, sizeof(struct queue_worker));
+   q->llr       = malloc(sizeof(float) * n_v * q->capacity);
+   q->job       = calloc(q->capacity, sizeof(struct queue_job));
+   q->free_slot = malloc(sizeof(int) * q->capacity);
+   q->pending   = malloc(sizeof(int) * q->capacity);
+   q->done      = malloc(sizeof(int) * q->capacity);
+   if(q->worker == NULL || q->llr == NULL || q->job == NULL || q->free_slot == NULL ||
+      q->pending == NULL || q->done == NULL) {
+      free(q->worker);
+      free(q->llr);
+      free(q->job);
+      free(q->free_slot);
+      free(q->pending);
+      free(q->done);
+      free(q);
+      return NULL;
+   }
+   for(int i = 0; i < q->capacity; i++) {
+      q->free_slot[i] = q->capacity - 1 - i;
+   }
+   q->n_free = q->capacity;
+
+   // Deadlines are on the monotonic clock
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_condattr_init(&attr);
+   pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&q->work, &attr);
+   pthread_condattr_destroy(&attr);
+   pthread_cond_init(&q->space, NULL);
+   pthread_cond_init(&q->finished, NULL);
+
+   int ok = 1;
+   for(int i = 0; i < n_workers; i++) {
+      struct queue_worker *w = &q->worker[i];
+      w->state   = state_new(code, config, n_i, 0, NULL);
+      w->slot    = malloc(sizeof(int) * q->batch);
+      w->llr     = malloc(sizeof(float) * n_v * q->batch);
+      w->bits    = malloc(n_v * q->batch);
+      w->results = malloc(sizeof(struct frame_result) * q->batch);
+      if(w->state == NULL || w->slot == NULL || w->llr == NULL || w->bits == NULL || w->results == NULL) {
+         ok = 0;
+         continue;
+      }
+      w->queue = q;
+      if(pthread_create(&w->thread, NULL, queue_worker_main, w) != 0) {
+         w->queue = NULL;
+         ok = 0;
+      }
+   }
+   if(!ok) {
+      queue_delete(q);
+      return NULL;
+   }
+   return q;
+}
+
+
+// Submit a frame of n_v float LLRs, which are copied, to be decoded
+// within 'deadline' seconds (or the queue's latency if deadline is
+// not more than 0). The hard decision is written to bits[] unless it
+// is NULL. When the frame is done it is passed to callback, on a
+// worker thread and with arg in the queue_done, or if callback is
+// NULL it goes on the completion list.
+//
+// Waits for a free slot if need be. Returns the frame's id, counting
+// up from 0, or -1 if every slot is taken up by completions that have
+// not been collected.
+long queue_submit(struct queue *q, const float *llr, uint8_t *bits, double deadline,
+                  queue_callback callback, void *arg) {
+   double now = queue_now();
+
+   pthread_mutex_lock(&q->lock);
+   while(q->n_free == 0 && q->n_done == 0)
+      pthread_cond_wait(&q->space, &q->lock);
+   if(q->n_free == 0) {
+      pthread_mutex_unlock(&q->lock);
+      return -1;
+   }
+   int slot = q->free_slot[--q->n_free];
+   struct queue_job *job = &q->job[slot];
+   long id = q->next_id++;
+   job->done.id  = id;
+   job->done.arg = arg;
+   job->bits     = bits;
+   job->deadline = now + (deadline > 0 ? deadline : q->latency);
+   job->callback = callback;
+   memcpy(q->llr + (size_t)slot*q->n_v, llr, sizeof(float) * q->n_v);
+   q->pending[(q->pending_head + q->n_pending) % q->capacity] = slot;
+   q->n_pending++;
+   pthread_cond_signal(&q->work);
+   pthread_mutex_unlock(&q->lock);
+   return id;
+}
+
+
+// Take the next frame off the completion list, in the order they were
+// finished. With 'wait' set, waits for one if any frames are still
+// being decoded. Returns 0 if there was none.
+int queue_complete(struct queue *q, struct queue_done *done, int wait) {
+   pthread_mutex_lock(&q->lock);
+   while(q->n_done == 0 && wait && (q->n_pending != 0 || q->in_flight != 0))
+      pthread_cond_wait(&q->finished, &q->lock);
+   int got = q->n_done != 0;
+   if(got) {
+      int slot = q->done[q->done_head];
+      q->done_head = (q->done_head + 1) % q->capacity;
+      q->n_done--;
+      *done = q->job[slot].done;
+      q->free_slot[q->n_free++] = slot;
+      pthread_cond_signal(&q->space);
+   }
+   pthread_mutex_unlock(&q->lock);
+   return got;
+}
+
+
+// Encoding
+//
+// Codewords are packed 64 bits to a word, with bit v of the codeword
+// in bit v%64 of word v/64. The encoder is built once per code and is
+// read-only afterwards, so it can be shared between threads.
+//
+// For QC codes the encoder works on whole Z bit blocks, following
+// Richardson and Urbanke: the parity block columns are split into p2,
+// found by back substitution through a block lower triangular T, and
+// a small gap p1 that is solved for first with the dense inverse of
+// phi = E T^-1 B + D. For the common dual-diagonal parity structure
+// the gap is a single block, and encoding is linear in the number of
+// edges. Any other code, or a QC code that will not triangulate, is
+// brought to systematic form once by Gaussian elimination and each
+// parity bit is a masked parity of the data bits.
+
+struct encoder {
+   const struct code *code;
+   int k;           // Data bits per codeword
+   int *info_pos;   // Codeword position of each data bit
+
+   // Gaussian elimination: row i of h gives parity bit pivot[i] from
+   // the data bits of the codeword
+   int rank;
+   int row_words;
+   int *pivot;
+   uint64_t *h;
+
+   // QC: block columns in p1 and in p2, with the block row that
+   // solves each p2 column and the gap rows left for phi. Data blocks
+   // are the first base_cols - base_rows block columns.
+   int block_words;
+   int gap;
+   int n_p2;
+   int *p1_col;
+   int *p2_col;
+   int *p2_row;
+   int *gap_row;
+   uint64_t *phi_inverse;   // gap*z rows of WORDS(gap*z) words
+   uint64_t *scratch;       // Blocks of working space, per thread
+
+   // Set if the tables are in a mapped code file, see encoder_map()
+   int mapped;
+};
+
+
+void encoder_delete(struct encoder *e) {
+   if(e == NULL)
+      return;
+   if(e->mapped) {
+      free(e);
+      return;
+   }
+   free(e->info_pos);
+   free(e->pivot);
+   free(e->h);
+   free(e->p1_col);
+   free(e->p2_col);
+   free(e->p2_row);
+   free(e->gap_row);
+   free(e->phi_inverse);
+   free(e->scratch);
+   free(e);
+}
+
+
+// Reduce the rows of mat (n_rows of row_words words, n_cols bits) in
+// place. Pivots are searched from the last column down, so the
+// parity bits end up at the end of the codeword where possible.
+// Returns the rank, with pivot[i] the pivot column of row i.
+static int gauss_jordan(uint64_t *mat, int n_rows, int n_cols, int row_words, int *pivot) {
+   int rank = 0;
+   for(int col = n_cols - 1; col >= 0 && rank < n_rows; col--) {
+      int r = rank;
+      while(r < n_rows && !bit_get(mat + (size_t)r*row_words, col))
+         r++;
+      if(r == n_rows)
+         continue;
+      if(r != rank) {
+         for(int w = 0; w < row_words; w++) {
+            uint64_t t = mat[(size_t)r*row_words + w];
+            mat[(size_t)r*row_words + w]    = mat[(size_t)rank*row_words + w];
+            mat[(size_t)rank*row_words + w] = t;
+         }
+      }
+      for(int i = 0; i < n_rows; i++) {
+         uint64_t *row = mat + (size_t)i*row_words;
+         if(i != rank && bit_get(row, col)) {
+            const uint64_t *p = mat + (size_t)rank*row_words;
+            for(int w = 0; w < row_words; w++)
+               row[w] ^= p[w];
+         }
+      }
+      pivot[rank++] = col;
+   }
+   return rank;
+}
+
+
+static int encoder_init_dense(struct encoder *e) {
+   const struct code *code = e->code;
+   int n_v = code->n_v;
+   uint8_t *is_pivot;
+
+   e->row_words = WORDS(n_v);
+   e->h     = calloc((size_t)code->n_c * e->row_words, sizeof(uint64_t));
+   e->pivot = malloc(sizeof(int) * code->n_c);
+   is_pivot = calloc(n_v, 1);
+   if(e->h == NULL || e->pivot == NULL || is_pivot == NULL) {
+      free(is_pivot);
+      return 0;
+   }
+   for(int c = 0; c < code->n_c; c++) {
+      for(int i = code->row_start[c]; i < code->row_start[c+1]; i++)
+         bit_flip(e->h + (size_t)c*e->row_words, code->edge_v[i]);
+   }
+   e->rank = gauss_jordan(e->h, code->n_c, n_v, e->row_words, e->pivot);
+
+   // Data goes in the columns without a pivot, and each reduced row
+   // only keeps its data columns
+   for(int i = 0; i < e->rank; i++) {
+      is_pivot[e->pivot[i]] = 1;
+      bit_flip(e->h + (size_t)i*e->row_words, e->pivot[i]);
+   }
+   e->k = n_v - e->rank;
+   e->info_pos = malloc(sizeof(int) * (e->k > 0 ? e->k : 1));
+   if(e->info_pos != NULL) {
+      for(int v = 0, i = 0; v < n_v; v++) {
+         if(!is_pivot[v])
+            e->info_pos[i++] = v;
+      }
+   }
+   free(is_pivot);
+   return e->info_pos != NULL;
+}
+
+
+// Run the block back substitution on a packed codeword x (base_cols
+// blocks of block_words words), whose data and p1 blocks are already
+// filled in. Solves the p2 blocks, and leaves in syndrome the checks
+// of the gap rows, one block per row.
+static void encoder_substitute(const struct encoder *e, uint64_t *x, uint64_t *syndrome) {
+   const struct code *code = e->code;
+   int z = code->z, bw = e->block_words;
+   uint64_t *acc = e->scratch;
+
+   for(int t = 0; t < e->n_p2; t++) {
+      const int *row = code->base + e->p2_row[t]*code->base_cols;
+      int col = e->p2_col[t];
+      memset(acc, 0, sizeof(uint64_t) * bw);
+      for(int j = 0; j < code->base_cols; j++) {
+         if(j != col && row[j] >= 0)
+            block_rotate_xor(acc, x + j*bw, z, row[j]);
+      }
+      memset(x + col*bw, 0, sizeof(uint64_t) * bw);
+      block_rotate_xor(x + col*bw, acc, z, (z - row[col]) % z);
+   }
+   for(int g = 0; g < e->gap; g++) {
+      const int *row = code->base + e->gap_row[g]*code->base_cols;
+      memset(syndrome + g*bw, 0, sizeof(uint64_t) * bw);
+      for(int j = 0; j < code->base_cols; j++) {
+         if(row[j] >= 0)
+            block_rotate_xor(syndrome + g*bw, x + j*bw, z, row[j]);
+      }
+   }
+}
+
+
+static int encoder_init_qc(struct encoder *e) {
+   const struct code *code = e->code;
+   int m = code->base_rows, nb = code->base_cols, z = code->z;
+   int k_blocks = nb - m;
+   int *weight = calloc(nb, sizeof(int));
+   uint8_t *known = calloc(nb, 1), *row_used = calloc(m, 1);
+   int n_p1 = 0, ok = 0;
+
+   e->p1_col  = malloc(sizeof(int) * m);
+   e->p2_col  = malloc(sizeof(int) * m);
+   e->p2_row  = malloc(sizeof(int) * m);
+   e->gap_row = malloc(sizeof(int) * m);
+   if(k_blocks <= 0 || weight == NULL || known == NULL || row_used == NULL ||
+      e->p1_col == NULL || e->p2_col == NULL || e->p2_row == NULL || e->gap_row == NULL)
+      goto done;
+
+   for(int i = 0; i < m; i++) {
+      for(int j = 0; j < nb; j++)
+         weight[j] += code->base[i*nb + j] >= 0;
+   }
+   for(int j = 0; j < k_blocks; j++)
+      known[j] = 1;
+
+   // Greedy triangulation: take any row left with one unknown parity
+   // block. When there is none, move all but the lightest unknown
+   // column of the row with fewest unknowns into the gap.
+   e->n_p2 = 0;
+   while(e->n_p2 + n_p1 < m) {
+      int best = -1, best_unknown = nb + 1;
+      for(int i = 0; i < m && best_unknown > 1; i++) {
+         int unknown = 0;
+         if(row_used[i])
+            continue;
+         for(int j = k_blocks; j < nb; j++)
+            unknown += code->base[i*nb + j] >= 0 && !known[j];
+         if(unknown > 0 && unknown < best_unknown) {
+            best = i;
+            best_unknown = unknown;
+         }
+      }
+      if(best < 0)
+         goto done;   // Parity columns that no row can reach
+      if(best_unknown > 1) {
+         int lightest = -1;
+         for(int j = k_blocks; j < nb; j++) {
+            if(code->base[best*nb + j] >= 0 && !known[j] && (lightest < 0 || weight[j] < weight[lightest]))
+               lightest = j;
+         }
+         for(int j = k_blocks; j < nb; j++) {
+            if(code->base[best*nb + j] >= 0 && !known[j] && j != lightest) {
+               e->p1_col[n_p1++] = j;
+               known[j] = 1;
+            }
+         }
+      }
+      for(int j = k_blocks; j < nb; j++) {
+         if(code->base[best*nb + j] >= 0 && !known[j]) {
+            e->p2_col[e->n_p2] = j;
+            e->p2_row[e->n_p2++] = best;
+            known[j] = 1;
+            row_used[best] = 1;
+         }
+      }
+   }
+   e->gap = 0;
+   for(int i = 0; i < m; i++) {
+      if(!row_used[i])
+         e->gap_row[e->gap++] = i;
+   }
+   if(e->gap != n_p1)
+      goto done;
+
+   // Build phi one p1 bit at a time from the gap syndrome with no
+   // data, then invert it. If it is singular, fall back to Gaussian
+   // elimination.
+   int bw = e->block_words = WORDS(z);
+   int n = e->gap * z, nw = WORDS(2*n);
+   uint64_t *x = calloc((size_t)nb * bw, sizeof(uint64_t));
+   uint64_t *syndrome = calloc((size_t)(e->gap > 0 ? e->gap : 1) * bw, sizeof(uint64_t));
+   uint64_t *aug = calloc((size_t)(n > 0 ? n : 1) * nw, sizeof(uint64_t));
+   int *pivot = malloc(sizeof(int) * (n > 0 ? n : 1));
+   e->scratch     = malloc(sizeof(uint64_t) * bw);
+   e->phi_inverse = calloc((size_t)(n > 0 ? n : 1) * WORDS(n), sizeof(uint64_t));
+   ok = x != NULL && syndrome != NULL && aug != NULL && pivot != NULL &&
+        e->scratch != NULL && e->phi_inverse != NULL;
+   for(int b = 0; ok && b < n; b++) {
+      memset(x, 0, sizeof(uint64_t) * nb * bw);
+      bit_flip(x + e->p1_col[b / z]*bw, b % z);
+      encoder_substitute(e, x, syndrome);
+      for(int r = 0; r < n; r++) {
+         if(bit_get(syndrome + (r / z)*bw, r % z))
+            bit_flip(aug + (size_t)r*nw, n + b);   // phi in the high half
+      }
+   }
+   if(ok) {
+      // [phi | I] reduces to [I | phi^-1] with the pivots taken from
+      // the top down
+      for(int r = 0; r < n; r++)
+         bit_flip(aug + (size_t)r*nw, n - 1 - r);
+      ok = gauss_jordan(aug, n, 2*n, nw, pivot) == n && (n == 0 || pivot[n-1] >= n);
+      for(int r = 0; ok && r < n; r++) {
+         // Row with its pivot on phi column c gives bit c of p1
+         const uint64_t *row = aug + (size_t)r*nw;
+         int c = pivot[r] - n;
+         for(int i = 0; i < n; i++) {
+            if(bit_get(row, n - 1 - i))
+               bit_flip(e->phi_inverse + (size_t)c*WORDS(n), i);
+         }
+      }
+   }
+   free(x);
+   free(syndrome);
+   free(aug);
+   free(pivot);
+   if(ok) {
+      e->k = k_blocks * z;
+      e->info_pos = malloc(sizeof(int) * e->k);
+      ok = e->info_pos != NULL;
+      for(int i = 0; ok && i < e->k; i++)
+         e->info_pos[i] = i;
+   }
+
+done:
+   free(weight);
+   free(known);
+   free(row_used);
+   return ok;
+}
+
+
+// Build an encoder for the code, which must outlive it. Returns NULL
+// if it could not be set up.
+static struct encoder *encoder_map(const struct code *code);
+
+struct encoder *encoder_new(const struct code *code) {
+   struct encoder *e;
+   if(code->map != NULL && (e = encoder_map(code)) != NULL)
+      return e;
+   if((e = calloc(1, sizeof(struct encoder))) == NULL)
+      return NULL;
+   e->code = code;
+   if(code->base != NULL && encoder_init_qc(e))
+      return e;
+
+   // Start again without the QC tables
+   encoder_delete(e);
+   if((e = calloc(1, sizeof(struct encoder))) == NULL)
+      return NULL;
+   e->code = code;
+   if(!encoder_init_dense(e)) {
+      encoder_delete(e);
+      return NULL;
+   }
+   return e;
+}
+
+
+// Data bits per codeword
+int encoder_k(const struct encoder *e) {
+   return e->k;
+}
+
+
+// The codeword position of each data bit
+const int *encoder_info_pos(const struct encoder *e) {
+   return e->info_pos;
+}
+
+
+// Encode the k packed data bits into the packed n_v bit codeword.
+// The data bits appear unchanged at info_pos[] in the codeword.
+// scratch must hold encoder_scratch_words() words, so that threads
+// can share one encoder.
+int encoder_scratch_words(const struct encoder *e) {
+   const struct code *code = e->code;
+   if(e->h != NULL)
+      return 0;
+   return (code->base_cols + e->gap + 1) * e->block_words + WORDS(e->gap * code->z);
+}
+
+
+void encoder_encode(const struct encoder *e, const uint64_t *data, uint64_t *codeword, uint64_t *scratch) {
+   const struct code *code = e->code;
+   int n_v = code->n_v;
+
+   memset(codeword, 0, sizeof(uint64_t) * WORDS(n_v));
+   if(e->h != NULL) {
+      for(int i = 0; i < e->k; i++) {
+         if(bit_get(data, i))
+            bit_flip(codeword, e->info_pos[i]);
+      }
+      for(int i = 0; i < e->rank; i++) {
+         const uint64_t *row = e->h + (size_t)i*e->row_words;
+         uint64_t sum = 0;
+         for(int w = 0; w < e->row_words; w++)
+            sum ^= row[w] & codeword[w];
+         if(__builtin_parityll(sum))
+            bit_flip(codeword, e->pivot[i]);
+      }
+      return;
+   }
+
+   // The blocks are padded to whole words in the working copy
+   int z = code->z, bw = e->block_words, n = e->gap * z;
+   uint64_t *x = scratch;
+   uint64_t *syndrome = x + code->base_cols * bw;
+   uint64_t *p1 = syndrome + e->gap * bw;
+   struct encoder local = *e;
+
+   local.scratch = p1 + WORDS(n);
+   memset(x, 0, sizeof(uint64_t) * code->base_cols * bw);
+   for(int i = 0; i < e->k; i++) {
+      if(bit_get(data, i))
+         bit_flip(x + (i / z)*bw, i % z);
+   }
+
+   // p1 = phi^-1 times the gap syndrome of the data alone, then the
+   // rest of the parity by back substitution
+   encoder_substitute(&local, x, syndrome);
+   memset(p1, 0, sizeof(uint64_t) * WORDS(n));
+   for(int r = 0; r < n; r++) {
+      if(bit_get(syndrome + (r / z)*bw, r % z))
+         bit_flip(p1, r);
+   }
+   for(int c = 0; c < n; c++) {
+      const uint64_t *row = e->phi_inverse + (size_t)c*WORDS(n);
+      uint64_t sum = 0;
+      for(int w = 0; w < WORDS(n); w++)
+         sum ^= row[w] & p1[w];
+      if(__builtin_parityll(sum))
+         bit_flip(x + e->p1_col[c / z]*bw, c % z);
+   }
+   encoder_substitute(&local, x, syndrome);
+
+   for(int j = 0; j < code->base_cols; j++) {
+      for(int l = 0; l < z; l++) {
+         if(bit_get(x + j*bw, l))
+            bit_flip(codeword, j*z + l);
+      }
+   }
+}
+
+
+// HARQ soft buffers
+//
+// Each HARQ process has a buffer of n_v LLRs that every transmission
+// of its block is added into (zeros for bits a transmission did not
+// carry), and it is the sum that is decoded, so each retransmission
+// starts from a better frame than the last. Buffers are kept as int8
+// at 'scale' steps per 1.0 of LLR and saturate at +/-127 steps, a
+// quarter of the memory of floats, and can be decoded in place as
+// LLR_INT8 frames.
+struct harq {
+   int n_v;
+   int n_processes;
+   float scale;
+   int8_t *buffer;
+   int *transmissions;
+};
+
+
+struct harq *harq_new(int n_v, int n_processes, float scale) {
+   struct harq *h = calloc(1, sizeof(struct harq));
+   if(h == NULL)
+      return NULL;
+   h->n_v           = n_v;
+   h->n_processes   = n_processes;
+   h->scale         = scale > 0 ? scale : HARQ_DEFAULT_SCALE;
+   h->buffer        = calloc((size_t)n_v * n_processes, 1);
+   h->transmissions = calloc(n_processes, sizeof(int));
+   if(h->buffer == NULL || h->transmissions == NULL) {
+      harq_delete(h);
+      return NULL;
+   }
+   return h;
+}
+
+
+void harq_delete(struct harq *h) {
+   if(h == NULL)
+      return;
+   free(h->buffer);
+   free(h->transmissions);
+   free(h);
+}
+
+
+// Start a process's buffer again, for a new block
+void harq_clear(struct harq *h, int process) {
+   memset(h->buffer + (size_t)process*h->n_v, 0, h->n_v);
+   h->transmissions[process] = 0;
+}
+
+
+// Add a transmission's n_v LLRs into a process's buffer. If combined
+// is not NULL the LLRs now in the buffer are written there as floats.
+// Returns the number of transmissions combined so far.
+int harq_combine(struct harq *h, int process, const float *llr, float *combined) {
+   int8_t *buffer = h->buffer + (size_t)process*h->n_v;
+   float inverse_scale = 1.0f / h->scale;
+
+   for(int i = 0; i < h->n_v; i++) {
+      // A NaN LLR carries nothing, and must not reach lrintf()
+      float q = buffer[i] + (isnan(llr[i]) ? 0.0f : llr[i] * h->scale);
+      q = q > 127.0f ? 127.0f : q < -127.0f ? -127.0f : q;
+      buffer[i] = (int8_t)lrintf(q);
+      if(combined != NULL)
+         combined[i] = buffer[i] * inverse_scale;
+   }
+   return ++h->transmissions[process];
+}
+
+
+// Point io at the buffers from 'process' on, to decode them in place.
+// Frame f of io is then process + f.
+void harq_frame(const struct harq *h, int process, struct frame_io *io) {
+   io->llr   = h->buffer + (size_t)process*h->n_v;
+   io->type  = LLR_INT8;
+   io->scale = h->scale;
+}
+
+
+// Code files
+//
+// Everything built from a code when it is loaded (the row and column
+// views, the base matrix and circulants) and by encoder_new() is kept
+// in one file, which later loads map rather than rebuild. The file
+// is a struct code_file followed by each table at a 64 byte aligned
+// offset, in the host's byte order. It is only read for the key it
+// was written for, which covers the source file's name, size, inode
+// and modification time and the lifting size, so a changed source
+// file gets a new code file and stale ones are never used.
+#define CODE_FILE_MAGIC "LDPCCOD1"
+
+enum code_section {
+   SECTION_ROW_START,
+   SECTION_EDGE_V,
+   SECTION_COL_START,
+   SECTION_COL_EDGE,
+   SECTION_BASE,
+   SECTION_CIRC_START,
+   SECTION_CIRC,
+   SECTION_INFO_POS,
+   SECTION_PIVOT,
+   SECTION_H,
+   SECTION_P1_COL,
+   SECTION_P2_COL,
+   SECTION_P2_ROW,
+   SECTION_GAP_ROW,
+   SECTION_PHI_INVERSE,
+   SECTION_COUNT
+};
+
+struct code_file {
+   char magic[8];
+   uint64_t key;
+   uint64_t size;
+   int32_t n_v, n_c, n_edges, max_row_degree;
+   int32_t z, base_rows, base_cols;
+   int32_t block_words, hard_words, syndrome_words;
+   // The encoder: 0 for none, 1 for Gaussian elimination, 2 for QC
+   int32_t encoder;
+   int32_t k, rank, row_words, encoder_block_words, gap, n_p2;
+   uint64_t offset[SECTION_COUNT];
+   uint64_t bytes[SECTION_COUNT];
+};
+
+
+// Where each table of the code and encoder goes, and how big it is
+// from the sizes in the code and encoder
+static void code_file_sections(struct code *code, struct encoder *e, void **table[SECTION_COUNT],
+                               size_t bytes[SECTION_COUNT]) {
+   int qc = code->base != NULL;
+   int n_blocks = qc ? code->n_edges / code->z : 0;
+
+   memset(table, 0, sizeof(void **) * SECTION_COUNT);
+   memset(bytes, 0, sizeof(size_t) * SECTION_COUNT);
+   table[SECTION_ROW_START]  = (void **)&code->row_start;
+   bytes[SECTION_ROW_START]  = sizeof(int) * (code->n_c + 1);
+   table[SECTION_EDGE_V]     = (void **)&code->edge_v;
+   bytes[SECTION_EDGE_V]     = sizeof(int) * code->n_edges;
+   table[SECTION_COL_START]  = (void **)&code->col_start;
+   bytes[SECTION_COL_START]  = sizeof(int) * (code->n_v + 1);
+   table[SECTION_COL_EDGE]   = (void **)&code->col_edge;
+   bytes[SECTION_COL_EDGE]   = sizeof(int) * code->n_edges;
+   table[SECTION_BASE]       = (void **)&code->base;
+   bytes[SECTION_BASE]       = qc ? sizeof(int) * code->base_rows * code->base_cols : 0;
+   table[SECTION_CIRC_START] = (void **)&code->circ_start;
+   bytes[SECTION_CIRC_START] = qc ? sizeof(int) * (code->base_cols + 1) : 0;
+   table[SECTION_CIRC]       = (void **)&code->circ;
+   bytes[SECTION_CIRC]       = sizeof(struct circulant) * n_blocks;
+   if(e == NULL)
+      return;
+
+   int n = e->gap * code->z;
+   table[SECTION_INFO_POS] = (void **)&e->info_pos;
+   table[SECTION_PIVOT]    = (void **)&e->pivot;
+   table[SECTION_H]        = (void **)&e->h;
+   table[SECTION_P1_COL]   = (void **)&e->p1_col;
+   table[SECTION_P2_COL]   = (void **)&e->p2_col;
+   table[SECTION_P2_ROW]   = (void **)&e->p2_row;
+   table[SECTION_GAP_ROW]  = (void **)&e->gap_row;
+   table[SECTION_PHI_INVERSE] = (void **)&e->phi_inverse;
+   if(e->h != NULL) {
+      bytes[SECTION_INFO_POS] = sizeof(int) * (e->k > 0 ? e->k : 1);
+      bytes[SECTION_PIVOT]    = sizeof(int) * code->n_c;
+      bytes[SECTION_H]        = sizeof(uint64_t) * code->n_c * e->row_words;
+   } else {
+      bytes[SECTION_INFO_POS] = sizeof(int) * e->k;
+      bytes[SECTION_P1_COL]   = sizeof(int) * code->base_rows;
+      bytes[SECTION_P2_COL]   = sizeof(int) * code->base_rows;
+      bytes[SECTION_P2_ROW]   = sizeof(int) * code->base_rows;
+      bytes[SECTION_GAP_ROW]  = sizeof(int) * code->base_rows;
+      bytes[SECTION_PHI_INVERSE] = sizeof(uint64_t) * (n > 0 ? n : 1) * WORDS(n);
+   }
+}
+
+
+// Write the code and its encoder (which may be NULL) to a code file.
+// It is written under a temporary name and renamed into place, so
+// other processes see the whole file or none of it. Returns 0 if it
+// could not be written.
+static int code_file_write(const struct code *code, const struct encoder *e, uint64_t key,
+                           const char *filename) {
+   struct code_file h;
+   void **table[SECTION_COUNT];
+   size_t bytes[SECTION_COUNT];
+   static const char zero[ARENA_ALIGN];
+
+   memset(&h, 0, sizeof(h));
+   memcpy(h.magic, CODE_FILE_MAGIC, 8);
+   h.key            = key;
+   h.n_v            = code->n_v;
+   h.n_c            = code->n_c;
+   h.n_edges        = code->n_edges;
+   h.max_row_degree = code->max_row_degree;
+   h.z              = code->z;
+   h.base_rows      = code->base_rows;
+   h.base_cols      = code->base_cols;
+   h.block_words    = code->block_words;
+   h.hard_words     = code->hard_words;
+   h.syndrome_words = code->syndrome_words;
+   if(e != NULL) {
+      h.encoder             = e->h != NULL ? 1 : 2;
+      h.k                   = e->k;
+      h.rank                = e->rank;
+      h.row_words           = e->row_words;
+      h.encoder_block_words = e->block_words;
+      h.gap                 = e->gap;
+      h.n_p2                = e->n_p2;
+   }
+   code_file_sections((struct code *)code, (struct encoder *)e, table, bytes);
+   h.size = ARENA_ROUND(sizeof(h));
+   for(int i = 0; i < SECTION_COUNT; i++) {
+      h.offset[i] = h.size;
+      h.bytes[i]  = bytes[i];
+      h.size     += ARENA_ROUND(bytes[i]);
+   }
+
+   char *temp = malloc(strlen(filename) + 32);
+   if(temp == NULL)
+      return 0;
+   sprintf(temp, "%s.%ld.tmp", filename, (long)getpid());
+   FILE *f = fopen(temp, "wb");
+   size_t header_pad = ARENA_ROUND(sizeof(h)) - sizeof(h);
+   int ok = f != NULL && fwrite(&h, sizeof(h), 1, f) == 1 &&
+            (header_pad == 0 || fwrite(zero, header_pad, 1, f) == 1);
+   for(int i = 0; ok && i < SECTION_COUNT; i++) {
+      size_t pad = ARENA_ROUND(bytes[i]) - bytes[i];
+      ok = (bytes[i] == 0 || fwrite(*table[i], bytes[i], 1, f) == 1) &&
+           (pad == 0 || fwrite(zero, pad, 1, f) == 1);
+   }
+   if(f != NULL && fclose(f) != 0)
+      ok = 0;
+   if(ok && rename(temp, filename) != 0)
+      ok = 0;
+   if(!ok)
+      remove(temp);
+   free(temp);
+   return ok;
+}
+
+
+// Whether a mapped code's sizes fit together, before any table is
+// looked at
+static int code_file_shape(const struct code *code, int qc) {
+   int64_t n_v = code->n_v, n_c = code->n_c, z = code->z;
+
+   if(n_v <= 0 || n_c <= 0 || code->n_edges < 0 || code->max_row_degree < 0)
+      return 0;
+   if(!qc)
+      return z == 1 && code->base_rows == 0 && code->base_cols == 0 && code->block_words == 0 &&
+             code->hard_words == WORDS(n_v) && code->syndrome_words == WORDS(n_c);
+   return z > 0 && n_v == code->base_cols * z && n_c == code->base_rows * z && code->n_edges % z == 0 &&
+          code->block_words == WORDS(z) && code->hard_words == code->base_cols * code->block_words &&
+          code->syndrome_words == code->base_rows * code->block_words;
+}
+
+
+// Whether a mapped code's tables are consistent, so that a damaged
+// code file cannot send a decoder outside its buffers: the row and
+// column views hold the same edges, and every circulant's edges are
+// in range and go to the variables its shift says.
+static int code_file_valid(const struct code *code) {
+   int n_v = code->n_v, n_c = code->n_c, n_e = code->n_edges, z = code->z;
+
+   if(code->row_start[0] != 0 || code->row_start[n_c] != n_e ||
+      code->col_start[0] != 0 || code->col_start[n_v] != n_e)
+      return 0;
+   for(int c = 0; c < n_c; c++) {
+      int d = code->row_start[c+1] - code->row_start[c];
+      if(d < 0 || d > code->max_row_degree)
+         return 0;
+   }
+   for(int e = 0; e < n_e; e++) {
+      if(code->edge_v[e] < 0 || code->edge_v[e] >= n_v)
+         return 0;
+   }
+   for(int v = 0; v < n_v; v++) {
+      if(code->col_start[v+1] < code->col_start[v])
+         return 0;
+      for(int j = code->col_start[v]; j < code->col_start[v+1]; j++) {
+         int e = code->col_edge[j];
+         if(e < 0 || e >= n_e || code->edge_v[e] != v)
+            return 0;
+      }
+   }
+   if(code->base == NULL)
+      return 1;
+
+   for(int i = 0; i < code->base_rows * code->base_cols; i++) {
+      if(code->base[i] < -1 || code->base[i] >= z)
+         return 0;
+   }
+   if(code->circ_start[0] != 0 || code->circ_start[code->base_cols] != n_e / z)
+      return 0;
+   for(int j = 0; j < code->base_cols; j++) {
+      if(code->circ_start[j+1] < code->circ_start[j])
+         return 0;
+      for(int i = code->circ_start[j]; i < code->circ_start[j+1]; i++) {
+         const struct circulant *b = &code->circ[i];
+         if(b->shift < 0 || b->shift >= z || b->first < 0 || b->stride < 0 ||
+            b->first + (int64_t)(z-1) * b->stride >= n_e)
+            return 0;
+         for(int k = 0; k < z; k++) {
+            if(code->edge_v[b->first + k*b->stride] != j*z + (k + b->shift) % z)
+               return 0;
+         }
+      }
+   }
+   return 1;
+}
+
+
+// Map a code file written for 'key'. The code's tables (and, through
+// encoder_new(), the encoder's) point into the mapping, which is
+// shared with every other process that maps the same file. Returns
+// NULL if there is no such file, or it is not right, in which case
+// code_load_cached() loads the code afresh and writes a new one.
+static struct code *code_file_map(const char *filename, uint64_t key) {
+   int fd = open(filename, O_RDONLY);
+   struct stat st;
+   if(fd < 0)
+      return NULL;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct code_file)) {
+      close(fd);
+      return NULL;
+   }
+   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(map == MAP_FAILED)
+      return NULL;
+
+   const struct code_file *h = map;
+   if(memcmp(h->magic, CODE_FILE_MAGIC, 8) != 0 || h->key != key || h->size != (uint64_t)st.st_size) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+
+   struct code *code = calloc(1, sizeof(struct code));
+   if(code == NULL) {
+      munmap(map, st.st_size);
+      return NULL;
+   }
+   code->n_v            = h->n_v;
+   code->n_c            = h->n_c;
+   code->n_edges        = h->n_edges;
+   code->max_row_degree = h->max_row_degree;
+   code->z              = h->z;
+   code->base_rows      = h->base_rows;
+   code->base_cols      = h->base_cols;
+   code->block_words    = h->block_words;
+   code->hard_words     = h->hard_words;
+   code->syndrome_words = h->syndrome_words;
+   code->map            = map;
+   code->map_size       = st.st_size;
+
+   // Every table is where the header says, and the size the code's
+   // sizes say. Tables are only looked at once the sizes are known to
+   // match, and the base matrix is needed to size the others.
+   void **table[SECTION_COUNT];
+   size_t bytes[SECTION_COUNT];
+   int ok = code_file_shape(code, h->bytes[SECTION_BASE] != 0);
+   code->base = h->bytes[SECTION_BASE] ? (int *)map : NULL;
+   if(ok)
+      code_file_sections(code, NULL, table, bytes);
+   for(int i = 0; ok && i < SECTION_CIRC + 1; i++) {
+      if(h->bytes[i] != bytes[i] || h->offset[i] % ARENA_ALIGN != 0 ||
+         h->offset[i] > h->size || h->bytes[i] > h->size - h->offset[i])
+         ok = 0;
+      else
+         *table[i] = bytes[i] ? (char *)map + h->offset[i] : NULL;
+   }
+   ok = ok && code_file_valid(code);
+
+   // A damaged encoder is rebuilt the same way, by writing the whole
+   // file again
+   struct encoder *e = NULL;
+   if(ok && h->encoder != 0 && (e = encoder_map(code)) == NULL)
+      ok = 0;
+   free(e);
+   if(!ok) {
+      munmap(map, st.st_size);
+      free(code);
+      return NULL;
+   }
+   return code;
+}
+
+
+// Whether a mapped encoder's sizes fit its code, before any table is
+// looked at: Gaussian elimination (h set) has a row per check, and
+// the QC encoder splits the block rows between p2 and the gap.
+static int encoder_file_shape(const struct encoder *e) {
+   const struct code *code = e->code;
+
+   if(e->h != NULL)
+      return e->rank >= 0 && e->rank <= code->n_c && e->k == code->n_v - e->rank &&
+             e->row_words == WORDS(code->n_v);
+   return code->base != NULL && e->gap >= 0 && e->n_p2 >= 0 && e->gap + e->n_p2 == code->base_rows &&
+          e->k == (code->base_cols - code->base_rows) * code->z && e->k > 0 &&
+          e->block_words == WORDS(code->z);
+}
+
+
+// Whether a mapped encoder's tables only name bits, rows and block
+// columns that the code has, so that encoding stays in its buffers
+static int encoder_file_valid(const struct encoder *e) {
+   const struct code *code = e->code;
+
+   for(int i = 0; i < e->k; i++) {
+      if(e->info_pos[i] < 0 || e->info_pos[i] >= code->n_v)
+         return 0;
+   }
+   if(e->h != NULL) {
+      for(int i = 0; i < e->rank; i++) {
+         if(e->pivot[i] < 0 || e->pivot[i] >= code->n_v)
+            return 0;
+      }
+      return 1;
+   }
+   for(int t = 0; t < e->n_p2; t++) {
+      if(e->p2_col[t] < 0 || e->p2_col[t] >= code->base_cols ||
+         e->p2_row[t] < 0 || e->p2_row[t] >= code->base_rows ||
+         code->base[e->p2_row[t]*code->base_cols + e->p2_col[t]] < 0)
+         return 0;
+   }
+   for(int g = 0; g < e->gap; g++) {
+      if(e->p1_col[g] < 0 || e->p1_col[g] >= code->base_cols ||
+         e->gap_row[g] < 0 || e->gap_row[g] >= code->base_rows)
+         return 0;
+   }
+   return 1;
+}
+
+
+// Tables that are in range can still be wrong, so encode a few random
+// words and check that each codeword holds its data at info_pos[] and
+// meets every parity check. A wrong encoder gets through each word at
+// most half the time.
+#define ENCODER_TEST_WORDS 8
+
+static int encoder_file_encodes(const struct encoder *e) {
+   const struct code *code = e->code;
+   uint64_t *data = malloc(sizeof(uint64_t) * WORDS(e->k > 0 ? e->k : 1));
+   uint64_t *codeword = malloc(sizeof(uint64_t) * WORDS(code->n_v));
+   uint64_t *scratch = malloc(sizeof(uint64_t) * (encoder_scratch_words(e) + 1));
+   struct rng r;
+   int ok = data != NULL && codeword != NULL && scratch != NULL;
+
+   rng_seed(&r, 1);
+   for(int word = 0; ok && word < ENCODER_TEST_WORDS; word++) {
+      for(int w = 0; w < WORDS(e->k); w++)
+         data[w] = rng_next(&r);
+      encoder_encode(e, data, codeword, scratch);
+      for(int i = 0; ok && i < e->k; i++)
+         ok = bit_get(codeword, e->info_pos[i]) == bit_get(data, i);
+      for(int c = 0; ok && c < code->n_c; c++) {
+         int parity = 0;
+         for(int i = code->row_start[c]; i < code->row_start[c+1]; i++)
+            parity ^= bit_get(codeword, code->edge_v[i]);
+         ok = parity == 0;
+      }
+   }
+   free(data);
+   free(codeword);
+   free(scratch);
+   return ok;
+}
+
+
+// The encoder kept in a mapped code's file, or NULL if it has none or
+// it is not right
+static struct encoder *encoder_map(const struct code *code) {
+   const struct code_file *h = code->map;
+   if(h->encoder == 0)
+      return NULL;
+
+   struct encoder *e = calloc(1, sizeof(struct encoder));
+   if(e == NULL)
+      return NULL;
+   e->code        = code;
+   e->mapped      = 1;
+   e->k           = h->k;
+   e->rank        = h->rank;
+   e->row_words   = h->row_words;
+   e->block_words = h->encoder_block_words;
+   e->gap         = h->gap;
+   e->n_p2        = h->n_p2;
+   // The kind of encoder goes by whether h is set
+   e->h           = h->encoder == 1 ? (uint64_t *)code->map : NULL;
+
+   void **table[SECTION_COUNT];
+   size_t bytes[SECTION_COUNT];
+   int ok = (h->encoder == 1 || h->encoder == 2) && encoder_file_shape(e);
+   if(ok)
+      code_file_sections((struct code *)code, e, table, bytes);
+   for(int i = SECTION_INFO_POS; ok && i < SECTION_COUNT; i++) {
+      if(h->bytes[i] != bytes[i] || h->offset[i] % ARENA_ALIGN != 0 ||
+         h->offset[i] > h->size || h->bytes[i] > h->size - h->offset[i])
+         ok = 0;
+      else
+         *table[i] = bytes[i] ? (char *)code->map + h->offset[i] : NULL;
+   }
+   if(!ok || !encoder_file_valid(e) || !encoder_file_encodes(e)) {
+      free(e);
+      return NULL;
+   }
+   return e;
+}
+
+
+// What a code file for this source file and lifting size is written
+// for: a 64 bit FNV-1a hash of the name and the file's identity
+static uint64_t code_file_key(const char *filename, int qc, int z, const struct stat *st) {
+   uint64_t h = 0xCBF29CE484222325ull;
+   uint64_t fields[6] = { qc, (uint64_t)z, st->st_size, st->st_ino,
+                          st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+
+   for(const char *p = filename; *p; p++) {
+      h ^= (uint8_t)*p;
+      h *= 0x100000001B3ull;
+   }
+   for(int i = 0; i < 6; i++) {
+      h ^= fields[i];
+      h *= 0x100000001B3ull;
+   }
+   return h;
+}
+
+
+// Load an alist file, or a QC base matrix (if qc is set) lifted by z
+// (or the file's own Z if z is 0). With a cache directory, the code
+// file for it there is mapped if there is one, else the code and its
+// encoder are built and written there first and then mapped, so that
+// only the first load of a code does any work. Without a cache
+// directory, or if it cannot be written, the code is loaded as usual.
+struct code *code_load_cached(const char *cache_dir, const char *filename, int qc, int z) {
+   struct stat st;
+   if(cache_dir == NULL || stat(filename, &st) != 0)
+      return qc ? code_load_qc(filename, z) : code_load_alist(filename);
+
+   uint64_t key = code_file_key(filename, qc, z, &st);
+   char *name = malloc(strlen(cache_dir) + 32);
+   if(name == NULL)
+      return NULL;
+   sprintf(name, "%s/%016llx.code", cache_dir, (unsigned long long)key);
+
+   struct code *code = code_file_map(name, key);
+   if(code == NULL) {
+      code = qc ? code_load_qc(filename, z) : code_load_alist(filename);
+      if(code != NULL) {
+         struct encoder *e = encoder_new(code);
+         if(code_file_write(code, e, key, name)) {
+            struct code *mapped = code_file_map(name, key);
+            if(mapped != NULL) {
+               code_delete(code);
+               code = mapped;
+            }
+         } else {
+            fprintf(stderr, "Unable to write the code file '%s'\n", name);
+         }
+         encoder_delete(e);
+      }
+   }
+   free(name);
+   return code;
+}
+
+
+// Code registry
+//
+// Each code asked for is loaded once (through the cache directory if
+// there is one) along with its encoder, and handed out to every
+// caller until the registry is deleted. Safe to use from any number
+// of threads.
+struct registry_entry {
+   char *filename;
+   int qc;
+   int z;
+   struct code *code;
+   struct encoder *encoder;
+};
+
+struct registry {
+   char *cache_dir;
+   pthread_mutex_t lock;
+   int n_entries;
+   int max_entries;
+   struct registry_entry *entry;
+};
+
+
+struct registry *registry_new(const char *cache_dir) {
+   struct registry *r = calloc(1, sizeof(struct registry));
+   if(r == NULL)
+      return NULL;
+   if(cache_dir != NULL && (r->cache_dir = strdup(cache_dir)) == NULL) {
+      free(r);
+      return NULL;
+   }
+   pthread_mutex_init(&r->lock, NULL);
+   return r;
+}
+
+
+// Deletes every code the registry handed out too
+void registry_delete(struct registry *r) {
+   if(r == NULL)
+      return;
+   for(int i = 0; i < r->n_entries; i++) {
+      encoder_delete(r->entry[i].encoder);
+      code_delete(r->entry[i].code);
+      free(r->entry[i].filename);
+   }
+   pthread_mutex_destroy(&r->lock);
+   free(r->entry);
+   free(r->cache_dir);
+   free(r);
+}
+
+
+// The code from a file, with the same arguments as code_load_cached().
+// Returns NULL if it cannot be loaded.
+const struct code *registry_code(struct registry *r, const char *filename, int qc, int z) {
+   struct code *code = NULL;
+
+   pthread_mutex_lock(&r->lock);
+   for(int i = 0; code == NULL && i < r->n_entries; i++) {
+      struct registry_entry *entry = &r->entry[i];
+      if(entry->qc == qc && entry->z == z && !strcmp(entry->filename, filename))
+         code = entry->code;
+   }
+   if(code == NULL && r->n_entries == r->max_entries) {
+      int max = r->max_entries ? 2*r->max_entries : 16;
+      struct registry_entry *entry = realloc(r->entry, sizeof(struct registry_entry) * max);
+      if(entry != NULL) {
+         r->entry = entry;
+         r->max_entries = max;
+      }
+   }
+   if(code == NULL && r->n_entries < r->max_entries &&
+      (code = code_load_cached(r->cache_dir, filename, qc, z)) != NULL) {
+      struct registry_entry *entry = &r->entry[r->n_entries];
+      entry->filename = strdup(filename);
+      entry->qc       = qc;
+      entry->z        = z;
+      entry->code     = code;
+      entry->encoder  = NULL;
+      if(entry->filename != NULL) {
+         r->n_entries++;
+      } else {
+         code_delete(code);
+         code = NULL;
+      }
+   }
+   pthread_mutex_unlock(&r->lock);
+   return code;
+}
+
+
+// The encoder for a code from the registry, made the first time it
+// is asked for. Returns NULL if the code has no encoder.
+const struct encoder *registry_encoder(struct registry *r, const struct code *code) {
+   struct encoder *e = NULL;
+
+   pthread_mutex_lock(&r->lock);
+   for(int i = 0; i < r->n_entries; i++) {
+      struct registry_entry *entry = &r->entry[i];
+      if(entry->code == code) {
+         if(entry->encoder == NULL)
+            entry->encoder = encoder_new(code);
+         e = entry->encoder;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&r->lock);
+   return e;
+}
+
+
+// Random numbers for the simulation and benchmark
+//
+// xoshiro256** seeded with splitmix64. rng_stream() gives each frame
+// a stream of its own from a seed, a point and a frame number, so
+// results do not depend on which thread made which frame.
+static uint64_t splitmix64(uint64_t *x) {
+   uint64_t z = (*x += 0x9E3779B97F4A7C15ull);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+   return z ^ (z >> 31);
+}
+
+
+void rng_seed(struct rng *r, uint64_t seed) {
+   for(int i = 0; i < 4; i++) {
+      r->s[i] = splitmix64(&seed);
+   }
+}
+
+
+// Seed the stream for one frame. Each key is hashed in turn, so
+// nearby seeds do not just shuffle the same set of streams.
+void rng_stream(struct rng *r, uint64_t seed, uint64_t point, uint64_t frame) {
+   uint64_t x = seed;
+   x = splitmix64(&x) ^ point;
+   x = splitmix64(&x) ^ frame;
+   rng_seed(r, x);
+}
+
+
+static uint64_t rotl(uint64_t x, int k) {
+   return (x << k) | (x >> (64 - k));
+}
+
+
+uint64_t rng_next(struct rng *r) {
+   uint64_t *s = r->s;
+   uint64_t result = rotl(s[1] * 5, 7) * 9;
+   uint64_t t = s[1] << 17;
+   s[2] ^= s[0];
+   s[3] ^= s[1];
+   s[1] ^= s[2];
+   s[0] ^= s[3];
+   s[2] ^= t;
+   s[3] = rotl(s[3], 45);
+   return result;
+}
+
+
+// 1/sqrt(x) for x >= 0, from the usual bit level first guess and
+// three Newton steps, which is good to float precision. 0 gives a
+// large finite value, so x times it is still 0.
+static inline __attribute__((always_inline))
+void lanes_rsqrt(lanes_f *x) {
+   lanes_f h = *x * 0.5f;
+   lanes_f y = (lanes_f)(0x5F3759DF - ((lanes_i)*x >> 1));
+   for(int i = 0; i < 3; i++)
+      y = y * (1.5f - h * y * y);
+   *x = y;
+}
+
+
+// sin and cos of 2 pi u for u in [0, 1). 4u = q + f with q the
+// nearest quadrant and f in [-1/2, 1/2], so the degree 9 and 8
+// series in f pi/2 give sin and cos to about 3e-8, and the quadrant
+// then swaps them and sets their signs.
+static inline __attribute__((always_inline))
+void lanes_sincos_2pi(lanes_f *u, lanes_f *c) {
+   lanes_f t  = *u * 4.0f;
+   lanes_i q  = __builtin_convertvector(t + 0.5f, lanes_i);
+   lanes_f a  = (t - __builtin_convertvector(q, lanes_f)) * 1.57079633f;
+   lanes_f a2 = a * a;
+   lanes_f sn = a2 * (1.0f/362880);
+   sn = (sn - 1.0f/5040) * a2;
+   sn = (sn + 1.0f/120) * a2;
+   sn = (sn - 1.0f/6) * a2;
+   sn = (sn + 1.0f) * a;
+   lanes_f cs = a2 * (1.0f/40320);
+   cs = (cs - 1.0f/720) * a2;
+   cs = (cs + 1.0f/24) * a2;
+   cs = (cs - 0.5f) * a2 + 1.0f;
+   lanes_i odd = (q & 1) != 0;
+   *u = (lanes_f)((lanes_i)lanes_select(odd, cs, sn) ^ (((q & 2) != 0) & LANE_SIGN));
+   *c = (lanes_f)((lanes_i)lanes_select(odd, sn, cs) ^ ((((q + 1) & 2) != 0) & LANE_SIGN));
+}
+
+
+// Fill out[] with n samples from N(0,1). The uniforms are made first
+// as a block, then turned into normals with Box-Muller a vector of
+// lanes at a time, with log(), sqrt() and sincos() from the
+// polynomials above rather than libm, which the compiler cannot
+// vectorize. Against libm the normals are within about 1e-6.
+#define RNG_BLOCK (256 / BATCH_LANES)
+
+BATCH_TARGETS
+void rng_gaussian(struct rng *r, float *out, int n) {
+   int pairs = (n + 1) / 2;
+   lanes_f u1[RNG_BLOCK], u2[RNG_BLOCK];
+   float *f1 = (float *)u1, *f2 = (float *)u2;
+
+   for(int base = 0; base < pairs; base += 256) {
+      int m = pairs - base < 256 ? pairs - base : 256;
+      int vectors = (m + BATCH_LANES - 1) / BATCH_LANES;
+      for(int i = 0; i < m; i++) {
+         uint64_t x = rng_next(r);
+         f1[i] = ((x >> 40) + 1) * (1.0f / 16777216.0f);          // (0, 1]
+         f2[i] = ((x >> 16) & 0xFFFFFF) * (1.0f / 16777216.0f);   // [0, 1)
+      }
+      for(int i = m; i < vectors * BATCH_LANES; i++) {
+         f1[i] = 1.0f;
+         f2[i] = 0.0f;
+      }
+      for(int v = 0; v < vectors; v++) {
+         lanes_f radius = u1[v];
+         lanes_log(&radius);
+         radius = radius * -2.0f;
+         lanes_f scale = radius;
+         lanes_rsqrt(&scale);
+         radius = radius * scale;
+         lanes_f c;
+         lanes_sincos_2pi(&u2[v], &c);
+         u1[v] = radius * c;
+         u2[v] = radius * u2[v];
+      }
+      for(int i = 0; i < m; i++) {
+         int k = 2*(base + i);
+         out[k] = f1[i];
+         if(k+1 < n)
+            out[k+1] = f2[i];
+      }
+   }
+}
+
+